@@ -0,0 +1,238 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+/* Load generator for the benchmark harness. Appends lines to a set of
+ * files at a steady rate, optionally rotating them, and prints how much
+ * it wrote. Every line carries the index of its file, a sequence number
+ * and the wall clock time it was written, which the sink uses to spot
+ * loss and measure latency:
+ *
+ *   narcbench <file> <seq> <microseconds> xxxxxxxx...
+ */
+
+#include <errno.h>	/* error numbers */
+#include <fcntl.h>	/* file control options */
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <sys/time.h>	/* time types */
+#include <time.h>	/* time types */
+#include <unistd.h>	/* standard symbolic constants and types */
+
+#define LOADGEN_TICK		10	/* milliseconds between batches */
+#define LOADGEN_MAX_FILES	1024
+#define LOADGEN_MAX_LINE	65536
+#define LOADGEN_BATCH		1000	/* lines per batch when unthrottled */
+#define LOADGEN_FRAME		"\tat narcbench.frame\n"	/* a continuation line */
+
+#define ROTATE_RENAME		1
+#define ROTATE_TRUNCATE		2
+
+typedef struct {
+	char			path[1024];
+	int			fd;
+	unsigned long long	seq;
+	unsigned long long	size;
+} loadgen_file;
+
+static char		*dir = ".";
+static int		nfiles = 1;
+static long		rate = 1000;
+static int		line_size = 200;
+static double		duration = 10;
+static unsigned long long rotate_bytes = 0;
+static int		rotate_mode = ROTATE_RENAME;
+static int		frames = 0;	/* continuation lines after every line */
+
+static loadgen_file	files[LOADGEN_MAX_FILES];
+
+/*============================ Utility functions ============================ */
+
+static unsigned long long
+now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: narc-loadgen [options]\n");
+	fprintf(stderr, "  -d <dir>     directory holding the files (.)\n");
+	fprintf(stderr, "  -n <files>   number of files, named bench<n>.log (1)\n");
+	fprintf(stderr, "  -r <rate>    lines per second per file, 0 for unthrottled (1000)\n");
+	fprintf(stderr, "  -s <bytes>   line size including the newline (200)\n");
+	fprintf(stderr, "  -t <secs>    run time (10)\n");
+	fprintf(stderr, "  -R <bytes>   rotate a file once it grows past this size (never)\n");
+	fprintf(stderr, "  -m <mode>    rotate by 'rename' or 'truncate' (rename)\n");
+	fprintf(stderr, "  -M <lines>   continuation lines following every line (0)\n");
+	exit(1);
+}
+
+static void
+open_file(loadgen_file *file)
+{
+	file->fd = open(file->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (file->fd == -1) {
+		fprintf(stderr, "Can't open %s: %s\n", file->path, strerror(errno));
+		exit(1);
+	}
+	file->size = lseek(file->fd, 0, SEEK_END);
+}
+
+static void
+rotate_file(loadgen_file *file)
+{
+	char rotated[1040];
+
+	switch (rotate_mode) {
+	case ROTATE_RENAME :
+		snprintf(rotated, sizeof(rotated), "%s.1", file->path);
+		rename(file->path, rotated);
+		close(file->fd);
+		open_file(file);
+		break;
+	case ROTATE_TRUNCATE :
+		if (ftruncate(file->fd, 0) == -1)
+			perror("ftruncate");
+		file->size = 0;
+		break;
+	}
+}
+
+/* Append count lines to the file with a single write. */
+static unsigned long long
+write_lines(loadgen_file *file, int index, long count, char *buf)
+{
+	unsigned long long stamp = now_us();
+	size_t len = 0;
+	long i;
+	int n;
+
+	for (i = 0; i < count; i++) {
+		n = snprintf(buf + len, line_size, "narcbench %d %llu %llu ",
+			index, file->seq++, stamp);
+		if (n < line_size - 1)
+			memset(buf + len + n, 'x', line_size - 1 - n);
+		buf[len + line_size - 1] = '\n';
+		len += line_size;
+		// a multi-line record, like a stack trace
+		for (n = 0; n < frames; n++) {
+			memcpy(buf + len, LOADGEN_FRAME, sizeof(LOADGEN_FRAME) - 1);
+			len += sizeof(LOADGEN_FRAME) - 1;
+		}
+	}
+
+	if (write(file->fd, buf, len) != (ssize_t)len) {
+		perror("write");
+		exit(1);
+	}
+	file->size += len;
+
+	if (rotate_bytes > 0 && file->size >= rotate_bytes)
+		rotate_file(file);
+
+	return len;
+}
+
+/*================================= Main ==================================== */
+
+int
+main(int argc, char **argv)
+{
+	unsigned long long start, now, end, lines = 0, bytes = 0;
+	struct timespec tick = { 0, LOADGEN_TICK * 1000000 };
+	long batch, due;
+	char *buf;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:n:r:s:t:R:m:M:h")) != -1) {
+		switch (opt) {
+		case 'd': dir = optarg; break;
+		case 'n': nfiles = atoi(optarg); break;
+		case 'r': rate = atol(optarg); break;
+		case 's': line_size = atoi(optarg); break;
+		case 't': duration = atof(optarg); break;
+		case 'M': frames = atoi(optarg); break;
+		case 'R': rotate_bytes = strtoull(optarg, NULL, 10); break;
+		case 'm':
+			if (!strcmp(optarg, "rename")) rotate_mode = ROTATE_RENAME;
+			else if (!strcmp(optarg, "truncate")) rotate_mode = ROTATE_TRUNCATE;
+			else usage();
+			break;
+		default: usage();
+		}
+	}
+
+	/* the header alone takes up to 60 bytes */
+	if (nfiles < 1 || nfiles > LOADGEN_MAX_FILES || rate < 0 ||
+	    line_size < 64 || line_size > LOADGEN_MAX_LINE || duration <= 0 || frames < 0)
+		usage();
+
+	for (i = 0; i < nfiles; i++) {
+		snprintf(files[i].path, sizeof(files[i].path), "%s/bench%d.log", dir, i);
+		files[i].seq = 0;
+		open_file(&files[i]);
+	}
+
+	/* room for a few ticks worth of lines, to catch up after oversleeping */
+	batch = rate > 0 ? rate * LOADGEN_TICK * 4 / 1000 + 1 : LOADGEN_BATCH;
+	buf = malloc((size_t)batch * (line_size + frames * (sizeof(LOADGEN_FRAME) - 1)));
+
+	start = now_us();
+	end = start + (unsigned long long)(duration * 1000000);
+
+	while ((now = now_us()) < end) {
+		for (i = 0; i < nfiles; i++) {
+			if (rate > 0) {
+				/* catch up with the schedule, a batch at a time */
+				due = (long)((now - start) * rate / 1000000) - (long)files[i].seq;
+				if (due > batch)
+					due = batch;
+			} else
+				due = batch;
+
+			if (due <= 0)
+				continue;
+
+			bytes += write_lines(&files[i], i, due, buf);
+			lines += due;
+		}
+		if (rate > 0)
+			nanosleep(&tick, NULL);
+	}
+
+	for (i = 0; i < nfiles; i++)
+		close(files[i].fd);
+	free(buf);
+
+	printf("lines:%llu\n", lines);
+	printf("bytes:%llu\n", bytes);
+	printf("seconds:%.3f\n", (now_us() - start) / 1e6);
+	return 0;
+}
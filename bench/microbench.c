@@ -0,0 +1,649 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+/* Microbenchmarks for the per line work narcd does, run over a corpus of
+ * real shaped log lines. Each kernel reports the time per line and the
+ * throughput, and is compared against a baseline file so a regression
+ * stands out:
+ *
+ *   narc-microbench -c corpus.log -b baseline.txt
+ *
+ * -w rewrites the baseline with the numbers of the current run.
+ *
+ * -z instead compares the ways narcd can compress the corpus: each
+ * message alone, with a dictionary, in small batches and as one stream.
+ * The dictionary is trained on the first half of the corpus and the
+ * ratio measured on the second, unless one is given with -D.
+ *
+ * -f instead runs the filter and the header formatting behind it over
+ * the corpus, without filters and with the noise rules as literals and
+ * as globs, to show what filtering saves in cpu and bytes shipped. */
+
+#include "narc.h"
+#include "sds.h"
+#include "util.h"
+#include "crc64.h"
+#include "compress.h"
+#include "filter.h"
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <time.h>	/* time types */
+#include <unistd.h>	/* standard symbolic constants and types */
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>	/* zstd compression */
+#include <zdict.h>	/* zstd dictionary training */
+#endif
+
+#define MICROBENCH_MIN_TIME	200000000ULL	/* nanoseconds per kernel */
+#define MICROBENCH_MIN_PASSES	3
+#define MICROBENCH_MAX_KERNELS	16
+#define MICROBENCH_THRESHOLD	10.0		/* percent slower to flag */
+#define MICROBENCH_ROUNDS	5		/* turns each filter mode takes */
+
+typedef struct {
+	const char	*name;
+	uint64_t	(*run)(void);		/* one pass over the corpus */
+	double		ns_per_line;
+	double		mb_per_sec;
+} microbench_kernel;
+
+typedef struct {
+	char		name[64];
+	double		ns_per_line;
+} microbench_baseline;
+
+static char		*corpus;		/* the corpus, newline separated */
+static size_t		corpus_len;
+static char		**lines;		/* each line, NUL terminated */
+static int		*line_lens;
+static int		nlines;
+
+static volatile uint64_t sink;			/* keeps results alive */
+
+/* Health checks and debug noise, the lines filters are meant to drop */
+static const char	*noise[] = { "kube-probe", "GET /healthz", "\"level\": \"debug\"", NULL };
+static narc_filter	*literal_filter;	/* the noise as literal rules */
+static narc_filter	*glob_filter;		/* the noise as glob rules */
+
+/*============================ Utility functions ============================ */
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+load_corpus(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char *line;
+	long size;
+	int i;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	corpus = malloc(size + 1);
+	corpus_len = fread(corpus, 1, size, fp);
+	corpus[corpus_len] = '\0';
+	fclose(fp);
+
+	for (i = 0, nlines = 0; i < (int)corpus_len; i++)
+		if (corpus[i] == '\n')
+			nlines++;
+
+	lines = malloc(sizeof(char *) * nlines);
+	line_lens = malloc(sizeof(int) * nlines);
+	line = corpus;
+	for (i = 0; i < nlines; i++) {
+		char *end = strchr(line, '\n');
+		line_lens[i] = end - line;
+		lines[i] = malloc(line_lens[i] + 1);
+		memcpy(lines[i], line, line_lens[i]);
+		lines[i][line_lens[i]] = '\0';
+		line = end + 1;
+	}
+}
+
+static void
+load_filters(void)
+{
+	int i;
+
+	literal_filter = new_filter();
+	glob_filter = new_filter();
+	for (i = 0; noise[i] != NULL; i++) {
+		sds glob = sdscatprintf(sdsempty(), "*%s*", noise[i]);
+
+		filter_add_rule(literal_filter, NARC_FILTER_EXCLUDE, NARC_FILTER_LITERAL, (char *)noise[i]);
+		filter_add_rule(glob_filter, NARC_FILTER_EXCLUDE, NARC_FILTER_GLOB, glob);
+		sdsfree(glob);
+	}
+	compile_filter(literal_filter);
+	compile_filter(glob_filter);
+}
+
+/*================================ Kernels ================================== */
+
+/* Mirrors the read loop of handle_file_read: the corpus comes in read
+ * sized chunks and is copied into the line buffer byte by byte. The
+ * first byte of every line goes into the result, or the copy would be
+ * optimized away. */
+static uint64_t
+bench_split(void)
+{
+	char line[NARC_MAX_LOGMSG_LEN+1];
+	size_t offset, chunk, i;
+	uint64_t count = 0;
+	int index = 0;
+
+	for (offset = 0; offset < corpus_len; offset += chunk) {
+		char *buf = corpus + offset;
+
+		chunk = corpus_len - offset;
+		if (chunk > NARC_MAX_BUFF_SIZE - 1)
+			chunk = NARC_MAX_BUFF_SIZE - 1;
+
+		for (i = 0; i < chunk; i++) {
+			if (buf[i] == '\n' || index == NARC_MAX_MESSAGE_SIZE - 1) {
+				line[index] = '\0';
+				count += index + (unsigned char)line[0];
+				index = 0;
+			} else {
+				line[index] = buf[i];
+				index += 1;
+			}
+		}
+	}
+	return count;
+}
+
+/* The syslog header handle_message puts in front of a line, the bytes
+ * it ships. */
+static size_t
+format_line(int i)
+{
+	sds message = sdscatprintf(sdsempty(), "<%d>%s %s %s %s\n",
+		LOG_USER + LOG_ERR, "Oct 19 01:02:03", "host1", "app[web]", lines[i]);
+	size_t len = sdslen(message);
+
+	sdsfree(message);
+	return len;
+}
+
+static uint64_t
+bench_format(void)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < nlines; i++)
+		count += format_line(i);
+	return count;
+}
+
+/* Joining multi-line records and remembering the previous line for the
+ * duplicate check, both into reused strings. */
+static uint64_t
+bench_sds(void)
+{
+	sds record = sdsempty(), previous = sdsempty();
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < nlines; i++) {
+		if (i % 8 == 0) {
+			count += sdslen(record);
+			sdsclear(record);
+		} else
+			record = sdscatlen(record, "\n", 1);
+		record = sdscatlen(record, lines[i], line_lens[i]);
+
+		if (sdslen(previous) == (size_t)line_lens[i] &&
+		    memcmp(previous, lines[i], line_lens[i]) == 0)
+			count++;
+		previous = sdscpylen(previous, lines[i], line_lens[i]);
+	}
+	sdsfree(record);
+	sdsfree(previous);
+	return count;
+}
+
+/* A multi-line start pattern and a filter glob on every line. */
+static uint64_t
+bench_stringmatch(void)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < nlines; i++) {
+		count += stringmatchlen("[0-9][0-9][0-9][0-9]-*", 22, lines[i], line_lens[i], 0);
+		count += stringmatchlen("*error*", 7, lines[i], line_lens[i], 1);
+	}
+	return count;
+}
+
+/* The hash behind sampling decisions. */
+static uint64_t
+bench_crc64(void)
+{
+	uint64_t hash = 0;
+	int i;
+
+	for (i = 0; i < nlines; i++)
+		hash ^= crc64(0, (unsigned char *)lines[i], line_lens[i]);
+	return hash;
+}
+
+/* The noise rules as literals, one pass of the automaton per line. */
+static uint64_t
+bench_filter(void)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < nlines; i++)
+		count += filter_match(literal_filter, lines[i], line_lens[i]);
+	return count;
+}
+
+/* The same rules as globs, one stringmatchlen per rule and line. */
+static uint64_t
+bench_filterglob(void)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0; i < nlines; i++)
+		count += filter_match(glob_filter, lines[i], line_lens[i]);
+	return count;
+}
+
+static microbench_kernel kernels[] = {
+	{ "split", bench_split, 0, 0 },
+	{ "format", bench_format, 0, 0 },
+	{ "sds", bench_sds, 0, 0 },
+	{ "stringmatch", bench_stringmatch, 0, 0 },
+	{ "crc64", bench_crc64, 0, 0 },
+	{ "filter", bench_filter, 0, 0 },
+	{ "filterglob", bench_filterglob, 0, 0 },
+	{ NULL, NULL, 0, 0 }
+};
+
+static void
+run_kernel(microbench_kernel *kernel)
+{
+	uint64_t start = now_ns(), elapsed;
+	int passes = 0;
+
+	kernel->run();	/* warm up */
+	do {
+		sink += kernel->run();
+		passes++;
+		elapsed = now_ns() - start;
+	} while (elapsed < MICROBENCH_MIN_TIME || passes < MICROBENCH_MIN_PASSES);
+
+	kernel->ns_per_line = (double)elapsed / ((double)passes * nlines);
+	kernel->mb_per_sec = ((double)corpus_len * passes / (1024 * 1024)) / (elapsed / 1e9);
+}
+
+/*=============================== Filtering ================================= */
+
+/* What a stream does per line: drop it, or format it and ship it. */
+static size_t
+filter_pass(narc_filter *filter, int *kept)
+{
+	size_t shipped = 0;
+	int i;
+
+	*kept = 0;
+	for (i = 0; i < nlines; i++) {
+		if (filter != NULL && !filter_match(filter, lines[i], line_lens[i]))
+			continue;
+		shipped += format_line(i);
+		*kept += 1;
+	}
+	return shipped;
+}
+
+static int
+filter_report(void)
+{
+	struct {
+		const char	*name;
+		narc_filter	*filter;
+	} modes[] = {
+		{ "none", NULL },
+		{ "literal", literal_filter },
+		{ "glob", glob_filter },
+		{ NULL, NULL }
+	};
+	double best[4], base_bytes = 0;
+	size_t shipped[4];
+	int kept[4], round, i;
+
+	printf("corpus: %d lines, %zu bytes, excluding", nlines, corpus_len);
+	for (i = 0; noise[i] != NULL; i++)
+		printf(" '%s'", noise[i]);
+	printf("\n%-10s %10s %12s %12s %10s %10s\n",
+		"filter", "kept", "ns/line", "bytes/line", "cpu", "bytes");
+
+	/* the modes take turns and keep their best round, so a noisy
+	 * machine does not favour whichever ran in a quiet moment */
+	for (round = 0; round < MICROBENCH_ROUNDS; round++) {
+		for (i = 0; modes[i].name != NULL; i++) {
+			uint64_t start = now_ns(), elapsed;
+			int passes = 0;
+			double ns;
+
+			do {
+				shipped[i] = filter_pass(modes[i].filter, &kept[i]);
+				passes++;
+				elapsed = now_ns() - start;
+			} while (elapsed < MICROBENCH_MIN_TIME || passes < MICROBENCH_MIN_PASSES);
+
+			ns = (double)elapsed / ((double)passes * nlines);
+			if (round == 0 || ns < best[i])
+				best[i] = ns;
+		}
+	}
+
+	base_bytes = shipped[0];
+	for (i = 0; modes[i].name != NULL; i++)
+		printf("%-10s %10d %12.2f %12.1f %+9.1f%% %+9.1f%%\n", modes[i].name, kept[i], best[i],
+			(double)shipped[i] / nlines,
+			100.0 * (best[i] - best[0]) / best[0],
+			100.0 * (shipped[i] - base_bytes) / base_bytes);
+	return 0;
+}
+
+/*============================== Compression ================================ */
+
+#ifdef HAVE_ZSTD
+typedef struct {
+	const char	*name;
+	int		batch;		/* messages per frame, 0 for one stream */
+	int		dictionary;
+} microbench_codec;
+
+static microbench_codec codecs[] = {
+	{ "message", 1, 0 },		/* a datagram per message */
+	{ "message+dict", 1, 1 },
+	{ "batch", 16, 0 },		/* a packed datagram */
+	{ "batch+dict", 16, 1 },
+	{ "stream", 0, 0 },		/* the tcp stream, flushed every batch */
+	{ "stream+dict", 0, 1 },
+	{ NULL, 0, 0 }
+};
+
+/* One pass over lines [first, last), the bytes it compressed to. */
+static size_t
+compress_pass(ZSTD_CCtx *cctx, microbench_codec *codec, int first, int last, char *out, size_t room)
+{
+	char batch[16 * (NARC_MAX_MESSAGE_SIZE + 1)];
+	size_t total = 0, len = 0;
+	int i, size = codec->batch ? codec->batch : 16;
+
+	if (codec->batch == 0)
+		ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+
+	for (i = first; i < last; i++) {
+		int n = line_lens[i] < NARC_MAX_MESSAGE_SIZE ? line_lens[i] : NARC_MAX_MESSAGE_SIZE;
+
+		memcpy(batch + len, lines[i], n);
+		len += n;
+		batch[len++] = '\n';
+		if ((i - first + 1) % size && i != last - 1)
+			continue;
+
+		if (codec->batch) {
+			total += ZSTD_compress2(cctx, out, room, batch, len);
+		} else {
+			ZSTD_inBuffer in = {batch, len, 0};
+			ZSTD_outBuffer buf = {out, room, 0};
+			ZSTD_compressStream2(cctx, &buf, &in, ZSTD_e_flush);
+			total += buf.pos;
+		}
+		len = 0;
+	}
+	return total;
+}
+
+static int
+compression_report(const char *dict_path)
+{
+	int first = nlines / 2, i;
+	size_t plain = 0, room = ZSTD_compressBound(sizeof(char) * 16 * (NARC_MAX_MESSAGE_SIZE + 1));
+	char *out = malloc(room), *dict;
+	size_t dict_len;
+	ZSTD_CDict *cdict;
+	microbench_codec *codec;
+
+	if (dict_path != NULL) {
+		FILE *fp = fopen(dict_path, "r");
+
+		if (fp == NULL) {
+			perror(dict_path);
+			return 1;
+		}
+		dict = malloc(NARC_DICTIONARY_SIZE);
+		dict_len = fread(dict, 1, NARC_DICTIONARY_SIZE, fp);
+		fclose(fp);
+		first = 0;
+	} else {
+		/* train on the first half, each line a sample, like narcd does */
+		size_t *sizes = malloc(sizeof(size_t) * first), train = 0, capacity;
+		char *samples = malloc(corpus_len);
+
+		for (i = 0; i < first; i++) {
+			memcpy(samples + train, lines[i], line_lens[i]);
+			sizes[i] = line_lens[i];
+			train += line_lens[i];
+		}
+		/* about a tenth of the samples, as zdict wants plenty of them */
+		capacity = train / 10 < NARC_DICTIONARY_SIZE ? train / 10 : NARC_DICTIONARY_SIZE;
+		dict = malloc(capacity);
+		dict_len = ZDICT_trainFromBuffer(dict, capacity, samples, sizes, first);
+		free(samples);
+		free(sizes);
+		if (ZDICT_isError(dict_len)) {
+			fprintf(stderr, "Can't train a dictionary: %s\n", ZDICT_getErrorName(dict_len));
+			return 1;
+		}
+	}
+	cdict = ZSTD_createCDict(dict, dict_len, NARC_DEFAULT_ZSTD_LEVEL);
+
+	for (i = first; i < nlines; i++)
+		plain += (line_lens[i] < NARC_MAX_MESSAGE_SIZE ? line_lens[i] : NARC_MAX_MESSAGE_SIZE) + 1;
+
+	printf("corpus: %d lines, %zu bytes measured, %zu bytes dictionary%s\n", nlines - first, plain,
+		dict_len, dict_path ? "" : " trained on the first half");
+	printf("%-14s %12s %12s %14s\n", "mode", "ratio", "ns/message", "bytes/message");
+	printf("%-14s %12.2f %12.2f %14.1f\n", "none", 1.0, 0.0, (double)plain / (nlines - first));
+
+	for (codec = codecs; codec->name; codec++) {
+		ZSTD_CCtx *cctx = ZSTD_createCCtx();
+		uint64_t start, elapsed;
+		size_t compressed = 0;
+		int passes = 0;
+
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, NARC_DEFAULT_ZSTD_LEVEL);
+		if (codec->dictionary)
+			ZSTD_CCtx_refCDict(cctx, cdict);
+
+		start = now_ns();
+		do {
+			compressed = compress_pass(cctx, codec, first, nlines, out, room);
+			passes++;
+			elapsed = now_ns() - start;
+		} while (elapsed < MICROBENCH_MIN_TIME || passes < MICROBENCH_MIN_PASSES);
+
+		printf("%-14s %12.2f %12.2f %14.1f\n", codec->name,
+			(double)plain / compressed,
+			(double)elapsed / ((double)passes * (nlines - first)),
+			(double)compressed / (nlines - first));
+		ZSTD_freeCCtx(cctx);
+	}
+
+	ZSTD_freeCDict(cdict);
+	free(dict);
+	free(out);
+	return 0;
+}
+#else
+static int
+compression_report(const char *dict_path)
+{
+	fprintf(stderr, "narc-microbench was built without zstd\n");
+	return 1;
+}
+#endif
+
+/*================================ Baseline ================================= */
+
+static int
+load_baseline(const char *path, microbench_baseline *baseline)
+{
+	FILE *fp = fopen(path, "r");
+	char buf[256];
+	int count = 0;
+
+	if (fp == NULL)
+		return 0;
+
+	while (fgets(buf, sizeof(buf), fp) && count < MICROBENCH_MAX_KERNELS) {
+		if (buf[0] == '#')
+			continue;
+		if (sscanf(buf, "%63s %lf", baseline[count].name, &baseline[count].ns_per_line) == 2)
+			count++;
+	}
+	fclose(fp);
+	return count;
+}
+
+static void
+write_baseline(const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	microbench_kernel *kernel;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(fp, "# narc-microbench baseline: kernel ns_per_line mb_per_sec\n");
+	for (kernel = kernels; kernel->name; kernel++)
+		fprintf(fp, "%s %.2f %.1f\n", kernel->name, kernel->ns_per_line, kernel->mb_per_sec);
+	fclose(fp);
+}
+
+/*================================= Main ==================================== */
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: narc-microbench [-c corpus] [-b baseline] [-w] [kernel ...]\n");
+	fprintf(stderr, "       narc-microbench [-c corpus] -z [-D dictionary]\n");
+	fprintf(stderr, "       narc-microbench [-c corpus] -f\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	microbench_baseline baseline[MICROBENCH_MAX_KERNELS];
+	microbench_kernel *kernel;
+	char *corpus_path = "corpus.log", *baseline_path = NULL, *dict_path = NULL;
+	int opt, rewrite = 0, compression = 0, filtering = 0, nbaseline = 0, regressions = 0, i, j;
+
+	while ((opt = getopt(argc, argv, "c:b:wzD:fh")) != -1) {
+		switch (opt) {
+		case 'c': corpus_path = optarg; break;
+		case 'b': baseline_path = optarg; break;
+		case 'w': rewrite = 1; break;
+		case 'z': compression = 1; break;
+		case 'D': dict_path = optarg; break;
+		case 'f': filtering = 1; break;
+		default: usage();
+		}
+	}
+
+	load_corpus(corpus_path);
+	load_filters();
+	if (compression)
+		return compression_report(dict_path);
+	if (filtering)
+		return filter_report();
+	if (baseline_path && !rewrite)
+		nbaseline = load_baseline(baseline_path, baseline);
+
+	printf("corpus: %d lines, %zu bytes\n", nlines, corpus_len);
+	printf("%-12s %12s %12s %10s\n", "kernel", "ns/line", "MB/s", "baseline");
+
+	for (kernel = kernels; kernel->name; kernel++) {
+		if (optind < argc) {
+			for (i = optind; i < argc; i++)
+				if (!strcmp(argv[i], kernel->name))
+					break;
+			if (i == argc)
+				continue;
+		}
+
+		run_kernel(kernel);
+		printf("%-12s %12.2f %12.1f", kernel->name, kernel->ns_per_line, kernel->mb_per_sec);
+
+		for (j = 0; j < nbaseline; j++) {
+			if (strcmp(baseline[j].name, kernel->name))
+				continue;
+			double delta = 100.0 * (kernel->ns_per_line - baseline[j].ns_per_line) / baseline[j].ns_per_line;
+			printf(" %+9.1f%%", delta);
+			if (delta > MICROBENCH_THRESHOLD) {
+				printf("  REGRESSION");
+				regressions++;
+			}
+		}
+		printf("\n");
+	}
+
+	if (rewrite && baseline_path)
+		write_baseline(baseline_path);
+
+	if (regressions)
+		printf("%d kernel(s) more than %.0f%% slower than the baseline\n",
+			regressions, MICROBENCH_THRESHOLD);
+	return 0;
+}
@@ -0,0 +1,159 @@
+#!/bin/sh
+#
+# End to end benchmark: narc-loadgen appends to a set of files, narcd
+# ships them to narc-sink, and the numbers of the three are combined in
+# a report. Tune the run through the environment:
+#
+#   PROTO=tcp|udp|syslog  FILES=4  RATE=10000 (lines/sec per file, 0 unthrottled)
+#   SIZE=200 (bytes per line)  DURATION=10  ROTATE=0 (bytes, 0 never)
+#   ROTATE_MODE=rename|truncate  PORT=15514  EXTRA_CONF=file
+#   VERIFY=1 (compare the delivery digests of narcd and the sink)
+#   FRAMING=newline|octet-counting (tcp only)  FORMAT=rfc3164|rfc5424
+#   CONNECTIONS=1 (tcp connections narcd opens to the sink)
+#   MULTILINE=0 (continuation lines narcd joins into every message)
+#   HOST=127.0.0.1 (remote-host, the sink listens on ADDRESS, default HOST)
+#   SINK_COST=0 (microseconds the sink spends per message, per connection)
+#   COMPRESSION=zstd|lz4 (tcp, or zstd over udp)  DICTIONARY=file (zstd)
+#   FILTER=literal|glob (every stream filters out the lines of the last file)
+#
+# usage: run.sh [path/to/narcd]
+
+NARCD=${1:-../src/narcd}
+BIN=${BENCH_BIN:-.}
+PROTO=${PROTO:-tcp}
+FILES=${FILES:-4}
+RATE=${RATE:-10000}
+SIZE=${SIZE:-200}
+DURATION=${DURATION:-10}
+ROTATE=${ROTATE:-0}
+ROTATE_MODE=${ROTATE_MODE:-rename}
+PORT=${PORT:-15514}
+MULTILINE=${MULTILINE:-0}
+HOST=${HOST:-127.0.0.1}
+ADDRESS=${ADDRESS:-$HOST}
+
+DIR=$(mktemp -d /tmp/narc-bench.XXXXXX) || exit 1
+trap 'kill $NARC_PID $SINK_PID 2>/dev/null; rm -rf $DIR' EXIT
+
+cat > $DIR/narc.conf <<EOC
+loglevel warning
+logfile $DIR/narc.log
+pidfile $DIR/narc.pid
+remote-host $HOST
+remote-port $PORT
+remote-proto $PROTO
+stream-id bench
+rate-limit 1000000000
+EOC
+i=0
+while [ $i -lt $FILES ]; do
+	: > $DIR/bench$i.log
+	echo "stream bench[$i] $DIR/bench$i.log" >> $DIR/narc.conf
+	[ "$MULTILINE" -gt 0 ] && echo "stream-multiline bench[$i] start \"narcbench *\"" >> $DIR/narc.conf
+	case "$FILTER" in
+		literal) echo "stream-filter bench[$i] exclude literal \"narcbench $((FILES-1)) \"" >> $DIR/narc.conf ;;
+		glob) echo "stream-filter bench[$i] exclude glob \"narcbench $((FILES-1)) *\"" >> $DIR/narc.conf ;;
+	esac
+	i=$((i+1))
+done
+[ -n "$EXTRA_CONF" ] && cat "$EXTRA_CONF" >> $DIR/narc.conf
+
+SINK_FLAGS="-b $ADDRESS -p $PORT -i 2"
+[ "$MULTILINE" -gt 0 ] && SINK_FLAGS="$SINK_FLAGS -M $MULTILINE"
+[ "$PROTO" = udp ] && SINK_FLAGS="$SINK_FLAGS -u"
+if [ "$PROTO" = syslog ]; then
+	# the sink stands in for the local syslog daemon
+	echo "remote-socket $DIR/log.sock" >> $DIR/narc.conf
+	SINK_FLAGS="$SINK_FLAGS -U $DIR/log.sock -k 3"
+fi
+if [ "$FRAMING" = octet-counting ]; then
+	echo "remote-framing octet-counting" >> $DIR/narc.conf
+	SINK_FLAGS="$SINK_FLAGS -o"
+fi
+if [ "$FORMAT" = rfc5424 ]; then
+	echo "remote-format rfc5424" >> $DIR/narc.conf
+	SINK_FLAGS="$SINK_FLAGS -5"
+fi
+if [ -n "$CONNECTIONS" ]; then
+	echo "remote-connections $CONNECTIONS" >> $DIR/narc.conf
+fi
+[ -n "$SINK_COST" ] && SINK_FLAGS="$SINK_FLAGS -c $SINK_COST"
+if [ -n "$COMPRESSION" ]; then
+	echo "remote-compression $COMPRESSION" >> $DIR/narc.conf
+	SINK_FLAGS="$SINK_FLAGS -z $COMPRESSION"
+fi
+if [ -n "$DICTIONARY" ]; then
+	echo "remote-dictionary $DICTIONARY" >> $DIR/narc.conf
+	SINK_FLAGS="$SINK_FLAGS -D $DICTIONARY"
+fi
+if [ -n "$VERIFY" ]; then
+	echo "verify-digest yes" >> $DIR/narc.conf
+	SINK_FLAGS="$SINK_FLAGS -v"
+fi
+
+$BIN/narc-sink $SINK_FLAGS > $DIR/sink.out &
+SINK_PID=$!
+sleep 0.3
+$NARCD $DIR/narc.conf &
+NARC_PID=$!
+sleep 0.5
+
+cpu_ticks() {
+	# utime + stime, skipping the command name which may hold spaces
+	sed 's/^.*) //' /proc/$NARC_PID/stat | awk '{ print $12 + $13 }'
+}
+
+START=$(date +%s.%N)
+CPU_START=$(cpu_ticks)
+
+$BIN/narc-loadgen -d $DIR -n $FILES -r $RATE -s $SIZE -t $DURATION \
+	-R $ROTATE -m $ROTATE_MODE -M $MULTILINE > $DIR/loadgen.out || exit 1
+
+# the sink exits once narcd stopped sending for 2 seconds
+wait $SINK_PID
+END=$(date +%s.%N)
+CPU_END=$(cpu_ticks)
+RSS=$(awk '/VmHWM/ { print $2 }' /proc/$NARC_PID/status)
+kill $NARC_PID
+wait $NARC_PID 2>/dev/null
+
+value() {
+	awk -F: -v key=$2 '$1 == key { print $2 }' $1
+}
+
+WRITTEN=$(value $DIR/loadgen.out lines)
+SECONDS_RUN=$(value $DIR/loadgen.out seconds)
+RECEIVED=$(value $DIR/sink.out received)
+BYTES=$(value $DIR/sink.out received_bytes)
+
+echo "proto:$PROTO files:$FILES rate:$RATE size:$SIZE duration:$DURATION rotate:$ROTATE/$ROTATE_MODE"
+awk -v written=$WRITTEN -v received=$RECEIVED -v bytes=$BYTES \
+	-v secs=$SECONDS_RUN -v start=$START -v end=$END \
+	-v cpu=$((CPU_END - CPU_START)) -v hz=$(getconf CLK_TCK) -v rss=$RSS 'BEGIN {
+	wall = end - start - 2
+	printf "lines_written:%d\n", written
+	printf "lines_received:%d\n", received
+	printf "lines_per_sec:%.0f\n", received / secs
+	printf "delivered_per_sec:%.0f\n", received / wall
+	printf "bytes_per_sec:%.0f\n", bytes / secs
+	printf "cpu_percent:%.1f\n", 100 * cpu / hz / wall
+	printf "max_rss_kb:%d\n", rss
+	printf "loss_percent:%.3f\n", written ? 100 * (written - received) / written : 0
+}'
+grep -E '^(lost|out_of_order|malformed|split_records|latency_)' $DIR/sink.out
+if [ -n "$COMPRESSION" ]; then
+	awk -F: '$1 == "received_bytes" { wire = $2 } $1 == "decoded_bytes" { plain = $2 }
+		END { printf "compression_ratio:%.2f\n", wire ? plain / wire : 0 }' $DIR/sink.out
+fi
+
+if [ -n "$VERIFY" ]; then
+	# narcd logs 'Delivery digest: <id> count=N sha1=X' on shutdown
+	sed -n 's/.*Delivery digest: /digest:/p' $DIR/narc.log | sort > $DIR/sent.digest
+	grep '^digest:' $DIR/sink.out | sort > $DIR/received.digest
+	if cmp -s $DIR/sent.digest $DIR/received.digest; then
+		echo "digest_match:yes"
+	else
+		echo "digest_match:no"
+		diff $DIR/sent.digest $DIR/received.digest
+	fi
+fi
@@ -0,0 +1,915 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+/* Syslog sink for the benchmark harness. Listens on TCP, UDP or a unix
+ * datagram socket standing in for /dev/log, checks
+ * the sequence numbers narc-loadgen put in every line and measures how
+ * long each line took to arrive. A report is printed on SIGTERM, or
+ * once nothing was received for the idle timeout.
+ *
+ * With -v it also keeps the same ordered digest narcd keeps with
+ * verify-digest, per stream id, so the two can be compared. */
+
+#include <sys/types.h>	/* u_int32_t for sha1.h */
+
+#include "histogram.h"
+#include "sha1.h"
+
+#include <signal.h>	/* signal numbers */
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <sys/socket.h>	/* sockets */
+#include <sys/un.h>	/* unix domain sockets */
+#include <sys/time.h>	/* time types */
+#include <time.h>	/* time types */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <uv.h>		/* Event driven programming library */
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>	/* zstd streaming decompression */
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>	/* lz4 frame format */
+#endif
+
+#define SINK_MAX_FILES		1024
+#define SINK_BUFFER_SIZE	(128 * 1024)
+
+typedef struct {
+	char			key[128];	/* stream id */
+	unsigned long long	count;		/* lines in the digest */
+	unsigned char		digest[20];
+} sink_digest;
+
+typedef struct {
+	uv_tcp_t	socket;			/* must stay first */
+	uv_timer_t	pause;			/* holds the reads while the cost is paid */
+	unsigned long long debt;		/* microseconds of cost not paid yet */
+	void		*decoder;		/* decompression context, with -z */
+	char		*input;			/* compressed bytes as read */
+	size_t		len;			/* bytes of an incomplete message */
+	char		buffer[SINK_BUFFER_SIZE + 1];
+} sink_connection;
+
+static char		*bind_host = "127.0.0.1";
+static int		port = 1514;
+static int		udp = 0;
+static char		*unix_path = NULL;	/* unix datagram socket to listen on */
+static double		idle_timeout = 0;
+static int		verify = 0;
+static int		key_field = 4;		/* <pri>Mon dd hh:mm:ss host id line */
+static int		octet = 0;		/* tcp frames are octet counted */
+static int		rfc5424 = 0;		/* messages are RFC 5424 */
+static unsigned long long cost = 0;		/* microseconds a tcp connection spends per message */
+static char		*codec = NULL;		/* tcp stream compression, zstd or lz4 */
+static char		*dictionary = NULL;	/* zstd dictionary */
+static size_t		dictionary_len = 0;
+#ifdef HAVE_ZSTD
+static unsigned		dictionary_id = 0;
+#endif
+static unsigned long long unknown_dictionary = 0;	/* frames made with another dictionary */
+
+static uv_loop_t	*loop;
+static uint64_t		last_receive = 0;
+
+static unsigned long long expected[SINK_MAX_FILES];	/* next sequence number per file */
+static unsigned long long received = 0;
+static unsigned long long received_bytes = 0;
+static unsigned long long decoded_bytes = 0;	/* received_bytes once decompressed */
+static unsigned long long lost = 0;
+static unsigned long long out_of_order = 0;
+static unsigned long long malformed = 0;
+static int		frames = 0;		/* continuation lines joined into every message */
+static unsigned long long split_records = 0;	/* multi-line records that arrived in pieces */
+static narc_histogram	latency;			/* microseconds */
+static sink_digest	digests[SINK_MAX_FILES];
+static int		ndigests = 0;
+
+/*============================ Utility functions ============================ */
+
+static unsigned long long
+now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: narc-sink [options]\n");
+	fprintf(stderr, "  -b <host>    ipv4 or ipv6 address to listen on (127.0.0.1)\n");
+	fprintf(stderr, "  -p <port>    port to listen on (1514)\n");
+	fprintf(stderr, "  -u           listen on udp instead of tcp\n");
+	fprintf(stderr, "  -U <path>    listen on a unix datagram socket, like a local syslog daemon\n");
+	fprintf(stderr, "  -i <secs>    exit once idle for this long, 0 to wait for SIGTERM (0)\n");
+	fprintf(stderr, "  -v           digest the lines received per stream\n");
+	fprintf(stderr, "  -k <field>   index of the stream id among the space separated fields (4)\n");
+	fprintf(stderr, "  -5           messages are RFC 5424, the stream id is app[msgid]\n");
+	fprintf(stderr, "  -o           tcp messages are octet counted (RFC 6587), not newline delimited\n");
+	fprintf(stderr, "  -c <usecs>   processing cost of a message, paid by each tcp connection on its own (0)\n");
+	fprintf(stderr, "  -z <codec>   tcp connections are a zstd or lz4 compressed stream, udp\n");
+	fprintf(stderr, "               datagrams a zstd frame each\n");
+	fprintf(stderr, "  -D <path>    zstd dictionary the frames were compressed with\n");
+	fprintf(stderr, "  -M <lines>   continuation lines joined into every message, counts records split apart\n");
+	fprintf(stderr, "  -B <corpus>  benchmark parsing the corpus in both framings and exit\n");
+	exit(1);
+}
+
+static char *
+load_file(const char *path, size_t *len)
+{
+	FILE *fp = fopen(path, "r");
+	char *data;
+	long size;
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	data = malloc(size);
+	*len = fread(data, 1, size, fp);
+	fclose(fp);
+	return data;
+}
+
+static void
+report(void)
+{
+	char hex[41];
+	int i, j;
+
+	printf("received:%llu\n", received);
+	printf("received_bytes:%llu\n", received_bytes);
+	if (codec != NULL)
+		printf("decoded_bytes:%llu\n", decoded_bytes);
+	if (dictionary != NULL)
+		printf("unknown_dictionary:%llu\n", unknown_dictionary);
+	printf("lost:%llu\n", lost);
+	printf("out_of_order:%llu\n", out_of_order);
+	printf("malformed:%llu\n", malformed);
+	if (frames > 0)
+		printf("split_records:%llu\n", split_records);
+	printf("latency_p50_us:%llu\n", (unsigned long long)histogram_percentile(&latency, 50));
+	printf("latency_p99_us:%llu\n", (unsigned long long)histogram_percentile(&latency, 99));
+	printf("latency_max_us:%llu\n", (unsigned long long)latency.max);
+
+	for (i = 0; i < ndigests; i++) {
+		for (j = 0; j < 20; j++)
+			sprintf(hex + j * 2, "%02x", digests[i].digest[j]);
+		printf("digest:%s count=%llu sha1=%s\n", digests[i].key, digests[i].count, hex);
+	}
+	fflush(stdout);
+}
+
+static void handle_line(char *line);
+static void (*line_handler)(char *line) = handle_line;
+
+/* Same as mixDigest() in src/debug.c: digest = SHA1(digest xor SHA1(data)) */
+static void
+mix_digest(unsigned char *digest, const char *data, size_t len)
+{
+	unsigned char hash[20];
+	SHA1_CTX ctx;
+	int j;
+
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, (const unsigned char *)data, len);
+	SHA1Final(hash, &ctx);
+	for (j = 0; j < 20; j++)
+		digest[j] ^= hash[j];
+
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, digest, 20);
+	SHA1Final(digest, &ctx);
+}
+
+/* Find the stream id and the line of an RFC 3164 message: the id is
+ * the key_field-th field, the line follows it and any [name=value] tags. */
+static char *
+split_rfc3164(char *line, char *key, size_t size)
+{
+	char *id = line, *body, *end;
+	int i;
+
+	for (i = 0; i < key_field && id; i++)
+		if ((id = strchr(id, ' ')) != NULL)
+			id++;
+	if (id == NULL || (body = strchr(id, ' ')) == NULL || (size_t)(body - id) >= size)
+		return NULL;
+
+	memcpy(key, id, body - id);
+	key[body - id] = '\0';
+	if (body > id && body[-1] == ':')	/* local syslog tag */
+		key[body - id - 1] = '\0';
+
+	body++;
+	while (body[0] == '[' && (end = strstr(body, "] ")) != NULL &&
+	    memchr(body, '=', end - body) != NULL)
+		body = end + 2;
+	return body;
+}
+
+/* Same for RFC 5424: '<pri>1 time host app procid msgid sd line', the
+ * stream id is rebuilt as app[msgid] and the structured data skipped. */
+static char *
+split_rfc5424(char *line, char *key, size_t size)
+{
+	char *field[6], *p = line;
+	int i, quoted;
+
+	for (i = 0; i < 6; i++) {
+		field[i] = p;
+		if ((p = strchr(p, ' ')) == NULL)
+			return NULL;
+		*p++ = '\0';
+	}
+
+	if (!strcmp(field[5], "-"))
+		snprintf(key, size, "%s", field[3]);
+	else
+		snprintf(key, size, "%s[%s]", field[3], field[5]);
+	for (i = 1; i < 6; i++)
+		field[i][-1] = ' ';
+	p[-1] = ' ';
+
+	if (*p == '-')
+		p++;
+	while (*p == '[') {
+		for (quoted = 0; *p && (quoted || *p != ']'); p++) {
+			if (*p == '\\' && p[1])
+				p++;
+			else if (*p == '"')
+				quoted = !quoted;
+		}
+		if (*p == ']')
+			p++;
+	}
+	return *p == ' ' ? p + 1 : p;
+}
+
+/* Fold the line into the digest of its stream. narcd digests the line
+ * alone, without the syslog header, tags or structured data. */
+static void
+verify_line(char *line)
+{
+	char key[128], *body;
+	size_t key_len;
+	int i;
+
+	body = rfc5424 ? split_rfc5424(line, key, sizeof(key)) : split_rfc3164(line, key, sizeof(key));
+	if (body == NULL)
+		return;
+	key_len = strlen(key);
+
+	for (i = 0; i < ndigests; i++)
+		if (strlen(digests[i].key) == key_len && !strncmp(digests[i].key, key, key_len))
+			break;
+
+	if (i == ndigests) {
+		if (ndigests == SINK_MAX_FILES || key_len >= sizeof(digests[i].key))
+			return;
+		memcpy(digests[i].key, key, key_len + 1);
+		digests[i].count = 0;
+		memset(digests[i].digest, 0, 20);
+		ndigests++;
+	}
+
+	mix_digest(digests[i].digest, body, strlen(body));
+	digests[i].count++;
+}
+
+/* Count the continuation lines joined into the message. */
+static int
+count_frames(const char *line)
+{
+	int count = 0;
+
+	while ((line = strstr(line, "narcbench.frame")) != NULL) {
+		count++;
+		line++;
+	}
+	return count;
+}
+
+/* Check one message. Lines that went missing show up as a jump in the
+ * sequence, lines sent twice or reordered as a step back. */
+static void
+handle_line(char *line)
+{
+	unsigned long long seq, stamp, now;
+	char *body;
+	int file;
+
+	if (verify)
+		verify_line(line);
+
+	body = strstr(line, "narcbench ");
+
+	// a record must arrive whole, with all its continuation lines
+	if (frames > 0 && (body == NULL ? count_frames(line) > 0 : count_frames(body) != frames)) {
+		split_records++;
+		if (body == NULL)
+			return;
+	}
+
+	if (body == NULL ||
+	    sscanf(body, "narcbench %d %llu %llu", &file, &seq, &stamp) != 3 ||
+	    file < 0 || file >= SINK_MAX_FILES) {
+		malformed++;
+		return;
+	}
+
+	received++;
+	now = now_us();
+	histogram_record(&latency, now > stamp ? now - stamp : 0);
+
+	if (seq == expected[file])
+		expected[file]++;
+	else if (seq > expected[file]) {
+		lost += seq - expected[file];
+		expected[file] = seq + 1;
+	} else
+		out_of_order++;
+}
+
+/* Split a buffer into newline delimited messages, returns the bytes
+ * left over after the last newline. */
+static size_t
+parse_newline(char *data, size_t len)
+{
+	char *start = data, *end;
+
+	while ((end = memchr(start, '\n', len - (start - data))) != NULL) {
+		*end = '\0';
+		line_handler(start);
+		start = end + 1;
+	}
+	return len - (start - data);
+}
+
+/* Split a buffer into RFC 6587 octet counted frames, '<len> <msg>',
+ * returns the bytes left over after the last complete frame. The byte
+ * after the buffer must be writable, it briefly holds a terminator. */
+static size_t
+parse_octet(char *data, size_t len)
+{
+	char *p = data, *end = data + len, *q, save;
+	size_t frame;
+
+	while (p < end) {
+		for (q = p, frame = 0; q < end && *q >= '0' && *q <= '9'; q++)
+			frame = frame * 10 + (*q - '0');
+		if (q == end)
+			break;
+		if (q == p || *q != ' ' || frame > SINK_BUFFER_SIZE) {
+			/* lost the framing, nothing after this can be trusted */
+			malformed++;
+			return 0;
+		}
+		if ((size_t)(end - q - 1) < frame)
+			break;
+
+		q++;
+		save = q[frame];
+		q[frame] = '\0';
+		line_handler(q);
+		q[frame] = save;
+		p = q + frame;
+	}
+	return end - p;
+}
+
+static size_t
+parse_data(char *data, size_t len)
+{
+	return octet ? parse_octet(data, len) : parse_newline(data, len);
+}
+
+/*============================== Callbacks ================================== */
+
+static void
+handle_udp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+	static char slab[65536 + 1];
+
+	buf->base = slab;
+	buf->len = sizeof(slab) - 1;
+}
+
+static char		decoded[65536 + 1];		/* a datagram once decompressed */
+#ifdef HAVE_ZSTD
+static void		*datagram_decoder = NULL;
+#endif
+
+static void *new_decoder(void);
+
+/* Each datagram is a frame of its own, made with the dictionary whose
+ * id it carries. Returns the decoded length, or -1. */
+static ssize_t
+decode_datagram(const char *data, size_t len)
+{
+#ifdef HAVE_ZSTD
+	unsigned id = ZSTD_getDictID_fromFrame(data, len);
+	size_t decoded_len;
+
+	if (id != 0 && id != dictionary_id) {
+		unknown_dictionary++;
+		return -1;
+	}
+	if (datagram_decoder == NULL)
+		datagram_decoder = new_decoder();
+	decoded_len = ZSTD_decompressDCtx(datagram_decoder, decoded, sizeof(decoded) - 1, data, len);
+	if (!ZSTD_isError(decoded_len))
+		return decoded_len;
+#endif
+	malformed++;
+	return -1;
+}
+
+static void
+handle_udp_read(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags)
+{
+	char *data = buf->base;
+	size_t left;
+
+	if (nread <= 0)
+		return;
+
+	/* a datagram holds whole messages, the last may lack its newline */
+	received_bytes += nread;
+	last_receive = uv_now(loop);
+	if (codec != NULL) {
+		nread = decode_datagram(buf->base, nread);
+		if (nread < 0)
+			return;
+		decoded_bytes += nread;
+		data = decoded;
+	}
+	data[nread] = '\0';
+	left = parse_newline(data, nread);
+	if (left > 0)
+		line_handler(data + nread - left);
+}
+
+/* Datagrams from a unix socket, which libuv only does as streams: drain
+ * the socket each time it becomes readable. */
+static void
+handle_unix_readable(uv_poll_t *poll, int status, int events)
+{
+	static char slab[65536 + 1];
+	uv_os_fd_t fd;
+	ssize_t nread;
+	size_t left;
+
+	uv_fileno((uv_handle_t *)poll, &fd);
+	while ((nread = recv(fd, slab, sizeof(slab) - 1, MSG_DONTWAIT)) > 0) {
+		received_bytes += nread;
+		last_receive = uv_now(loop);
+		slab[nread] = '\0';
+		left = parse_newline(slab, nread);
+		if (left > 0)
+			line_handler(slab + nread - left);
+	}
+}
+
+static void
+handle_tcp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf)
+{
+	sink_connection *connection = (sink_connection *)handle;
+
+	if (connection->decoder != NULL) {
+		buf->base = connection->input;
+		buf->len = SINK_BUFFER_SIZE;
+		return;
+	}
+	buf->base = connection->buffer + connection->len;
+	buf->len = SINK_BUFFER_SIZE - connection->len;
+}
+
+static void *
+new_decoder(void)
+{
+#ifdef HAVE_ZSTD
+	if (!strcmp(codec, "zstd")) {
+		ZSTD_DCtx *dctx = ZSTD_createDCtx();
+		if (dictionary != NULL)
+			ZSTD_DCtx_loadDictionary(dctx, dictionary, dictionary_len);
+		return dctx;
+	}
+#endif
+#ifdef HAVE_LZ4
+	if (!strcmp(codec, "lz4")) {
+		LZ4F_dctx *dctx;
+		LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+		return dctx;
+	}
+#endif
+	return NULL;
+}
+
+static void
+free_decoder(void *decoder)
+{
+#ifdef HAVE_ZSTD
+	if (!strcmp(codec, "zstd"))
+		ZSTD_freeDCtx(decoder);
+#endif
+#ifdef HAVE_LZ4
+	if (!strcmp(codec, "lz4"))
+		LZ4F_freeDecompressionContext(decoder);
+#endif
+}
+
+/* Decode what it can of src into dst, returns the bytes produced or -1
+ * on a corrupt stream, and advances src past what was consumed. */
+static ssize_t
+decode(void *decoder, const char **src, size_t *srclen, char *dst, size_t dstlen)
+{
+#ifdef HAVE_ZSTD
+	if (!strcmp(codec, "zstd")) {
+		ZSTD_inBuffer in = {*src, *srclen, 0};
+		ZSTD_outBuffer out = {dst, dstlen, 0};
+
+		if (ZSTD_isError(ZSTD_decompressStream(decoder, &out, &in)))
+			return -1;
+		*src += in.pos;
+		*srclen -= in.pos;
+		return out.pos;
+	}
+#endif
+#ifdef HAVE_LZ4
+	if (!strcmp(codec, "lz4")) {
+		size_t consumed = *srclen, produced = dstlen;
+
+		if (LZ4F_isError(LZ4F_decompress(decoder, dst, &produced, *src, &consumed, NULL)))
+			return -1;
+		*src += consumed;
+		*srclen -= consumed;
+		return produced;
+	}
+#endif
+	return -1;
+}
+
+static void
+handle_connection_close(uv_handle_t *handle)
+{
+	sink_connection *connection = (sink_connection *)handle->data;
+
+	if (connection->decoder != NULL) {
+		free_decoder(connection->decoder);
+		free(connection->input);
+	}
+	free(connection);
+}
+
+static void
+close_connection(uv_handle_t *pause)
+{
+	sink_connection *connection = (sink_connection *)pause->data;
+
+	uv_close((uv_handle_t *)&connection->socket, handle_connection_close);
+}
+
+static void handle_tcp_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+
+/* Parse the complete messages of the buffer, keeping the incomplete
+ * one for the next read. */
+static void
+consume(sink_connection *connection)
+{
+	size_t left = parse_data(connection->buffer, connection->len);
+
+	if (left == SINK_BUFFER_SIZE) {
+		/* a message longer than the buffer, give up on it */
+		malformed++;
+		left = 0;
+	}
+	memmove(connection->buffer, connection->buffer + connection->len - left, left);
+	connection->len = left;
+}
+
+static void
+handle_pause_timeout(uv_timer_t *timer)
+{
+	sink_connection *connection = (sink_connection *)timer->data;
+
+	uv_read_start((uv_stream_t *)&connection->socket, handle_tcp_alloc, handle_tcp_read);
+}
+
+static void
+handle_tcp_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+	sink_connection *connection = (sink_connection *)stream;
+	unsigned long long before = received;
+
+	if (nread < 0) {
+		/* the pause timer goes first, the socket frees the connection */
+		uv_close((uv_handle_t *)&connection->pause, close_connection);
+		uv_read_stop(stream);
+		return;
+	}
+
+	received_bytes += nread;
+	last_receive = uv_now(loop);
+
+	if (connection->decoder == NULL) {
+		connection->len += nread;
+		consume(connection);
+	} else {
+		const char *src = buf->base;
+		size_t srclen = nread, room;
+		ssize_t produced;
+
+		/* the decoder may hold more than the buffer takes at once */
+		do {
+			room = SINK_BUFFER_SIZE - connection->len;
+			produced = decode(connection->decoder, &src, &srclen,
+				connection->buffer + connection->len, room);
+			if (produced < 0) {
+				malformed++;
+				uv_close((uv_handle_t *)&connection->pause, close_connection);
+				uv_read_stop(stream);
+				return;
+			}
+			decoded_bytes += produced;
+			connection->len += produced;
+			consume(connection);
+		} while (srclen > 0 || (size_t)produced == room);
+	}
+
+	/* a slow receiver working each connection apart: the connection
+	 * stops reading until the messages it got are paid for */
+	connection->debt += (received - before) * cost;
+	if (connection->debt >= 1000) {
+		uv_read_stop(stream);
+		uv_timer_start(&connection->pause, handle_pause_timeout, connection->debt / 1000, 0);
+		connection->debt %= 1000;
+	}
+}
+
+static void
+handle_tcp_connection(uv_stream_t *listener, int status)
+{
+	sink_connection *connection;
+
+	if (status < 0)
+		return;
+
+	connection = malloc(sizeof(sink_connection));
+	connection->len = 0;
+	connection->debt = 0;
+	connection->decoder = NULL;
+	if (codec != NULL) {
+		connection->decoder = new_decoder();
+		connection->input = malloc(SINK_BUFFER_SIZE);
+	}
+	uv_tcp_init(loop, &connection->socket);
+	uv_timer_init(loop, &connection->pause);
+	connection->socket.data = connection;
+	connection->pause.data = connection;
+
+	if (uv_accept(listener, (uv_stream_t *)&connection->socket) == 0)
+		uv_read_start((uv_stream_t *)&connection->socket, handle_tcp_alloc, handle_tcp_read);
+	else
+		uv_close((uv_handle_t *)&connection->pause, close_connection);
+}
+
+static void
+handle_idle_timer(uv_timer_t *timer)
+{
+	if (last_receive > 0 && uv_now(loop) - last_receive >= idle_timeout * 1000)
+		uv_stop(loop);
+}
+
+static void
+handle_signal(uv_signal_t *handle, int signum)
+{
+	uv_stop(loop);
+}
+
+/*=============================== Benchmark ================================= */
+
+static unsigned long long parsed = 0;
+
+static void
+count_line(char *line)
+{
+	parsed++;
+}
+
+static size_t
+parse_none(char *data, size_t len)
+{
+	return 0;
+}
+
+static double
+time_parse(size_t (*parse)(char *, size_t), char *framed, char *work, size_t len, int passes)
+{
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < passes; i++) {
+		/* parsing writes terminators, start from a clean copy */
+		memcpy(work, framed, len);
+		parse(work, len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+/* Frame every line of the corpus both ways and time the parsers alone,
+ * the copy of the input each pass is timed separately and taken off. */
+static int
+bench_parse(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char *newline, *octets, *work, line[65536];
+	size_t newline_len = 0, octet_len = 0, size = 0;
+	double copy, elapsed;
+	int lines = 0, passes = 2000;
+
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		size += strlen(line) + 8;
+		lines++;
+	}
+	rewind(fp);
+
+	newline = malloc(size);
+	octets = malloc(size);
+	work = malloc(size + 1);
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len = strcspn(line, "\n");
+
+		memcpy(newline + newline_len, line, len);
+		newline[newline_len + len] = '\n';
+		newline_len += len + 1;
+		octet_len += sprintf(octets + octet_len, "%zu ", len);
+		memcpy(octets + octet_len, line, len);
+		octet_len += len;
+	}
+	fclose(fp);
+
+	line_handler = count_line;
+	printf("corpus: %d messages\n", lines);
+
+	copy = time_parse(parse_none, newline, work, newline_len, passes);
+	elapsed = time_parse(parse_newline, newline, work, newline_len, passes) - copy;
+	printf("newline_ns_per_msg:%.2f\n", elapsed / ((double)passes * lines));
+	printf("newline_mb_per_sec:%.1f\n", newline_len * (double)passes / (1024 * 1024) / (elapsed / 1e9));
+
+	copy = time_parse(parse_none, octets, work, octet_len, passes);
+	elapsed = time_parse(parse_octet, octets, work, octet_len, passes) - copy;
+	printf("octet_ns_per_msg:%.2f\n", elapsed / ((double)passes * lines));
+	printf("octet_mb_per_sec:%.1f\n", octet_len * (double)passes / (1024 * 1024) / (elapsed / 1e9));
+
+	if (parsed != (unsigned long long)lines * passes * 2)
+		printf("parsed %llu messages, expected %llu\n", parsed, (unsigned long long)lines * passes * 2);
+
+	free(newline);
+	free(octets);
+	free(work);
+	return 0;
+}
+
+/*================================= Main ==================================== */
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_storage addr;
+	uv_signal_t term_signal, int_signal;
+	uv_timer_t idle_timer;
+	uv_tcp_t tcp;
+	uv_udp_t udp_socket;
+	uv_poll_t unix_poll;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "b:p:uU:i:vk:o5c:z:D:M:B:h")) != -1) {
+		switch (opt) {
+		case 'b': bind_host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'u': udp = 1; break;
+		case 'U': unix_path = optarg; break;
+		case 'i': idle_timeout = atof(optarg); break;
+		case 'v': verify = 1; break;
+		case 'k': key_field = atoi(optarg); break;
+		case 'o': octet = 1; break;
+		case 'c': cost = strtoull(optarg, NULL, 10); break;
+		case 'M': frames = atoi(optarg); break;
+		case 'z': codec = optarg; break;
+		case 'D': dictionary = load_file(optarg, &dictionary_len); break;
+		case '5': rfc5424 = 1; break;
+		case 'B': return bench_parse(optarg);
+		default: usage();
+		}
+	}
+
+	if (codec != NULL) {
+		void *decoder = new_decoder();
+
+		if (decoder == NULL) {
+			fprintf(stderr, "narc-sink: %s streams are not supported\n", codec);
+			return 1;
+		}
+		free_decoder(decoder);
+	}
+	if (dictionary != NULL) {
+#ifdef HAVE_ZSTD
+		dictionary_id = ZSTD_getDictID_fromDict(dictionary, dictionary_len);
+#endif
+		if (codec == NULL || strcmp(codec, "zstd")) {
+			fprintf(stderr, "narc-sink: a dictionary needs -z zstd\n");
+			return 1;
+		}
+	}
+
+	loop = uv_default_loop();
+	histogram_reset(&latency);
+	if (uv_ip4_addr(bind_host, port, (struct sockaddr_in *)&addr) != 0)
+		uv_ip6_addr(bind_host, port, (struct sockaddr_in6 *)&addr);
+
+	if (unix_path) {
+		struct sockaddr_un sun;
+		int fd, size = 8 * 1024 * 1024;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, unix_path, sizeof(sun.sun_path) - 1);
+		unlink(unix_path);
+		if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+		    bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+			perror(unix_path);
+			return 1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		uv_poll_init(loop, &unix_poll, fd);
+		err = uv_poll_start(&unix_poll, UV_READABLE, handle_unix_readable);
+	} else if (udp) {
+		uv_udp_init(loop, &udp_socket);
+		if ((err = uv_udp_bind(&udp_socket, (const struct sockaddr *)&addr, UV_UDP_REUSEADDR)) == 0) {
+			int size = 8 * 1024 * 1024;
+			uv_recv_buffer_size((uv_handle_t *)&udp_socket, &size);
+			err = uv_udp_recv_start(&udp_socket, handle_udp_alloc, handle_udp_read);
+		}
+	} else {
+		uv_tcp_init(loop, &tcp);
+		if ((err = uv_tcp_bind(&tcp, (const struct sockaddr *)&addr, 0)) == 0)
+			err = uv_listen((uv_stream_t *)&tcp, 128, handle_tcp_connection);
+	}
+
+	if (err) {
+		fprintf(stderr, "Can't listen on %s:%d: %s\n", bind_host, port, uv_strerror(err));
+		return 1;
+	}
+
+	uv_signal_init(loop, &term_signal);
+	uv_signal_start(&term_signal, handle_signal, SIGTERM);
+	uv_signal_init(loop, &int_signal);
+	uv_signal_start(&int_signal, handle_signal, SIGINT);
+
+	if (idle_timeout > 0) {
+		uv_timer_init(loop, &idle_timer);
+		uv_timer_start(&idle_timer, handle_idle_timer, 100, 100);
+	}
+
+	uv_run(loop, UV_RUN_DEFAULT);
+	report();
+	return 0;
+}
@@ -0,0 +1,372 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "compress.h"
+
+#include "sds.h"	/* dynamic safe strings */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <time.h>	/* clock_gettime */
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>	/* zstd streaming compression */
+#include <zdict.h>	/* zstd dictionary training */
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>	/* lz4 frame format */
+#endif
+
+/*============================ Utility functions ============================ */
+
+#ifdef HAVE_ZSTD
+sds
+compress_zstd(narc_compressor *compressor, sds out, const char *data, size_t len)
+{
+	ZSTD_inBuffer in = {data, len, 0};
+	size_t left;
+
+	do {
+		ZSTD_outBuffer buf;
+
+		out = sdsMakeRoomFor(out, ZSTD_CStreamOutSize());
+		buf.dst  = out + sdslen(out);
+		buf.size = sdsavail(out);
+		buf.pos  = 0;
+
+		left = ZSTD_compressStream2(compressor->ctx, &buf, &in, ZSTD_e_flush);
+		if (ZSTD_isError(left)) {
+			narc_log(NARC_WARNING, "zstd compression failed: %s", ZSTD_getErrorName(left));
+			sdsfree(out);
+			return NULL;
+		}
+		sdsIncrLen(out, buf.pos);
+	} while (left > 0 || in.pos < in.size);
+
+	return out;
+}
+#endif
+
+#ifdef HAVE_LZ4
+sds
+compress_lz4(narc_compressor *compressor, sds out, const char *data, size_t len)
+{
+	LZ4F_preferences_t prefs;
+	size_t bound, written;
+
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.frameInfo.blockMode = LZ4F_blockLinked;
+	prefs.compressionLevel    = compressor->level;
+	prefs.autoFlush           = 1;
+
+	bound = LZ4F_compressBound(len, &prefs) + LZ4F_HEADER_SIZE_MAX;
+	out = sdsMakeRoomFor(out, bound);
+
+	if (!compressor->started) {
+		written = LZ4F_compressBegin(compressor->ctx, out + sdslen(out), sdsavail(out), &prefs);
+		if (LZ4F_isError(written)) {
+			narc_log(NARC_WARNING, "lz4 compression failed: %s", LZ4F_getErrorName(written));
+			sdsfree(out);
+			return NULL;
+		}
+		sdsIncrLen(out, written);
+		compressor->started = 1;
+	}
+
+	written = LZ4F_compressUpdate(compressor->ctx, out + sdslen(out), sdsavail(out), data, len, NULL);
+	if (LZ4F_isError(written)) {
+		narc_log(NARC_WARNING, "lz4 compression failed: %s", LZ4F_getErrorName(written));
+		sdsfree(out);
+		return NULL;
+	}
+	sdsIncrLen(out, written);
+
+	return out;
+}
+#endif
+
+/*================================== API ==================================== */
+
+int
+compression_available(int codec)
+{
+	switch (codec) {
+		case NARC_COMPRESSION_NONE : return 1;
+#ifdef HAVE_ZSTD
+		case NARC_COMPRESSION_ZSTD : return 1;
+#endif
+#ifdef HAVE_LZ4
+		case NARC_COMPRESSION_LZ4 : return 1;
+#endif
+	}
+	return 0;
+}
+
+const char
+*compression_name(int codec)
+{
+	switch (codec) {
+		case NARC_COMPRESSION_NONE : return "none";
+		case NARC_COMPRESSION_ZSTD : return "zstd";
+		case NARC_COMPRESSION_LZ4 : return "lz4";
+	}
+	return "unknown";
+}
+
+narc_compressor
+*new_compressor(int codec, int level)
+{
+	narc_compressor *compressor = (narc_compressor *)malloc(sizeof(narc_compressor));
+
+	compressor->codec   = codec;
+	compressor->level   = level;
+	compressor->ctx     = NULL;
+	compressor->started = 0;
+	compressor->dict    = NULL;
+	compressor->dict_id = 0;
+
+	switch (codec) {
+#ifdef HAVE_ZSTD
+		case NARC_COMPRESSION_ZSTD :
+			compressor->ctx = ZSTD_createCCtx();
+			ZSTD_CCtx_setParameter(compressor->ctx, ZSTD_c_compressionLevel, level);
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case NARC_COMPRESSION_LZ4 :
+			LZ4F_createCompressionContext((LZ4F_cctx **)&compressor->ctx, LZ4F_VERSION);
+			break;
+#endif
+	}
+
+	return compressor;
+}
+
+void
+free_compressor(narc_compressor *compressor)
+{
+	switch (compressor->codec) {
+#ifdef HAVE_ZSTD
+		case NARC_COMPRESSION_ZSTD :
+			ZSTD_freeCCtx(compressor->ctx);
+			ZSTD_freeCDict(compressor->dict);
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case NARC_COMPRESSION_LZ4 :
+			LZ4F_freeCompressionContext(compressor->ctx);
+			break;
+#endif
+	}
+	free(compressor);
+}
+
+/* A new connection starts a new frame, the receiver knows nothing of
+ * the previous one. */
+void
+reset_compressor(narc_compressor *compressor)
+{
+	switch (compressor->codec) {
+#ifdef HAVE_ZSTD
+		case NARC_COMPRESSION_ZSTD :
+			ZSTD_CCtx_reset(compressor->ctx, ZSTD_reset_session_only);
+			break;
+#endif
+#ifdef HAVE_LZ4
+		case NARC_COMPRESSION_LZ4 :
+			// a frame that never ended is dropped by the next begin
+			break;
+#endif
+	}
+	compressor->started = 0;
+}
+
+/* Append the batch, compressed and flushed, to out. Only touches the
+ * compressor, so it may run on the thread pool. NULL when the codec
+ * failed: out is freed and the frame is broken until the next reset. */
+sds
+compress_batch(narc_compressor *compressor, sds out, const char *data, size_t len)
+{
+	switch (compressor->codec) {
+#ifdef HAVE_ZSTD
+		case NARC_COMPRESSION_ZSTD :
+			return compress_zstd(compressor, out, data, len);
+#endif
+#ifdef HAVE_LZ4
+		case NARC_COMPRESSION_LZ4 :
+			return compress_lz4(compressor, out, data, len);
+#endif
+	}
+	return sdscatlen(out, data, len);
+}
+
+/* One frame standing on its own, e.g. a datagram. Without the history
+ * of a stream short messages only compress well with a dictionary.
+ * NULL when the codec failed, out is freed then. */
+sds
+compress_frame(narc_compressor *compressor, sds out, const char *data, size_t len)
+{
+#ifdef HAVE_ZSTD
+	if (compressor->codec == NARC_COMPRESSION_ZSTD) {
+		size_t written;
+
+		out = sdsMakeRoomFor(out, ZSTD_compressBound(len));
+		written = ZSTD_compress2(compressor->ctx, out + sdslen(out), sdsavail(out), data, len);
+		if (ZSTD_isError(written)) {
+			narc_log(NARC_WARNING, "zstd compression failed: %s", ZSTD_getErrorName(written));
+			sdsfree(out);
+			return NULL;
+		}
+		sdsIncrLen(out, written);
+		return out;
+	}
+#endif
+	return sdscatlen(out, data, len);
+}
+
+/* What compressing costs is measured in cpu time of the thread doing
+ * it, the loop or a thread pool worker. */
+uint64_t
+thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*============================== Dictionaries =============================== */
+
+sds
+load_dictionary(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	sds dict = sdsempty();
+	char buf[4096];
+	size_t len;
+
+	if (fp == NULL) {
+		sdsfree(dict);
+		return NULL;
+	}
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		dict = sdscatlen(dict, buf, len);
+	fclose(fp);
+
+	return dict;
+}
+
+/* 0 unless it is a trained zstd dictionary, raw content has no id. */
+unsigned
+dictionary_id(const char *dict, size_t len)
+{
+#ifdef HAVE_ZSTD
+	return ZSTD_getDictID_fromDict(dict, len);
+#else
+	return 0;
+#endif
+}
+
+/* The dictionary is digested once, every frame after that starts from
+ * it and carries its id so the receiver knows which one to use. */
+int
+compressor_use_dictionary(narc_compressor *compressor, const char *dict, size_t len)
+{
+#ifdef HAVE_ZSTD
+	if (compressor->codec == NARC_COMPRESSION_ZSTD) {
+		compressor->dict = ZSTD_createCDict(dict, len, compressor->level);
+		if (compressor->dict == NULL)
+			return NARC_ERR;
+		ZSTD_CCtx_refCDict(compressor->ctx, compressor->dict);
+		compressor->dict_id = dictionary_id(dict, len);
+		return NARC_OK;
+	}
+#endif
+	return NARC_ERR;
+}
+
+/* Train a dictionary on the lines of the sample files, each line being
+ * a sample. Run offline by narcd --train-dictionary, returns the exit
+ * status. */
+int
+train_dictionary(const char *path, char **files, int nfiles)
+{
+#ifdef HAVE_ZSTD
+	sds samples = sdsempty();
+	size_t *sizes = NULL, count = 0, room = 0, written;
+	char line[NARC_MAX_MESSAGE_SIZE+1];
+	void *dict;
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < nfiles && sdslen(samples) < NARC_DICTIONARY_SAMPLES; i++) {
+		if ((fp = fopen(files[i], "r")) == NULL) {
+			perror(files[i]);
+			return 1;
+		}
+		while (fgets(line, sizeof(line), fp) && sdslen(samples) < NARC_DICTIONARY_SAMPLES) {
+			size_t len = strlen(line);
+
+			if (len > 0 && line[len-1] == '\n')
+				len--;
+			if (len == 0)
+				continue;
+			if (count == room) {
+				room = room ? room * 2 : 4096;
+				sizes = realloc(sizes, sizeof(size_t) * room);
+			}
+			samples = sdscatlen(samples, line, len);
+			sizes[count++] = len;
+		}
+		fclose(fp);
+	}
+
+	dict = malloc(NARC_DICTIONARY_SIZE);
+	written = ZDICT_trainFromBuffer(dict, NARC_DICTIONARY_SIZE, samples, sizes, count);
+	if (ZDICT_isError(written)) {
+		fprintf(stderr, "Can't train a dictionary from %zu lines: %s\n",
+			count, ZDICT_getErrorName(written));
+		return 1;
+	}
+
+	if ((fp = fopen(path, "w")) == NULL || fwrite(dict, 1, written, fp) != written) {
+		perror(path);
+		return 1;
+	}
+	fclose(fp);
+	printf("Trained a %zu bytes dictionary with id %u from %zu lines\n",
+		written, dictionary_id(dict, written), count);
+
+	free(dict);
+	free(sizes);
+	sdsfree(samples);
+	return 0;
+#else
+	fprintf(stderr, "narc was built without zstd\n");
+	return 1;
+#endif
+}
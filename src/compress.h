@@ -0,0 +1,81 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_COMPRESS
+#define NARC_COMPRESS 
+
+#include "sds.h"	/* dynamic safe strings */
+
+#include <stddef.h>	/* size_t */
+#include <stdint.h>	/* fixed width integers */
+
+/* wire compression codecs */
+#define NARC_COMPRESSION_NONE	0
+#define NARC_COMPRESSION_ZSTD	1	/* a zstd frame per connection */
+#define NARC_COMPRESSION_LZ4	2	/* an lz4 frame per connection, linked blocks */
+
+#define NARC_DEFAULT_ZSTD_LEVEL	3
+#define NARC_DEFAULT_LZ4_LEVEL	0	/* the fast compressor, 3 and up use lz4hc */
+
+#define NARC_DICTIONARY_SIZE	(64*1024)	/* trained dictionary size */
+#define NARC_DICTIONARY_SAMPLES	(64*1024*1024)	/* sample bytes read for training */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* One compressed stream, the life of a connection. Every batch ends in
+ * a flush so the receiver can decode it at once, while the window keeps
+ * the history of the previous batches for a better ratio. */
+typedef struct {
+	int		codec;		/* NARC_COMPRESSION_* */
+	int		level;		/* codec compression level */
+	void		*ctx;		/* codec context */
+	int		started;	/* the frame header went out */
+	void		*dict;		/* digested dictionary, zstd only */
+	unsigned	dict_id;	/* id of the dictionary, written in each frame */
+} narc_compressor;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+int	compression_available(int codec);
+const char	*compression_name(int codec);
+narc_compressor	*new_compressor(int codec, int level);
+void	free_compressor(narc_compressor *compressor);
+void	reset_compressor(narc_compressor *compressor);
+sds	compress_batch(narc_compressor *compressor, sds out, const char *data, size_t len);
+sds	compress_frame(narc_compressor *compressor, sds out, const char *data, size_t len);
+uint64_t	thread_cpu_ns(void);
+
+/* dictionaries */
+sds	load_dictionary(const char *path);
+unsigned	dictionary_id(const char *dict, size_t len);
+int	compressor_use_dictionary(narc_compressor *compressor, const char *dict, size_t len);
+int	train_dictionary(const char *path, char **files, int nfiles);
+
+#endif
@@ -27,8 +27,12 @@
 #include "config.h"
 #include "narc.h"
 #include "stream.h"
+#include "output.h"
+#include "udp_client.h"
+#include "compress.h"
 
 #include "sds.h"	/* dynamic safe strings */
+#include "util.h"	/* Misc functions useful in many places */
 // #include "malloc.h"	/* total memory usage aware version of malloc/free */
 
 #include <stdio.h>	/* standard buffered input/output */
@@ -84,6 +88,161 @@ yesnotoi(char *s)
 	else return -1;
 }
 
+/* Output settings, shared by the remote-* and output-* directives. They
+ * return the error message, or NULL. */
+char *
+parse_output_protocol(narc_output *output, char *arg)
+{
+	if (!strcasecmp(arg,"udp")) output->protocol = NARC_PROTO_UDP;
+	else if (!strcasecmp(arg,"tcp")) output->protocol = NARC_PROTO_TCP;
+	else if (!strcasecmp(arg,"syslog")) output->protocol = NARC_PROTO_SYSLOG;
+	else return "Invalid protocol. Must be either udp, tcp or syslog";
+	return NULL;
+}
+
+char *
+parse_output_port(narc_output *output, char *arg)
+{
+	output->port = atoi(arg);
+	if (output->port < 0 || output->port > 65535)
+		return "Invalid port";
+	return NULL;
+}
+
+char *
+parse_output_framing(narc_output *output, char *arg)
+{
+	if (!strcasecmp(arg,"newline")) output->framing = NARC_FRAMING_NEWLINE;
+	else if (!strcasecmp(arg,"octet-counting")) output->framing = NARC_FRAMING_OCTET;
+	else return "Invalid framing. Must be either newline or octet-counting";
+	return NULL;
+}
+
+char *
+parse_output_packing(narc_output *output, char *arg)
+{
+	int memerr;
+
+	output->packing = memtoll(arg, &memerr);
+	if (memerr || output->packing > NARC_UDP_MAX_PAYLOAD)
+		return "Invalid udp packing size";
+	return NULL;
+}
+
+char *
+parse_output_compression(narc_output *output, char *codec, char *level)
+{
+	if (!strcasecmp(codec,"none")) output->compression = NARC_COMPRESSION_NONE;
+	else if (!strcasecmp(codec,"zstd")) output->compression = NARC_COMPRESSION_ZSTD;
+	else if (!strcasecmp(codec,"lz4")) output->compression = NARC_COMPRESSION_LZ4;
+	else return "Invalid compression. Must be either none, zstd or lz4";
+	if (!compression_available(output->compression))
+		return "narc was built without this compression";
+
+	if (level != NULL)
+		output->compression_level = atoi(level);
+	else if (output->compression == NARC_COMPRESSION_ZSTD)
+		output->compression_level = NARC_DEFAULT_ZSTD_LEVEL;
+	else
+		output->compression_level = NARC_DEFAULT_LZ4_LEVEL;
+	return NULL;
+}
+
+char *
+parse_output_dictionary(narc_output *output, char *path)
+{
+	sdsfree(output->dictionary);
+	if ((output->dictionary = load_dictionary(path)) == NULL)
+		return "Can't read the dictionary";
+	output->dictionary_id = dictionary_id(output->dictionary, sdslen(output->dictionary));
+	if (output->dictionary_id == 0)
+		return "Not a trained zstd dictionary, see narcd --train-dictionary";
+	return NULL;
+}
+
+char *
+parse_output_connections(narc_output *output, char *arg)
+{
+	output->connections = atoi(arg);
+	if (output->connections < 1 || output->connections > NARC_MAX_CONNECTIONS)
+		return "Invalid number of connections";
+	return NULL;
+}
+
+char *
+parse_output_queue(narc_output *output, char *limit, char *mode)
+{
+	int memerr;
+
+	output->queue_limit = memtoll(limit, &memerr);
+	if (memerr)
+		return "Invalid queue limit";
+	if (!strcasecmp(mode,"drop")) output->backpressure = NARC_BACKPRESSURE_DROP;
+	else if (!strcasecmp(mode,"block")) output->backpressure = NARC_BACKPRESSURE_BLOCK;
+	else return "Invalid backpressure. Must be either drop or block";
+	return NULL;
+}
+
+/* Connection pools are a tcp thing, udp datagrams are only compressed
+ * with zstd, and a group needs members. */
+void
+check_output(narc_output *output)
+{
+	if (output->members != NULL && listLength(output->members) == 0) {
+		fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+		fprintf(stderr, "Output group '%s' has no members\n", output->name);
+		exit(1);
+	}
+	if (output->connections > 1 && output->protocol != NARC_PROTO_TCP) {
+		fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+		fprintf(stderr, "Output '%s' has several connections, only tcp can pool them\n", output->name);
+		exit(1);
+	}
+	if (output->compression != NARC_COMPRESSION_NONE && output->protocol != NARC_PROTO_TCP &&
+	    !(output->compression == NARC_COMPRESSION_ZSTD && output->protocol == NARC_PROTO_UDP)) {
+		fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+		fprintf(stderr, "Output '%s' is compressed, only tcp and zstd over udp can be\n", output->name);
+		exit(1);
+	}
+	if (output->dictionary != NULL && output->compression != NARC_COMPRESSION_ZSTD) {
+		fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+		fprintf(stderr, "Output '%s' has a dictionary, it needs zstd compression\n", output->name);
+		exit(1);
+	}
+}
+
+void
+check_outputs(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	if (listLength(server.outputs) == 0) {
+		check_output(server.default_output);
+		return;
+	}
+
+	iter = listGetIterator(server.outputs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		check_output((narc_output *)listNodeValue(node));
+	listReleaseIterator(iter);
+}
+
+void
+compile_stream_filters(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+		if (stream->filter != NULL)
+			compile_filter(stream->filter);
+	}
+	listReleaseIterator(iter);
+}
+
 void
 load_server_config_from_string(char *config)
 {
@@ -122,6 +281,14 @@ load_server_config_from_string(char *config)
 			if ((server.daemonize = yesnotoi(argv[1])) == -1) {
 				err = "argument must be 'yes' or 'no'"; goto loaderr;
 			}
+		} else if (!strcasecmp(argv[0], "verify-digest") && argc == 2) {
+			if ((server.verify_digest = yesnotoi(argv[1])) == -1) {
+				err = "argument must be 'yes' or 'no'"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "sequence-numbers") && argc == 2) {
+			if ((server.sequence_numbers = yesnotoi(argv[1])) == -1) {
+				err = "argument must be 'yes' or 'no'"; goto loaderr;
+			}
 		} else if (!strcasecmp(argv[0], "pidfile") && argc == 2) {
 			free(server.pidfile);
 			server.pidfile = strdup(argv[1]);
@@ -171,25 +338,149 @@ load_server_config_from_string(char *config)
 				err = "Invalid log facility. Must be one of 'user' or between 'local0-local7'";
 				goto loaderr;
 			}
+		} else if (!strcasecmp(argv[0],"stats-socket") && argc == 2) {
+			free(server.stats_socket);
+			server.stats_socket = strdup(argv[1]);
+		} else if (!strcasecmp(argv[0],"metrics-port") && argc == 2) {
+			server.metrics_port = atoi(argv[1]);
+			if (server.metrics_port < 0 || server.metrics_port > 65535) {
+				err = "Invalid port"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"metrics-bind") && argc == 2) {
+			free(server.metrics_bind);
+			server.metrics_bind = strdup(argv[1]);
 		} else if (!strcasecmp(argv[0], "remote-host") && argc == 2) {
-			free(server.host);
-			server.host = strdup(argv[1]);
+			free(server.default_output->host);
+			server.default_output->host = strdup(argv[1]);
 		} else if (!strcasecmp(argv[0], "remote-port") && argc == 2) {
-			server.port = atoi(argv[1]);
-			if (server.port < 0 || server.port > 65535) {
+			if ((err = parse_output_port(server.default_output, argv[1])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "remote-proto") && argc == 2) {
+			if ((err = parse_output_protocol(server.default_output, argv[1])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "remote-socket") && argc == 2) {
+			free(server.default_output->path);
+			server.default_output->path = strdup(argv[1]);
+		} else if (!strcasecmp(argv[0], "remote-queue") && argc == 3) {
+			if ((err = parse_output_queue(server.default_output, argv[1], argv[2])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "remote-connections") && argc == 2) {
+			if ((err = parse_output_connections(server.default_output, argv[1])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "remote-compression") && (argc == 2 || argc == 3)) {
+			if ((err = parse_output_compression(server.default_output, argv[1], argc == 3 ? argv[2] : NULL)) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "remote-dictionary") && argc == 2) {
+			if ((err = parse_output_dictionary(server.default_output, argv[1])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "output") && argc >= 3 && argc <= 5) {
+			narc_output *output;
+			if (find_output(argv[1]) != NULL) {
+				err = "Duplicate output name"; goto loaderr;
+			}
+			output = new_output(argv[1]);
+			listAddNodeTail(server.outputs, (void *)output);
+			if (!strcasecmp(argv[2],"group")) {
+				// members are added with output-member
+				if (argc != 4) {
+					err = "A group needs the protocol of its members"; goto loaderr;
+				}
+				if ((err = parse_output_protocol(output, argv[3])) != NULL) goto loaderr;
+				output->members = listCreate();
+				listSetFreeMethod(output->members, free_output);
+			} else if ((err = parse_output_protocol(output, argv[2])) != NULL) {
+				goto loaderr;
+			} else if (output->protocol == NARC_PROTO_SYSLOG) {
+				if (argc == 5) {
+					err = "A syslog output only takes a socket path"; goto loaderr;
+				}
+				if (argc == 4) {
+					free(output->path);
+					output->path = strdup(argv[3]);
+				}
+			} else {
+				if (argc != 5) {
+					err = "A udp or tcp output needs a host and a port"; goto loaderr;
+				}
+				free(output->host);
+				output->host = strdup(argv[3]);
+				if ((err = parse_output_port(output, argv[4])) != NULL) goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "output-member") && (argc == 3 || argc == 4)) {
+			narc_output *output = find_output(argv[1]);
+			if (output == NULL || output->members == NULL) {
+				err = "Unknown group, it must be declared before its members"; goto loaderr;
+			}
+			if ((output->protocol == NARC_PROTO_SYSLOG) != (argc == 3)) {
+				err = "A member needs a host and a port, or a socket path in a syslog group"; goto loaderr;
+			}
+			if (argc == 4 && (atoi(argv[3]) < 0 || atoi(argv[3]) > 65535)) {
 				err = "Invalid port"; goto loaderr;
 			}
-		} else if (!strcasecmp(argv[0], "remote-proto") && argc == 2) {
-			if (!strcasecmp(argv[1],"udp")) server.protocol = NARC_PROTO_UDP;
-			else if (!strcasecmp(argv[1],"tcp")) server.protocol = NARC_PROTO_TCP;
+			add_output_member(output, argv[2], argc == 4 ? atoi(argv[3]) : 0);
+		} else if (!strcasecmp(argv[0], "output-framing") && argc == 3) {
+			narc_output *output = find_output(argv[1]);
+			if (output == NULL) {
+				err = "Unknown output, it must be declared before its options"; goto loaderr;
+			}
+			if ((err = parse_output_framing(output, argv[2])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "output-packing") && (argc == 3 || argc == 4)) {
+			narc_output *output = find_output(argv[1]);
+			if (output == NULL) {
+				err = "Unknown output, it must be declared before its options"; goto loaderr;
+			}
+			if ((err = parse_output_packing(output, argv[2])) != NULL) goto loaderr;
+			if (argc == 4)
+				output->linger = atoll(argv[3]);
+		} else if (!strcasecmp(argv[0], "output-connections") && argc == 3) {
+			narc_output *output = find_output(argv[1]);
+			if (output == NULL) {
+				err = "Unknown output, it must be declared before its options"; goto loaderr;
+			}
+			if ((err = parse_output_connections(output, argv[2])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "output-compression") && (argc == 3 || argc == 4)) {
+			narc_output *output = find_output(argv[1]);
+			if (output == NULL) {
+				err = "Unknown output, it must be declared before its options"; goto loaderr;
+			}
+			if ((err = parse_output_compression(output, argv[2], argc == 4 ? argv[3] : NULL)) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "output-dictionary") && argc == 3) {
+			narc_output *output = find_output(argv[1]);
+			if (output == NULL) {
+				err = "Unknown output, it must be declared before its options"; goto loaderr;
+			}
+			if ((err = parse_output_dictionary(output, argv[2])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "output-queue") && argc == 4) {
+			narc_output *output = find_output(argv[1]);
+			if (output == NULL) {
+				err = "Unknown output, it must be declared before its options"; goto loaderr;
+			}
+			if ((err = parse_output_queue(output, argv[2], argv[3])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "remote-format") && argc == 2) {
+			if (!strcasecmp(argv[1],"rfc3164")) server.format = NARC_FORMAT_RFC3164;
+			else if (!strcasecmp(argv[1],"rfc5424")) server.format = NARC_FORMAT_RFC5424;
 			else {
-				err = "Invalid protocol. Must be either udp or tcp";
+				err = "Invalid format. Must be either rfc3164 or rfc5424";
 				goto loaderr;
 			}
+		} else if (!strcasecmp(argv[0], "remote-framing") && argc == 2) {
+			if ((err = parse_output_framing(server.default_output, argv[1])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "udp-packing") && argc == 2) {
+			if ((err = parse_output_packing(server.default_output, argv[1])) != NULL) goto loaderr;
+		} else if (!strcasecmp(argv[0], "udp-linger") && argc == 2) {
+			server.default_output->linger = atoll(argv[1]);
 		} else if (!strcasecmp(argv[0], "max-connect-attempts") && argc == 2) {
 			server.max_connect_attempts = atoi(argv[1]);
 		} else if (!strcasecmp(argv[0], "connect-retry-delay") && argc == 2) {
 			server.connect_retry_delay = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0], "dns-ttl") && argc == 2) {
+			server.dns_ttl = atoll(argv[1]);
+		} else if (!strcasecmp(argv[0], "bandwidth-limit") && argc == 2) {
+			int memerr;
+			server.bandwidth_limit = memtoll(argv[1], &memerr);
+			if (memerr) {
+				err = "Invalid bandwidth limit"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0], "bandwidth-burst") && argc == 2) {
+			int memerr;
+			server.bandwidth_burst = memtoll(argv[1], &memerr);
+			if (memerr) {
+				err = "Invalid bandwidth burst"; goto loaderr;
+			}
 		} else if (!strcasecmp(argv[0], "max-open-attempts") && argc == 2) {
 			server.max_open_attempts = atoi(argv[1]);
 		} else if (!strcasecmp(argv[0], "open-retry-delay") && argc == 2) {
@@ -229,13 +520,116 @@ load_server_config_from_string(char *config)
 			char *id = sdsdup(argv[1]);
 			char *file = sdsdup(argv[2]);
 			narc_stream *stream = new_stream(id, file);
+			stream->number = listLength(server.streams);
 			listAddNodeTail(server.streams, (void *)stream);
+		} else if (!strcasecmp(argv[0],"stream-multiline") && argc == 4) {
+			narc_stream *stream = find_stream(argv[1]);
+			if (stream == NULL) {
+				err = "Unknown stream, it must be declared before its options"; goto loaderr;
+			}
+			if (!strcasecmp(argv[2],"start")) stream->multiline_mode = NARC_MULTILINE_START;
+			else if (!strcasecmp(argv[2],"continue")) stream->multiline_mode = NARC_MULTILINE_CONTINUE;
+			else {
+				err = "Invalid multiline mode. Must be either start or continue";
+				goto loaderr;
+			}
+			if (stream->multiline_pattern) sdsfree(stream->multiline_pattern);
+			stream->multiline_pattern = sdsdup(argv[3]);
+		} else if (!strcasecmp(argv[0],"stream-filter") && argc == 5) {
+			narc_stream *stream = find_stream(argv[1]);
+			int action, type;
+			if (stream == NULL) {
+				err = "Unknown stream, it must be declared before its options"; goto loaderr;
+			}
+			if (!strcasecmp(argv[2],"include")) action = NARC_FILTER_INCLUDE;
+			else if (!strcasecmp(argv[2],"exclude")) action = NARC_FILTER_EXCLUDE;
+			else {
+				err = "Invalid filter action. Must be either include or exclude";
+				goto loaderr;
+			}
+			if (!strcasecmp(argv[3],"glob")) type = NARC_FILTER_GLOB;
+			else if (!strcasecmp(argv[3],"literal")) type = NARC_FILTER_LITERAL;
+			else {
+				err = "Invalid filter type. Must be either glob or literal";
+				goto loaderr;
+			}
+			if (sdslen(argv[4]) == 0) {
+				err = "Filter pattern can't be empty"; goto loaderr;
+			}
+			if (stream->filter == NULL) stream->filter = new_filter();
+			filter_add_rule(stream->filter, action, type, argv[4]);
+		} else if (!strcasecmp(argv[0],"stream-sample") && (argc == 3 || argc == 4)) {
+			narc_stream *stream = find_stream(argv[1]);
+			double ratio = strtod(argv[2], NULL);
+			if (stream == NULL) {
+				err = "Unknown stream, it must be declared before its options"; goto loaderr;
+			}
+			if (ratio <= 0 || ratio > 1) {
+				err = "Invalid sample ratio. Must be greater than 0 and at most 1";
+				goto loaderr;
+			}
+			stream->sample_rate = 1 / ratio;
+			stream->sample_threshold = (ratio == 1) ? UINT64_MAX : (uint64_t)(ratio * 18446744073709551616.0);
+			stream->sample_field = (argc == 4) ? atoi(argv[3]) : 0;
+			if (stream->sample_field < 0) {
+				err = "Invalid sample field"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"multiline-max-lines") && argc == 2) {
+			server.multiline_max_lines = atoi(argv[1]);
+			if (server.multiline_max_lines < 1) {
+				err = "Invalid multiline max lines"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"multiline-max-bytes") && argc == 2) {
+			server.multiline_max_bytes = atoi(argv[1]);
+			if (server.multiline_max_bytes < NARC_MAX_MESSAGE_SIZE) {
+				err = "Invalid multiline max bytes"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"multiline-timeout") && argc == 2) {
+			server.multiline_timeout = atoll(argv[1]);
+			if ((long long)server.multiline_timeout < 1) {
+				err = "Invalid multiline timeout"; goto loaderr;
+			}
 		} else if (!strcasecmp(argv[0],"rate-limit") && argc == 2) {
 			server.rate_limit = atoi(argv[1]);
 		} else if (!strcasecmp(argv[0],"rate-time") && argc == 2) {
 			server.rate_time = atoi(argv[1]);
+		} else if (!strcasecmp(argv[0],"global-rate-limit") && argc == 2) {
+			server.global_rate_limit = atoi(argv[1]);
+			if (server.global_rate_limit < 0) {
+				err = "Invalid global rate limit"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"stream-weight") && argc == 3) {
+			narc_stream *stream = find_stream(argv[1]);
+			if (stream == NULL) {
+				err = "Unknown stream, it must be declared before its options"; goto loaderr;
+			}
+			stream->weight = atoi(argv[2]);
+			if (stream->weight < 1) {
+				err = "Invalid stream weight"; goto loaderr;
+			}
 		} else if (!strcasecmp(argv[0],"truncate-limit") && argc == 2) {
 			server.truncate_limit = atoi(argv[1]);
+		} else if (!strcasecmp(argv[0],"lag-warning-bytes") && argc == 2) {
+			int memerr;
+			server.lag_warning_bytes = memtoll(argv[1], &memerr);
+			if (memerr) {
+				err = "Invalid lag warning threshold"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"lag-warning-interval") && argc == 2) {
+			server.lag_warning_interval = atoll(argv[1]);
+			if (server.lag_warning_interval < 1) {
+				err = "Invalid lag warning interval"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"log-buffer-size") && argc == 2) {
+			server.log_buffer_size = memtoll(argv[1], NULL);
+			if (server.log_buffer_size < NARC_MAX_LOGMSG_LEN) {
+				err = "Invalid log buffer size"; goto loaderr;
+			}
+		} else if (!strcasecmp(argv[0],"watchdog-period") && argc == 2) {
+			server.watchdog_period = atoi(argv[1]);
+			if (server.watchdog_period < 0) {
+				err = "Invalid watchdog period"; goto loaderr;
+			}
 		} else {
 			err = "Bad directive or wrong number of arguments"; goto loaderr;
 		}
@@ -243,6 +637,8 @@ load_server_config_from_string(char *config)
 	}
 	sdsfreesplitres(lines,totlines);
 
+	compile_stream_filters();
+	check_outputs();
 	return;
 
 loaderr:
@@ -37,6 +37,10 @@
 
 #include <arpa/inet.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_BACKTRACE
 #include <execinfo.h>
@@ -89,11 +93,24 @@ void mixDigest(unsigned char *digest, void *ptr, size_t len) {
     SHA1Final(digest,&ctx);
 }
 
+/* Hex encode a 20 bytes digest into hex, which must hold 41 bytes. */
+void digestHex(unsigned char *digest, char *hex) {
+    const char *charset = "0123456789abcdef";
+    int j;
+
+    for (j = 0; j < 20; j++) {
+        hex[j*2] = charset[(digest[j]&0xF0)>>4];
+        hex[j*2+1] = charset[digest[j]&0xF];
+    }
+    hex[40] = '\0';
+}
+
 /* =========================== Crash handling  ============================== */
 
 void _narcAssert(char *estr, char *file, int line) {
     narc_log(NARC_WARNING,"=== ASSERTION FAILED ===");
     narc_log(NARC_WARNING,"==> %s:%d '%s' is not true",file,line,estr);
+    logger_flush(&server.logger);
 #ifdef HAVE_BACKTRACE
     server.assert_failed = estr;
     server.assert_file = file;
@@ -111,5 +128,131 @@ void _narcPanic(char *msg, char *file, int line) {
     narc_log(NARC_WARNING,"(forcing SIGSEGV in order to print the stack trace)");
 #endif
     narc_log(NARC_WARNING,"------------------------------------------------");
+    logger_flush(&server.logger);
     *((char*)-1) = 'x';
 }
+
+/* ========================== Software Watchdog ============================= */
+
+/* A thread pings the loop through an async handle every quarter period.
+ * An idle loop answers within microseconds, so a ping left unanswered for
+ * longer than watchdog-period means a callback is blocking the loop. The
+ * watchdog then interrupts the loop thread with SIGALRM, whose handler
+ * logs the stack it was stuck in. */
+
+#ifdef HAVE_BACKTRACE
+static int openDirectLogFiledes(void) {
+    int log_to_stdout = server.logfile[0] == '\0';
+
+    return log_to_stdout ? STDOUT_FILENO :
+        open(server.logfile, O_APPEND|O_CREAT|O_WRONLY, 0644);
+}
+
+static void closeDirectLogFiledes(int fd) {
+    int log_to_stdout = server.logfile[0] == '\0';
+    if (!log_to_stdout && fd != -1) close(fd);
+}
+
+/* Log the stack trace of the current thread using the async signal safe
+ * backtrace_symbols_fd(). */
+static void logStackTrace(void) {
+    void *trace[100];
+    int trace_size, fd = openDirectLogFiledes();
+
+    if (fd == -1) return;
+    trace_size = backtrace(trace, 100);
+    backtrace_symbols_fd(trace, trace_size, fd);
+    closeDirectLogFiledes(fd);
+}
+#endif
+
+static void watchdogSignalHandler(int sig, siginfo_t *info, void *secret) {
+    NARC_NOTUSED(sig);
+    NARC_NOTUSED(info);
+    NARC_NOTUSED(secret);
+
+    narc_log_from_handler(NARC_WARNING,"\n--- WATCHDOG TIMER EXPIRED ---");
+#ifdef HAVE_BACKTRACE
+    logStackTrace();
+#else
+    narc_log_from_handler(NARC_WARNING,"Sorry: no support for backtrace().");
+#endif
+    narc_log_from_handler(NARC_WARNING,"--------\n");
+}
+
+/* Runs on the loop: the ping was answered, measure how long it took. */
+static void watchdogPong(uv_async_t *handle) {
+    uint64_t now = uv_hrtime();
+    uint64_t elapsed = now - __atomic_load_n(&server.watchdog_ping, __ATOMIC_ACQUIRE);
+
+    NARC_NOTUSED(handle);
+    __atomic_store_n(&server.watchdog_pong, now, __ATOMIC_RELEASE);
+
+    if (elapsed > server.loop_max_stall)
+        server.loop_max_stall = elapsed;
+    if (elapsed > (uint64_t)server.watchdog_period * 1000000)
+        narc_log(NARC_WARNING, "Event loop stalled for %llu ms",
+            (unsigned long long)(elapsed / 1000000));
+}
+
+static void *watchdogMain(void *arg) {
+    useconds_t interval = server.watchdog_period * 250;
+    uint64_t period = (uint64_t)server.watchdog_period * 1000000;
+    int reported = 0;
+
+    NARC_NOTUSED(arg);
+    if (interval == 0) interval = 1;
+
+    while (__atomic_load_n(&server.watchdog_running, __ATOMIC_ACQUIRE)) {
+        uint64_t now = uv_hrtime();
+        uint64_t ping = __atomic_load_n(&server.watchdog_ping, __ATOMIC_ACQUIRE);
+        uint64_t pong = __atomic_load_n(&server.watchdog_pong, __ATOMIC_ACQUIRE);
+
+        if (pong >= ping) {
+            __atomic_store_n(&server.watchdog_ping, now, __ATOMIC_RELEASE);
+            uv_async_send(server.watchdog_async);
+            reported = 0;
+        } else if (!reported && now - ping > period) {
+            __atomic_add_fetch(&server.loop_stalls, 1, __ATOMIC_RELAXED);
+            pthread_kill(server.main_thread, SIGALRM);
+            reported = 1;
+        }
+        usleep(interval);
+    }
+    return NULL;
+}
+
+void init_watchdog(void) {
+    struct sigaction act;
+
+#ifdef HAVE_BACKTRACE
+    /* The first call to backtrace() may allocate while loading the
+     * unwinder, do it now rather than inside the signal handler. */
+    void *trace[1];
+    backtrace(trace, 1);
+#endif
+
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_ONSTACK | SA_SIGINFO | SA_RESTART;
+    act.sa_sigaction = watchdogSignalHandler;
+    sigaction(SIGALRM, &act, NULL);
+
+    server.watchdog_async = malloc(sizeof(uv_async_t));
+    uv_async_init(server.loop, server.watchdog_async, watchdogPong);
+    uv_unref((uv_handle_t *)server.watchdog_async);
+
+    server.main_thread = pthread_self();
+    server.watchdog_ping = server.watchdog_pong = uv_hrtime();
+    server.watchdog_running = 1;
+    if (pthread_create(&server.watchdog_thread, NULL, watchdogMain, NULL) != 0) {
+        narc_log(NARC_WARNING, "Unable to start the watchdog thread");
+        server.watchdog_running = 0;
+    }
+}
+
+/* Must run before the async handle is closed. */
+void stop_watchdog(void) {
+    if (!server.watchdog_running) return;
+    __atomic_store_n(&server.watchdog_running, 0, __ATOMIC_RELEASE);
+    pthread_join(server.watchdog_thread, NULL);
+}
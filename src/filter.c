@@ -0,0 +1,240 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "filter.h"
+
+#include "sds.h"	/* dynamic safe strings */
+#include "util.h"	/* Misc functions useful in many places */
+
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+
+/*============================ Utility functions ============================ */
+
+void
+free_pattern(void *ptr)
+{
+	sdsfree((sds)ptr);
+}
+
+int
+count_literal_states(list *literals)
+{
+	listIter *iter;
+	listNode *node;
+	int count = 0;
+
+	iter = listGetIterator(literals, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		count += sdslen((sds)listNodeValue(node));
+	listReleaseIterator(iter);
+
+	return count;
+}
+
+/* Add every literal to the trie, marking the final state with 'action'. */
+void
+add_literal_states(narc_filter *filter, list *literals, int action)
+{
+	listIter *iter;
+	listNode *node;
+
+	iter = listGetIterator(literals, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		sds literal = (sds)listNodeValue(node);
+		int state = 0;
+		size_t i;
+
+		for (i = 0; i < sdslen(literal); i++) {
+			int *next = &filter->delta[state * 256 + (unsigned char)literal[i]];
+			if (*next <= 0)
+				*next = filter->nstates++;
+			state = *next;
+		}
+		filter->output[state] |= action;
+	}
+	listReleaseIterator(iter);
+}
+
+int
+match_globs(list *globs, const char *line, size_t len)
+{
+	listIter *iter;
+	listNode *node;
+	int match = 0;
+
+	iter = listGetIterator(globs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		sds glob = (sds)listNodeValue(node);
+		if (stringmatchlen(glob, sdslen(glob), line, len, 0)) {
+			match = 1;
+			break;
+		}
+	}
+	listReleaseIterator(iter);
+
+	return match;
+}
+
+/*================================== API ==================================== */
+
+narc_filter
+*new_filter(void)
+{
+	narc_filter *filter = malloc(sizeof(narc_filter));
+
+	filter->include_globs    = listCreate();
+	filter->exclude_globs    = listCreate();
+	filter->include_literals = listCreate();
+	filter->exclude_literals = listCreate();
+	filter->includes         = 0;
+	filter->nstates          = 0;
+	filter->delta            = NULL;
+	filter->output           = NULL;
+
+	listSetFreeMethod(filter->include_globs, free_pattern);
+	listSetFreeMethod(filter->exclude_globs, free_pattern);
+	listSetFreeMethod(filter->include_literals, free_pattern);
+	listSetFreeMethod(filter->exclude_literals, free_pattern);
+
+	return filter;
+}
+
+void
+free_filter(narc_filter *filter)
+{
+	listRelease(filter->include_globs);
+	listRelease(filter->exclude_globs);
+	listRelease(filter->include_literals);
+	listRelease(filter->exclude_literals);
+	free(filter->delta);
+	free(filter->output);
+	free(filter);
+}
+
+void
+filter_add_rule(narc_filter *filter, int action, int type, char *pattern)
+{
+	list *rules;
+
+	if (type == NARC_FILTER_GLOB)
+		rules = (action == NARC_FILTER_INCLUDE) ? filter->include_globs : filter->exclude_globs;
+	else
+		rules = (action == NARC_FILTER_INCLUDE) ? filter->include_literals : filter->exclude_literals;
+
+	listAddNodeTail(rules, sdsnew(pattern));
+	if (action == NARC_FILTER_INCLUDE)
+		filter->includes++;
+}
+
+/* Build an Aho-Corasick automaton from the literal rules. The failure
+ * links are folded into a full transition table, so matching costs one
+ * table lookup per byte regardless of how many literals there are. */
+void
+compile_filter(narc_filter *filter)
+{
+	int max_states, *fail, *queue, head = 0, tail = 0, c;
+
+	if (listLength(filter->include_literals) + listLength(filter->exclude_literals) == 0)
+		return;
+
+	max_states = 1 + count_literal_states(filter->include_literals)
+		+ count_literal_states(filter->exclude_literals);
+
+	filter->delta   = calloc(max_states * 256, sizeof(int));
+	filter->output  = calloc(max_states, sizeof(unsigned char));
+	filter->nstates = 1;
+
+	add_literal_states(filter, filter->include_literals, NARC_FILTER_INCLUDE);
+	add_literal_states(filter, filter->exclude_literals, NARC_FILTER_EXCLUDE);
+
+	fail  = calloc(filter->nstates, sizeof(int));
+	queue = malloc(filter->nstates * sizeof(int));
+
+	for (c = 0; c < 256; c++) {
+		int next = filter->delta[c];
+		if (next > 0)
+			queue[tail++] = next;
+	}
+
+	while (head < tail) {
+		int state = queue[head++];
+		filter->output[state] |= filter->output[fail[state]];
+
+		for (c = 0; c < 256; c++) {
+			int *next = &filter->delta[state * 256 + c];
+			if (*next > 0) {
+				fail[*next] = filter->delta[fail[state] * 256 + c];
+				queue[tail++] = *next;
+			} else
+				*next = filter->delta[fail[state] * 256 + c];
+		}
+	}
+
+	free(fail);
+	free(queue);
+}
+
+/* Returns 1 if the line should be shipped, 0 if it should be dropped. */
+int
+filter_match(narc_filter *filter, const char *line, size_t len)
+{
+	int included = 0;
+
+	if (filter->nstates > 0) {
+		const int *delta = filter->delta;
+		const unsigned char *output = filter->output;
+		int state = 0, seen = output[0];
+		size_t i;
+
+		// an empty literal matches any line
+		if (seen & NARC_FILTER_EXCLUDE)
+			return 0;
+
+		for (i = 0; i < len; i++) {
+			// bytes that start no literal leave the root as it is
+			if (state == 0) {
+				while (i < len && delta[(unsigned char)line[i]] == 0)
+					i++;
+				if (i == len)
+					break;
+			}
+			state = delta[state * 256 + (unsigned char)line[i]];
+			seen |= output[state];
+			if (seen & NARC_FILTER_EXCLUDE)
+				return 0;
+		}
+		included = seen & NARC_FILTER_INCLUDE;
+	}
+
+	if (listLength(filter->exclude_globs) > 0 && match_globs(filter->exclude_globs, line, len))
+		return 0;
+
+	if (filter->includes == 0 || included)
+		return 1;
+
+	return match_globs(filter->include_globs, line, len);
+}
@@ -0,0 +1,68 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_FILTER
+#define NARC_FILTER 
+
+#include "adlist.h"	/* Linked lists */
+#include "sds.h"	/* dynamic safe strings */
+
+#include <stddef.h>
+
+/* Filter actions, also used as automaton output bits */
+#define NARC_FILTER_INCLUDE	1
+#define NARC_FILTER_EXCLUDE	2
+
+/* Filter rule types */
+#define NARC_FILTER_GLOB	1
+#define NARC_FILTER_LITERAL	2
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+typedef struct {
+	list		*include_globs;		/* glob patterns a line must match */
+	list		*exclude_globs;		/* glob patterns a line must not match */
+	list		*include_literals;	/* literal rules, until compiled */
+	list		*exclude_literals;	/* literal rules, until compiled */
+	int		includes;		/* number of include rules */
+	int		nstates;		/* automaton state count */
+	int		*delta;			/* nstates * 256 transitions */
+	unsigned char	*output;		/* action bits per state */
+} narc_filter;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+narc_filter	*new_filter(void);
+void		free_filter(narc_filter *filter);
+void		filter_add_rule(narc_filter *filter, int action, int type, char *pattern);
+void		compile_filter(narc_filter *filter);
+int		filter_match(narc_filter *filter, const char *line, size_t len);
+
+#endif
@@ -0,0 +1,109 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "histogram.h"
+
+#include <string.h>	/* string operations */
+
+/*============================ Utility functions ============================ */
+
+int
+histogram_index(uint64_t value)
+{
+	int shift;
+
+	if (value < (1 << NARC_HISTOGRAM_SUB_BITS))
+		return (int)value;
+
+	shift = (63 - __builtin_clzll(value)) - (NARC_HISTOGRAM_SUB_BITS - 1);
+	if (shift > NARC_HISTOGRAM_MAX_SHIFT)
+		return NARC_HISTOGRAM_BUCKETS - 1;
+
+	return (1 << NARC_HISTOGRAM_SUB_BITS)
+		+ (shift - 1) * (1 << (NARC_HISTOGRAM_SUB_BITS - 1))
+		+ (int)(value >> shift) - (1 << (NARC_HISTOGRAM_SUB_BITS - 1));
+}
+
+/* The highest value that lands in the bucket, so reported percentiles
+ * never understate the latency. */
+uint64_t
+histogram_value(int index)
+{
+	int shift;
+	uint64_t base;
+
+	if (index < (1 << NARC_HISTOGRAM_SUB_BITS))
+		return (uint64_t)index;
+
+	index -= (1 << NARC_HISTOGRAM_SUB_BITS);
+	shift  = index / (1 << (NARC_HISTOGRAM_SUB_BITS - 1)) + 1;
+	base   = (uint64_t)(index % (1 << (NARC_HISTOGRAM_SUB_BITS - 1)) + (1 << (NARC_HISTOGRAM_SUB_BITS - 1)));
+
+	return ((base + 1) << shift) - 1;
+}
+
+/*================================== API ==================================== */
+
+void
+histogram_reset(narc_histogram *histogram)
+{
+	memset(histogram, 0, sizeof(narc_histogram));
+}
+
+void
+histogram_record(narc_histogram *histogram, uint64_t value)
+{
+	histogram->counts[histogram_index(value)]++;
+	histogram->total += value;
+	if (histogram->count == 0 || value < histogram->min)
+		histogram->min = value;
+	if (value > histogram->max)
+		histogram->max = value;
+	histogram->count++;
+}
+
+uint64_t
+histogram_percentile(narc_histogram *histogram, double percentile)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	if (histogram->count == 0)
+		return 0;
+
+	target = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < NARC_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= target) {
+			uint64_t value = histogram_value(i);
+			return (value > histogram->max) ? histogram->max : value;
+		}
+	}
+
+	return histogram->max;
+}
@@ -0,0 +1,58 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_HISTOGRAM
+#define NARC_HISTOGRAM 
+
+#include <stdint.h>
+
+/* Values are bucketed HDR style: exact below 128, then 64 buckets per
+ * power of two, which keeps every bucket within 1.6% of its value. */
+#define NARC_HISTOGRAM_SUB_BITS		7
+#define NARC_HISTOGRAM_MAX_SHIFT	34	/* values up to 2^41 */
+#define NARC_HISTOGRAM_BUCKETS		((1 << NARC_HISTOGRAM_SUB_BITS) + NARC_HISTOGRAM_MAX_SHIFT * (1 << (NARC_HISTOGRAM_SUB_BITS - 1)))
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+typedef struct {
+	uint64_t	count;				/* values recorded */
+	uint64_t	total;				/* sum of the values recorded */
+	uint64_t	min;				/* smallest value recorded */
+	uint64_t	max;				/* largest value recorded */
+	uint64_t	counts[NARC_HISTOGRAM_BUCKETS];
+} narc_histogram;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+void		histogram_reset(narc_histogram *histogram);
+void		histogram_record(narc_histogram *histogram, uint64_t value);
+uint64_t	histogram_percentile(narc_histogram *histogram, double percentile);
+
+#endif
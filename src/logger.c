@@ -0,0 +1,274 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "logger.h"
+
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <fcntl.h>	/* file control options */
+
+/*============================ Utility functions ============================ */
+
+int
+open_log_file(void)
+{
+	if (server.logfile[0] == '\0')
+		return STDOUT_FILENO;
+
+	return open(server.logfile, O_WRONLY | O_APPEND | O_CREAT, 0644);
+}
+
+void
+close_log_file(int fd)
+{
+	if (fd != -1 && fd != STDOUT_FILENO)
+		close(fd);
+}
+
+void
+write_log_file(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n <= 0)
+			return;
+		data += n;
+		len -= n;
+	}
+}
+
+/* Write out everything pending in the ring. Only the drain moves the start
+ * of the ring, so the pending bytes stay put while write_lock is held and
+ * new lines can keep coming in behind them. */
+void
+drain_logger(narc_logger *logger)
+{
+	size_t start, len, chunk;
+
+	pthread_mutex_lock(&logger->write_lock);
+
+	pthread_mutex_lock(&logger->lock);
+	start = logger->start;
+	len = logger->len;
+	pthread_mutex_unlock(&logger->lock);
+
+	while (len > 0) {
+		chunk = logger->size - start;
+		if (chunk > len)
+			chunk = len;
+
+		if (logger->fd != -1)
+			write_log_file(logger->fd, logger->buffer + start, chunk);
+
+		start = (start + chunk) % logger->size;
+		len -= chunk;
+
+		pthread_mutex_lock(&logger->lock);
+		logger->start = start;
+		logger->len -= chunk;
+		pthread_mutex_unlock(&logger->lock);
+	}
+
+	pthread_mutex_unlock(&logger->write_lock);
+}
+
+/* Note the drops straight in the file, the ring they did not fit in may
+ * well still be full. */
+void
+report_dropped_lines(narc_logger *logger)
+{
+	char msg[128], line[256];
+	uint64_t dropped;
+	int len;
+
+	pthread_mutex_lock(&logger->lock);
+	dropped = logger->dropped - logger->reported;
+	logger->reported = logger->dropped;
+	pthread_mutex_unlock(&logger->lock);
+
+	if (dropped == 0 || NARC_WARNING < server.verbosity)
+		return;
+
+	snprintf(msg, sizeof(msg), "%llu log lines dropped, the log buffer was full",
+		(unsigned long long)dropped);
+	len = narc_log_format(NARC_WARNING, msg, line, sizeof(line));
+
+	pthread_mutex_lock(&logger->write_lock);
+	if (logger->fd != -1)
+		write_log_file(logger->fd, line, len);
+	pthread_mutex_unlock(&logger->write_lock);
+	if (server.syslog_enabled)
+		syslog(LOG_WARNING, "%s", msg);
+}
+
+/*============================== Callbacks ================================== */
+
+void *
+logger_thread(void *arg)
+{
+	narc_logger *logger = (narc_logger *)arg;
+	int running, reopen;
+
+	do {
+		pthread_mutex_lock(&logger->lock);
+		while (logger->len == 0 && logger->running && !logger->reopen)
+			pthread_cond_wait(&logger->cond, &logger->lock);
+		running = logger->running;
+		reopen = logger->reopen;
+		logger->reopen = 0;
+		pthread_mutex_unlock(&logger->lock);
+
+		if (reopen) {
+			pthread_mutex_lock(&logger->write_lock);
+			close_log_file(logger->fd);
+			logger->fd = open_log_file();
+			pthread_mutex_unlock(&logger->write_lock);
+		}
+
+		drain_logger(logger);
+		report_dropped_lines(logger);
+	} while (running);
+
+	return NULL;
+}
+
+/*================================= API ===================================== */
+
+void
+init_logger(narc_logger *logger, size_t size)
+{
+	pthread_mutex_init(&logger->lock, NULL);
+	pthread_mutex_init(&logger->write_lock, NULL);
+	pthread_cond_init(&logger->cond, NULL);
+
+	logger->buffer = malloc(size);
+	logger->size = size;
+	logger->start = 0;
+	logger->len = 0;
+	logger->fd = open_log_file();
+	logger->dropped = 0;
+	logger->reported = 0;
+	logger->reopen = 0;
+	logger->running = 1;
+
+	if (pthread_create(&logger->thread, NULL, logger_thread, logger) != 0) {
+		logger->running = 0;
+		narc_log(NARC_WARNING, "Unable to start the logger thread, logging synchronously");
+	}
+}
+
+/* Queue a formatted line. Lines that do not fit are dropped and counted
+ * rather than making the caller wait on the disk. Before the thread is
+ * started, and once it is stopped, lines are written synchronously. */
+void
+logger_write(narc_logger *logger, const char *line, size_t len)
+{
+	size_t end, chunk;
+
+	if (!logger->running) {
+		int fd = open_log_file();
+		if (fd == -1)
+			return;
+		write_log_file(fd, line, len);
+		close_log_file(fd);
+		return;
+	}
+
+	pthread_mutex_lock(&logger->lock);
+	if (len > logger->size - logger->len) {
+		logger->dropped++;
+		pthread_mutex_unlock(&logger->lock);
+		return;
+	}
+
+	end = (logger->start + logger->len) % logger->size;
+	chunk = logger->size - end;
+	if (chunk > len)
+		chunk = len;
+	memcpy(logger->buffer + end, line, chunk);
+	memcpy(logger->buffer, line + chunk, len - chunk);
+	logger->len += len;
+
+	pthread_cond_signal(&logger->cond);
+	pthread_mutex_unlock(&logger->lock);
+}
+
+/* Reopen the log file, typically after it was rotated. */
+void
+logger_reopen(narc_logger *logger)
+{
+	if (!logger->running)
+		return;
+
+	pthread_mutex_lock(&logger->lock);
+	logger->reopen = 1;
+	pthread_cond_signal(&logger->cond);
+	pthread_mutex_unlock(&logger->lock);
+}
+
+/* Write out the pending lines from the calling thread, used right before
+ * crashing on purpose. */
+void
+logger_flush(narc_logger *logger)
+{
+	if (logger->running)
+		drain_logger(logger);
+}
+
+void
+stop_logger(narc_logger *logger)
+{
+	if (!logger->running)
+		return;
+
+	pthread_mutex_lock(&logger->lock);
+	logger->running = 0;
+	pthread_cond_signal(&logger->cond);
+	pthread_mutex_unlock(&logger->lock);
+
+	pthread_join(logger->thread, NULL);
+	drain_logger(logger);
+	close_log_file(logger->fd);
+	free(logger->buffer);
+}
+
+uint64_t
+logger_dropped(narc_logger *logger)
+{
+	uint64_t dropped;
+
+	if (!logger->running)
+		return logger->dropped;
+
+	pthread_mutex_lock(&logger->lock);
+	dropped = logger->dropped;
+	pthread_mutex_unlock(&logger->lock);
+
+	return dropped;
+}
@@ -0,0 +1,65 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_LOGGER
+#define NARC_LOGGER 
+
+#include <pthread.h>	/* logger thread */
+#include <stddef.h>	/* size_t */
+#include <stdint.h>	/* uint64_t */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+typedef struct {
+	pthread_mutex_t	lock;			/* guards the ring and the flags */
+	pthread_mutex_t	write_lock;		/* held while writing to fd */
+	pthread_cond_t	cond;			/* wakes the logger thread */
+	pthread_t	thread;			/* writes the ring out to fd */
+	char		*buffer;		/* ring of formatted lines */
+	size_t		size;			/* ring capacity */
+	size_t		start;			/* offset of the oldest pending byte */
+	size_t		len;			/* bytes waiting to be written */
+	int		fd;			/* log file, kept open */
+	int		running;		/* the thread is accepting lines */
+	int		reopen;			/* reopen the file before the next write */
+	uint64_t	dropped;		/* lines dropped because the ring was full */
+	uint64_t	reported;		/* drops already noted in the log */
+} narc_logger;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+void	init_logger(narc_logger *logger, size_t size);
+void	logger_write(narc_logger *logger, const char *line, size_t len);
+void	logger_reopen(narc_logger *logger);
+void	logger_flush(narc_logger *logger);
+void	stop_logger(narc_logger *logger);
+uint64_t logger_dropped(narc_logger *logger);
+
+#endif
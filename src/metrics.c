@@ -0,0 +1,452 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "metrics.h"
+#include "stream.h"
+#include "output.h"
+
+#include "sds.h"	/* dynamic safe strings */
+#include "util.h"	/* Misc functions useful in many places */
+
+#include <stddef.h>	/* offsetof */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <uv.h>		/* Event driven programming library */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+static struct {
+	const char	*name;
+	const char	*type;
+	const char	*help;
+	size_t		offset;
+} streamMetrics[] = {
+	{"narc_stream_read_bytes_total", "counter", "Bytes read from the file.", offsetof(narc_stream, read_bytes)},
+	{"narc_stream_lines_total", "counter", "Lines read from the file.", offsetof(narc_stream, line_count)},
+	{"narc_stream_sent_messages_total", "counter", "Messages taken by at least one output.", offsetof(narc_stream, sent_count)},
+	{"narc_stream_sent_bytes_total", "counter", "Bytes taken by at least one output.", offsetof(narc_stream, sent_bytes)},
+	{"narc_stream_suppressed_total", "counter", "Messages dropped by rate limiting.", offsetof(narc_stream, suppressed_count)},
+	{"narc_stream_filtered_total", "counter", "Records dropped by the stream filter.", offsetof(narc_stream, filtered_count)},
+	{"narc_stream_sampled_total", "counter", "Records dropped by sampling.", offsetof(narc_stream, sampled_count)},
+	{"narc_stream_dropped_total", "counter", "Messages no output took.", offsetof(narc_stream, dropped_count)},
+	{NULL, NULL, NULL, 0}
+};
+
+/* gauges computed from the transport rather than read from the output */
+#define NARC_METRIC_CONNECTED	((size_t)-1)
+#define NARC_METRIC_QUEUE_BYTES	((size_t)-2)
+#define NARC_METRIC_BLOCKED	((size_t)-3)
+
+static struct {
+	const char	*name;
+	const char	*type;
+	const char	*help;
+	size_t		offset;
+} outputMetrics[] = {
+	{"narc_transport_connected", "gauge", "Whether the output can send.", NARC_METRIC_CONNECTED},
+	{"narc_transport_queue_bytes", "gauge", "Bytes waiting to be written.", NARC_METRIC_QUEUE_BYTES},
+	{"narc_transport_blocked", "gauge", "Whether the output is full and holding the reads.", NARC_METRIC_BLOCKED},
+	{"narc_transport_reconnects_total", "counter", "Connections lost or refused.", offsetof(narc_output, reconnects)},
+	{"narc_transport_write_calls_total", "counter", "Writes issued.", offsetof(narc_output, write_calls)},
+	{"narc_transport_write_messages_total", "counter", "Messages written.", offsetof(narc_output, write_messages)},
+	{"narc_transport_write_bytes_total", "counter", "Bytes written.", offsetof(narc_output, write_bytes)},
+	{"narc_transport_write_errors_total", "counter", "Writes that failed.", offsetof(narc_output, write_errors)},
+	{"narc_transport_dropped_total", "counter", "Messages dropped while disconnected or over the queue limit.", offsetof(narc_output, dropped)},
+	{"narc_transport_blocked_total", "counter", "Times the output held the reads.", offsetof(narc_output, blocked_count)},
+	{"narc_transport_compress_in_bytes_total", "counter", "Bytes handed to the compressor.", offsetof(narc_output, compress_in_bytes)},
+	{"narc_transport_compress_out_bytes_total", "counter", "Bytes out of the compressor.", offsetof(narc_output, compress_out_bytes)},
+	{"narc_transport_compress_cpu_nanoseconds_total", "counter", "CPU time spent compressing.", offsetof(narc_output, compress_cpu_ns)},
+	{NULL, NULL, NULL, 0}
+};
+
+/*============================ Utility functions ============================ */
+
+sds
+metrics_header(sds metrics, const char *name, const char *type, const char *help)
+{
+	return sdscatprintf(metrics, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+sds
+metrics_value(sds metrics, const char *name, const char *type, const char *help, unsigned long long value)
+{
+	metrics = metrics_header(metrics, name, type, help);
+	return sdscatprintf(metrics, "%s %llu\n", name, value);
+}
+
+sds
+metrics_seconds(sds metrics, const char *name, const char *type, const char *help, double value)
+{
+	metrics = metrics_header(metrics, name, type, help);
+	return sdscatprintf(metrics, "%s %.9f\n", name, value);
+}
+
+/* Label values are escaped the way the exposition format wants them. */
+sds
+metrics_label(sds metrics, const char *value)
+{
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			metrics = sdscatprintf(metrics, "\\%c", *value);
+		else if (*value == '\n')
+			metrics = sdscatlen(metrics, "\\n", 2);
+		else
+			metrics = sdscatlen(metrics, value, 1);
+	}
+	return metrics;
+}
+
+sds
+metrics_streams(sds metrics)
+{
+	listIter *iter;
+	listNode *node;
+	int i;
+
+	for (i = 0; streamMetrics[i].name; i++) {
+		metrics = metrics_header(metrics, streamMetrics[i].name, streamMetrics[i].type, streamMetrics[i].help);
+
+		iter = listGetIterator(server.streams, AL_START_HEAD);
+		while ((node = listNext(iter)) != NULL) {
+			narc_stream *stream = (narc_stream *)listNodeValue(node);
+			uint64_t value = *(uint64_t *)((char *)stream + streamMetrics[i].offset);
+
+			metrics = sdscatprintf(metrics, "%s{stream=\"", streamMetrics[i].name);
+			metrics = metrics_label(metrics, stream->id);
+			metrics = sdscatprintf(metrics, "\"} %llu\n", (unsigned long long)value);
+		}
+		listReleaseIterator(iter);
+	}
+
+	metrics = metrics_header(metrics, "narc_stream_lag_bytes", "gauge", "Bytes between the read offset and the end of the file.");
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+
+		metrics = sdscat(metrics, "narc_stream_lag_bytes{stream=\"");
+		metrics = metrics_label(metrics, stream->id);
+		metrics = sdscatprintf(metrics, "\"} %lld\n", (long long)stream_lag_bytes(stream));
+	}
+	listReleaseIterator(iter);
+
+	metrics = metrics_header(metrics, "narc_stream_lag_seconds", "gauge", "Estimated seconds the stream is behind the end of the file.");
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+
+		metrics = sdscat(metrics, "narc_stream_lag_seconds{stream=\"");
+		metrics = metrics_label(metrics, stream->id);
+		metrics = sdscatprintf(metrics, "\"} %llu\n", (unsigned long long)stream_lag_seconds(stream));
+	}
+	listReleaseIterator(iter);
+
+	return metrics;
+}
+
+/* The samples of one output metric, groups standing for their members. */
+sds
+metrics_output(sds metrics, int i, narc_output *output)
+{
+	unsigned long long value;
+
+	if (output->members != NULL) {
+		listIter *iter = listGetIterator(output->members, AL_START_HEAD);
+		listNode *node;
+
+		while ((node = listNext(iter)) != NULL)
+			metrics = metrics_output(metrics, i, (narc_output *)listNodeValue(node));
+		listReleaseIterator(iter);
+		return metrics;
+	}
+
+	if (outputMetrics[i].offset == NARC_METRIC_CONNECTED)
+		value = output_connected(output);
+	else if (outputMetrics[i].offset == NARC_METRIC_QUEUE_BYTES)
+		value = output_queue_bytes(output);
+	else if (outputMetrics[i].offset == NARC_METRIC_BLOCKED)
+		value = output->blocked;
+	else
+		value = *(uint64_t *)((char *)output + outputMetrics[i].offset);
+
+	metrics = sdscatprintf(metrics, "%s{output=\"", outputMetrics[i].name);
+	metrics = metrics_label(metrics, output->name);
+	return sdscatprintf(metrics, "\"} %llu\n", value);
+}
+
+sds
+metrics_transport(sds metrics)
+{
+	listIter *iter;
+	listNode *node;
+	int i, groups = 0;
+
+	for (i = 0; outputMetrics[i].name; i++) {
+		metrics = metrics_header(metrics, outputMetrics[i].name, outputMetrics[i].type, outputMetrics[i].help);
+
+		iter = listGetIterator(server.outputs, AL_START_HEAD);
+		while ((node = listNext(iter)) != NULL)
+			metrics = metrics_output(metrics, i, (narc_output *)listNodeValue(node));
+		listReleaseIterator(iter);
+	}
+
+	iter = listGetIterator(server.outputs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		groups += ((narc_output *)listNodeValue(node))->members != NULL;
+	listReleaseIterator(iter);
+
+	if (groups > 0) {
+		metrics = metrics_header(metrics, "narc_group_healthy_members", "gauge", "Members of the group able to send.");
+		iter = listGetIterator(server.outputs, AL_START_HEAD);
+		while ((node = listNext(iter)) != NULL) {
+			narc_output *output = (narc_output *)listNodeValue(node);
+			if (output->members == NULL)
+				continue;
+			metrics = sdscat(metrics, "narc_group_healthy_members{output=\"");
+			metrics = metrics_label(metrics, output->name);
+			metrics = sdscatprintf(metrics, "\"} %d\n", output_connected(output));
+		}
+		listReleaseIterator(iter);
+
+		metrics = metrics_header(metrics, "narc_group_failovers_total", "counter", "Messages sent past their member while it was down.");
+		iter = listGetIterator(server.outputs, AL_START_HEAD);
+		while ((node = listNext(iter)) != NULL) {
+			narc_output *output = (narc_output *)listNodeValue(node);
+			if (output->members == NULL)
+				continue;
+			metrics = sdscat(metrics, "narc_group_failovers_total{output=\"");
+			metrics = metrics_label(metrics, output->name);
+			metrics = sdscatprintf(metrics, "\"} %llu\n", (unsigned long long)output->failovers);
+		}
+		listReleaseIterator(iter);
+	}
+
+	metrics = metrics_value(metrics, "narc_bandwidth_rate_bytes", "gauge", "Bytes per second sent over the last second.", server.shaper.current_rate);
+	metrics = metrics_seconds(metrics, "narc_bandwidth_throttled_seconds_total", "counter", "Time spent waiting on the bandwidth limit.", shaper_throttled_time(&server.shaper) / 1000.0);
+
+	return metrics;
+}
+
+sds
+metrics_process(sds metrics)
+{
+	metrics = metrics_value(metrics, "narc_uptime_seconds", "gauge", "Seconds since narc started.", time(NULL) - server.start_time);
+	metrics = metrics_value(metrics, "narc_log_dropped_total", "counter", "Log lines dropped because the log buffer was full.", logger_dropped(&server.logger));
+	metrics = metrics_value(metrics, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes.", getRSS());
+
+	metrics = metrics_header(metrics, "narc_loop_iteration_seconds", "summary", "Time spent handling events per loop iteration.");
+	metrics = sdscatprintf(metrics, "narc_loop_iteration_seconds_sum %.9f\n", server.loop_busy_time / 1e9);
+	metrics = sdscatprintf(metrics, "narc_loop_iteration_seconds_count %llu\n", (unsigned long long)server.loop_iterations);
+	metrics = metrics_seconds(metrics, "narc_loop_iteration_max_seconds", "gauge", "Longest loop iteration.", server.loop_max_busy / 1e9);
+	metrics = metrics_header(metrics, "narc_loop_stalls_total", "counter", "Watchdog pings left unanswered past the watchdog period.");
+	metrics = sdscatprintf(metrics, "narc_loop_stalls_total %llu\n", (unsigned long long)__atomic_load_n(&server.loop_stalls, __ATOMIC_RELAXED));
+	metrics = metrics_seconds(metrics, "narc_loop_max_stall_seconds", "gauge", "Longest time the loop took to answer the watchdog.", server.loop_max_stall / 1e9);
+
+	return metrics;
+}
+
+sds
+metrics_histogram(sds metrics, const char *name, const char *help, narc_histogram *histogram)
+{
+	double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	int i;
+
+	metrics = metrics_header(metrics, name, "summary", help);
+	for (i = 0; i < 4; i++)
+		metrics = sdscatprintf(metrics, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[i],
+			histogram_percentile(histogram, quantiles[i] * 100) / 1e6);
+	metrics = sdscatprintf(metrics, "%s_sum %.6f\n", name, histogram->total / 1e6);
+	return sdscatprintf(metrics, "%s_count %llu\n", name, (unsigned long long)histogram->count);
+}
+
+sds
+metrics_latency(sds metrics)
+{
+	metrics = metrics_histogram(metrics, "narc_read_latency_seconds", "Time from a file change to its read completing.", &server.read_latency);
+	return metrics_histogram(metrics, "narc_send_latency_seconds", "Time from a read completing to its messages being written.", &server.send_latency);
+}
+
+/*============================== Callbacks ================================== */
+
+void
+handle_metrics_close(uv_handle_t *handle)
+{
+	narc_metrics_connection *connection = (narc_metrics_connection *)handle;
+
+	if (connection->response != NULL)
+		sdsfree(connection->response);
+	free(connection);
+}
+
+void
+handle_metrics_write(uv_write_t *req, int status)
+{
+	narc_metrics_connection *connection = (narc_metrics_connection *)req->data;
+
+	if (connection->response == NULL)
+		server.metrics_busy = 0;
+	uv_close((uv_handle_t *)&connection->socket, handle_metrics_close);
+}
+
+void
+handle_metrics_alloc_buffer(uv_handle_t *handle, size_t len, struct uv_buf_t *buf)
+{
+	narc_metrics_connection *connection = (narc_metrics_connection *)handle;
+
+	buf->base = connection->request + connection->len;
+	buf->len = NARC_METRICS_REQUEST_SIZE - connection->len;
+}
+
+void
+respond_metrics(narc_metrics_connection *connection)
+{
+	sds body;
+	uv_buf_t bufs[2];
+	char header[160];
+	int found = !strncmp(connection->request, "GET /metrics ", 13) ||
+		!strncmp(connection->request, "GET /metrics?", 13);
+
+	/* The shared buffer is only rendered into when no earlier scrape is
+	 * still being written out, which in practice is always. */
+	int shared = !server.metrics_busy;
+
+	if (!shared)
+		body = sdsempty();
+	else if (server.metrics_buffer == NULL)
+		body = sdsempty();
+	else {
+		body = server.metrics_buffer;
+		sdsclear(body);
+	}
+
+	if (found)
+		body = metrics_render(body);
+	else
+		body = sdscat(body, "Not Found\n");
+
+	if (shared) {
+		server.metrics_buffer = body;
+		server.metrics_busy = 1;
+	} else
+		connection->response = body;
+
+	snprintf(header, sizeof(header),
+		"HTTP/1.1 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\n"
+		"Connection: close\r\n\r\n",
+		found ? "200 OK" : "404 Not Found",
+		(unsigned long)sdslen(body));
+
+	bufs[0] = uv_buf_init(header, strlen(header));
+	bufs[1] = uv_buf_init(body, sdslen(body));
+	connection->write_req.data = (void *)connection;
+
+	if (uv_write(&connection->write_req, (uv_stream_t *)&connection->socket, bufs, 2, handle_metrics_write) != 0) {
+		if (connection->response == NULL)
+			server.metrics_busy = 0;
+		uv_close((uv_handle_t *)&connection->socket, handle_metrics_close);
+	}
+}
+
+void
+handle_metrics_read(uv_stream_t *stream, ssize_t nread, const struct uv_buf_t *buf)
+{
+	narc_metrics_connection *connection = (narc_metrics_connection *)stream;
+
+	if (nread < 0) {
+		uv_close((uv_handle_t *)stream, handle_metrics_close);
+		return;
+	}
+
+	connection->len += nread;
+	connection->request[connection->len] = '\0';
+
+	/* wait for the end of the request headers, the body is ignored */
+	if (strstr(connection->request, "\r\n\r\n") == NULL) {
+		if (connection->len == NARC_METRICS_REQUEST_SIZE)
+			uv_close((uv_handle_t *)stream, handle_metrics_close);
+		return;
+	}
+
+	uv_read_stop(stream);
+	respond_metrics(connection);
+}
+
+void
+handle_metrics_connection(uv_stream_t *listener, int status)
+{
+	if (status != 0) {
+		narc_log(NARC_WARNING, "Metrics connection error: %s", uv_err_name(status));
+		return;
+	}
+
+	narc_metrics_connection *connection = malloc(sizeof(narc_metrics_connection));
+	connection->response = NULL;
+	connection->len = 0;
+	uv_tcp_init(server.loop, &connection->socket);
+
+	if (uv_accept(listener, (uv_stream_t *)&connection->socket) != 0) {
+		uv_close((uv_handle_t *)&connection->socket, handle_metrics_close);
+		return;
+	}
+
+	uv_read_start((uv_stream_t *)&connection->socket, handle_metrics_alloc_buffer, handle_metrics_read);
+}
+
+/*================================== API ==================================== */
+
+sds
+metrics_render(sds metrics)
+{
+	metrics = metrics_process(metrics);
+	metrics = metrics_streams(metrics);
+	metrics = metrics_transport(metrics);
+	metrics = metrics_latency(metrics);
+	return metrics;
+}
+
+void
+init_metrics_server(void)
+{
+	uv_tcp_t *listener = malloc(sizeof(uv_tcp_t));
+	struct sockaddr_in addr;
+	int err;
+
+	uv_tcp_init(server.loop, listener);
+
+	if ((err = uv_ip4_addr(server.metrics_bind, server.metrics_port, &addr)) != 0 ||
+		(err = uv_tcp_bind(listener, (struct sockaddr *)&addr, 0)) != 0 ||
+		(err = uv_listen((uv_stream_t *)listener, 16, handle_metrics_connection)) != 0) {
+		narc_log(NARC_WARNING, "Can't listen for metrics on %s:%d: %s",
+			server.metrics_bind, server.metrics_port, uv_err_name(err));
+		uv_close((uv_handle_t *)listener, (uv_close_cb)free);
+		return;
+	}
+
+	narc_log(NARC_NOTICE, "Metrics available on http://%s:%d/metrics", server.metrics_bind, server.metrics_port);
+}
@@ -27,7 +27,11 @@
 #include "stream.h" 
 #include "config.h"
 #include "tcp_client.h"
-#include "udp_client.h"
+#include "output.h"
+#include "stats.h"
+#include "metrics.h"
+#include "compress.h"
+#include "resolver.h"
 
 // #include "malloc.h"	/* total memory usage aware version of malloc/free */
 #include "sds.h"	/* dynamic safe strings */
@@ -40,6 +44,7 @@
 #include <unistd.h>	/* standard symbolic constants and types */
 #include <locale.h>	/* set program locale */
 #include <string.h>	/* string operations */
+#include <fcntl.h>	/* file control options */
 
 /*================================= Globals ================================= */
 
@@ -48,38 +53,46 @@ struct narc_server server; /* server global state */
 
 /*============================ Utility functions ============================ */
 
+/* Format a log line with its pid, timestamp and level mark. Safe to call
+ * from the logger thread. */
+int
+narc_log_format(int level, const char *msg, char *line, size_t size)
+{
+	const char *c = ".-*#";
+	char buf[64];
+	int off, len;
+	struct timeval tv;
+	struct tm tm;
+
+	gettimeofday(&tv,NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	off = strftime(buf,sizeof(buf),"%d %b %H:%M:%S.",&tm);
+	snprintf(buf+off,sizeof(buf)-off,"%03d",(int)tv.tv_usec/1000);
+	len = snprintf(line,size,"[%d] %s %c %s\n",(int)getpid(),buf,c[level],msg);
+	if (len >= (int)size) len = size-1;
+	return len;
+}
+
 /* Low level logging. To use only for very big messages, otherwise
- * narc_log() is to prefer. */
+ * narc_log() is to prefer. Lines are handed to the logger, which writes
+ * them out from its own thread. */
 void
 narc_log_raw(int level, const char *msg)
 {
 	const int syslogLevelMap[] = { LOG_DEBUG, LOG_INFO, LOG_NOTICE, LOG_WARNING };
-	const char *c = ".-*#";
-	FILE *fp;
-	char buf[64];
+	char line[NARC_MAX_LOGMSG_LEN+128];
 	int rawmode = (level & NARC_LOG_RAW);
-	int log_to_stdout = server.logfile[0] == '\0';
 
 	level &= 0xff; /* clear flags */
 	if (level < server.verbosity) return;
 
-	fp = log_to_stdout ? stdout : fopen(server.logfile,"a");
-	if (!fp) return;
-
 	if (rawmode) {
-		fprintf(fp,"%s",msg);
+		logger_write(&server.logger, msg, strlen(msg));
 	} else {
-		int off;
-		struct timeval tv;
-
-		gettimeofday(&tv,NULL);
-		off = strftime(buf,sizeof(buf),"%d %b %H:%M:%S.",localtime(&tv.tv_sec));
-		snprintf(buf+off,sizeof(buf)-off,"%03d",(int)tv.tv_usec/1000);
-		fprintf(fp,"[%d] %s %c %s\n",(int)getpid(),buf,c[level],msg);
+		int len = narc_log_format(level, msg, line, sizeof(line));
+		logger_write(&server.logger, line, len);
 	}
-	fflush(fp);
 
-	if (!log_to_stdout) fclose(fp);
 	if (server.syslog_enabled) syslog(syslogLevelMap[level], "%s", msg);
 }
 
@@ -101,26 +114,178 @@ narc_log(int level, const char *fmt, ...)
 	narc_log_raw(level,msg);
 }
 
+/* Log from a signal handler, where stdio is off limits: the file is
+ * opened and written with plain system calls. */
 void
-handle_message(char *id, char *body)
+narc_log_from_handler(int level, const char *msg)
 {
-	char *message;
-	message = sdscatprintf(sdsempty(), "<%d>%s %s %s %s\n", 
-				server.stream_facility + server.stream_priority,
-				server.time, server.stream_id, id, body);
-
-	switch (server.protocol) {
-		case NARC_PROTO_UDP :
-			submit_udp_message(message);
-			break;
-		case NARC_PROTO_TCP :
-			submit_tcp_message(message);
-			break;
-		case NARC_PROTO_SYSLOG :
-			narc_log(NARC_WARNING, "syslog is not yet implemented");
-			exit(1);
-			break;
+	int fd;
+	int log_to_stdout = server.logfile[0] == '\0';
+	char buf[32];
+
+	if ((level&0xff) < server.verbosity) return;
+
+	fd = log_to_stdout ? STDOUT_FILENO :
+		open(server.logfile, O_APPEND|O_CREAT|O_WRONLY, 0644);
+	if (fd == -1) return;
+
+	snprintf(buf, sizeof(buf), "[%d] (signal handler) ", (int)getpid());
+	if (write(fd, buf, strlen(buf)) == -1) goto err;
+	if (write(fd, msg, strlen(msg)) == -1) goto err;
+	if (write(fd, "\n", 1) == -1) goto err;
+err:
+	if (!log_to_stdout) close(fd);
+}
+
+void
+handle_message(narc_stream *stream, char *body)
+{
+	narc_message *message = malloc(sizeof(narc_message));
+
+	message->stream    = stream;
+	message->read_time = stream->read_time;
+	message->local     = NULL;
+	message->refcount  = 1;
+	message->sent      = 0;
+
+	if (server.format == NARC_FORMAT_RFC5424) {
+		/* optional parameters, as structured data */
+		char sd[160];
+		int sd_len = 0;
+
+		if (server.sequence_numbers)
+			sd_len += snprintf(sd, sizeof(sd), "[meta sequenceId=\"%llu\"][" NARC_SD_ID " offset=\"%lld\"",
+						(unsigned long long)++stream->sequence, (long long)stream->record_offset);
+		if (stream->sample_threshold != UINT64_MAX)
+			sd_len += snprintf(sd + sd_len, sizeof(sd) - sd_len, "%s sampleRate=\"%g\"",
+						sd_len ? "" : "[" NARC_SD_ID, stream->sample_rate);
+		if (sd_len)
+			snprintf(sd + sd_len, sizeof(sd) - sd_len, "]");
+		else
+			strcpy(sd, "-");
+
+		message->data = sdscatprintf(sdsempty(), "<%d>1 %s%s%s %s\n",
+					server.stream_facility + server.stream_priority,
+					rfc5424_timestamp(), stream->rfc5424_header, sd, body);
+	} else {
+		/* optional tags, ahead of the line */
+		char tags[96];
+		int tags_len = 0;
+
+		tags[0] = '\0';
+		if (server.sequence_numbers)
+			tags_len += snprintf(tags, sizeof(tags), "[seq=%llu offset=%lld] ",
+						(unsigned long long)++stream->sequence, (long long)stream->record_offset);
+		if (stream->sample_threshold != UINT64_MAX)
+			snprintf(tags + tags_len, sizeof(tags) - tags_len, "[sample-rate=%g] ", stream->sample_rate);
+
+		message->data = sdscatprintf(sdsempty(), "<%d>%s %s %s %s%s\n", 
+					server.stream_facility + server.stream_priority,
+					server.time, server.stream_id, stream->id, tags, body);
+		if (server.local_syslog)
+			// the local daemon adds the hostname, the stream id is the tag
+			message->local = sdscatprintf(sdsempty(), "<%d>%s %s: %s%s\n",
+						server.stream_facility + server.stream_priority,
+						server.time, stream->id, tags, body);
 	}
+
+	size_t len = sdslen(message->data);
+	int status = NARC_ERR;
+
+	if (server.verify_digest)
+		message->body = len - strlen(body) - 1;
+
+	// every output takes its own reference, a slow one holds nobody else
+	listIter *iter = listGetIterator(server.outputs, AL_START_HEAD);
+	listNode *node;
+
+	while ((node = listNext(iter)) != NULL)
+		if (submit_output_message((narc_output *)listNodeValue(node), message) == NARC_OK)
+			status = NARC_OK;
+	listReleaseIterator(iter);
+	free_message(message);
+
+	if (status == NARC_OK) {
+		stream->sent_count++;
+		stream->sent_bytes += len;
+	} else
+		stream->dropped_count++;
+}
+
+/* Called by the transports once a message has been written out. */
+void
+message_sent(narc_message *message)
+{
+	// the first output to deliver it counts, they all deliver in order
+	if (message->sent)
+		return;
+	message->sent = 1;
+
+	histogram_record(&server.send_latency, (uv_hrtime() - message->read_time) / 1000);
+
+	if (server.verify_digest) {
+		narc_stream *stream = message->stream;
+
+		mixDigest(stream->digest, message->data + message->body,
+			sdslen(message->data) - message->body - 1);
+		stream->digest_count++;
+	}
+}
+
+/* Log the digest of what every stream sent, to be compared with what
+ * the receiving end computed over the same lines. */
+void
+log_delivery_digests(void)
+{
+	listIter *iter;
+	listNode *node;
+	char hex[41];
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+
+		digestHex(stream->digest, hex);
+		narc_log(NARC_WARNING, "Delivery digest: %s count=%llu sha1=%s",
+			stream->id, (unsigned long long)stream->digest_count, hex);
+	}
+	listReleaseIterator(iter);
+}
+
+void
+free_message(narc_message *message)
+{
+	if (--message->refcount > 0)
+		return;
+	sdsfree(message->data);
+	if (message->local)
+		sdsfree(message->local);
+	free(message);
+}
+
+sds
+latency_info(sds info)
+{
+	narc_histogram *histograms[] = { &server.read_latency, &server.send_latency };
+	const char *names[] = { "read", "send" };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		narc_histogram *h = histograms[i];
+		info = sdscatprintf(info,
+			"%s_latency_count:%llu\r\n"
+			"%s_latency_usec:min=%llu,p50=%llu,p90=%llu,p99=%llu,p999=%llu,max=%llu\r\n",
+			names[i], (unsigned long long)h->count,
+			names[i],
+			(unsigned long long)h->min,
+			(unsigned long long)histogram_percentile(h, 50),
+			(unsigned long long)histogram_percentile(h, 90),
+			(unsigned long long)histogram_percentile(h, 99),
+			(unsigned long long)histogram_percentile(h, 99.9),
+			(unsigned long long)h->max);
+	}
+
+	return info;
 }
 
 void
@@ -131,6 +296,43 @@ calculate_time(uv_timer_t* handle)
 	strftime(server.time,sizeof(server.time),"%b %d %T",localtime(&tv.tv_sec));
 }
 
+/* The RFC 3339 timestamp of RFC 5424 messages. Everything up to the
+ * seconds, and the timezone, only changes once a second and is cached,
+ * each call just rewrites the microseconds in place. */
+char *
+rfc5424_timestamp(void)
+{
+	struct timeval tv;
+	char *fraction;
+	int usec, i;
+
+	gettimeofday(&tv, NULL);
+
+	if (tv.tv_sec != server.rfc5424_second) {
+		struct tm tm;
+		char zone[8];
+		int len;
+
+		localtime_r(&tv.tv_sec, &tm);
+		len = strftime(server.rfc5424_time, sizeof(server.rfc5424_time), "%Y-%m-%dT%H:%M:%S.", &tm);
+		server.rfc5424_fraction = len;
+		// %z is +hhmm, RFC 3339 wants +hh:mm
+		strftime(zone, sizeof(zone), "%z", &tm);
+		snprintf(server.rfc5424_time + len, sizeof(server.rfc5424_time) - len,
+			"000000%.3s:%.2s", zone, zone + 3);
+		server.rfc5424_second = tv.tv_sec;
+	}
+
+	fraction = server.rfc5424_time + server.rfc5424_fraction;
+	usec = tv.tv_usec;
+	for (i = 5; i >= 0; i--) {
+		fraction[i] = '0' + usec % 10;
+		usec /= 10;
+	}
+
+	return server.rfc5424_time;
+}
+
 void
 start_timer_loop()
 {
@@ -139,6 +341,56 @@ start_timer_loop()
 	uv_timer_start(&server.time_timer,calculate_time,500,500);
 }
 
+/* The loop probe brackets every iteration: the time between two prepare
+ * callbacks, minus what the loop spent idle in the poll, is the time
+ * spent running callbacks. */
+void
+handle_loop_prepare(uv_prepare_t *handle)
+{
+	uint64_t now = uv_hrtime(), busy;
+
+#if UV_VERSION_HEX >= 0x012700
+	uint64_t idle = uv_metrics_idle_time(server.loop);
+
+	if (server.loop_start == 0) {
+		server.loop_start = now;
+		server.loop_idle = idle;
+		return;
+	}
+	busy = (now - server.loop_start) - (idle - server.loop_idle);
+	server.loop_idle = idle;
+#else
+	if (server.loop_wake == 0)
+		return;
+	busy = now - server.loop_wake;
+#endif
+	server.loop_start = now;
+	server.loop_iterations++;
+	server.loop_busy_time += busy;
+	if (busy > server.loop_max_busy)
+		server.loop_max_busy = busy;
+}
+
+void
+handle_loop_check(uv_check_t *handle)
+{
+	server.loop_wake = uv_hrtime();
+}
+
+void
+start_loop_probe(void)
+{
+	server.loop_prepare = malloc(sizeof(uv_prepare_t));
+	uv_prepare_init(server.loop, server.loop_prepare);
+	uv_prepare_start(server.loop_prepare, handle_loop_prepare);
+	uv_unref((uv_handle_t *)server.loop_prepare);
+
+	server.loop_check = malloc(sizeof(uv_check_t));
+	uv_check_init(server.loop, server.loop_check);
+	uv_check_start(server.loop_check, handle_loop_check);
+	uv_unref((uv_handle_t *)server.loop_check);
+}
+
 /*=========================== Server initialization ========================= */
 
 void
@@ -146,13 +398,19 @@ init_server_config(void)
 {
 	server.pidfile = strdup(NARC_DEFAULT_PIDFILE);
 	server.arch_bits = (sizeof(long) == 8) ? 64 : 32;
-	server.host = strdup(NARC_DEFAULT_HOST);
-	server.port = NARC_DEFAULT_PORT;
-	server.protocol = NARC_DEFAULT_PROTO;
+	server.outputs = listCreate();
+	listSetFreeMethod(server.outputs, free_output);
+	server.default_output = new_output(NARC_DEFAULT_OUTPUT_NAME);
+	server.blocked_outputs = 0;
+	server.local_syslog = 0;
+	server.format = NARC_FORMAT_RFC3164;
+	server.rfc5424_second = -1;
 	server.stream_id = strdup(NARC_DEFAULT_STREAM_ID);
 	server.stream_facility = NARC_DEFAULT_STREAM_FACILITY;
 	server.stream_priority = NARC_DEFAULT_STREAM_PRIORITY;
 	server.verbosity = NARC_DEFAULT_VERBOSITY;
+	server.verify_digest = 0;
+	server.sequence_numbers = 0;
 	server.daemonize = NARC_DEFAULT_DAEMONIZE;
 	server.logfile = strdup(NARC_DEFAULT_LOGFILE);
 	server.syslog_enabled = NARC_DEFAULT_SYSLOG_ENABLED;
@@ -162,9 +420,38 @@ init_server_config(void)
 	server.open_retry_delay = NARC_DEFAULT_OPEN_DELAY;
 	server.max_connect_attempts = NARC_DEFAULT_CONNECT_ATTEMPTS;
 	server.connect_retry_delay = NARC_DEFAULT_CONNECT_DELAY;
+	server.dns_ttl = NARC_DEFAULT_DNS_TTL;
 	server.rate_limit = NARC_DEFAULT_RATE_LIMIT;
 	server.rate_time = NARC_DEFAULT_RATE_TIME;
+	server.global_rate_limit = NARC_DEFAULT_GLOBAL_RATE_LIMIT;
+	server.bandwidth_limit = NARC_DEFAULT_BANDWIDTH_LIMIT;
+	server.bandwidth_burst = 0;
+	server.stats_socket = NULL;
+	server.metrics_port = NARC_DEFAULT_METRICS_PORT;
+	server.metrics_bind = strdup(NARC_DEFAULT_METRICS_BIND);
+	server.metrics_buffer = NULL;
+	server.metrics_busy = 0;
+	server.loop_start = 0;
+	server.loop_idle = 0;
+	server.loop_wake = 0;
+	server.loop_iterations = 0;
+	server.loop_busy_time = 0;
+	server.loop_max_busy = 0;
+	server.log_buffer_size = NARC_DEFAULT_LOG_BUFFER_SIZE;
+	server.watchdog_period = NARC_DEFAULT_WATCHDOG_PERIOD;
+	server.watchdog_running = 0;
+	server.watchdog_ping = 0;
+	server.watchdog_pong = 0;
+	server.loop_stalls = 0;
+	server.loop_max_stall = 0;
+	histogram_reset(&server.read_latency);
+	histogram_reset(&server.send_latency);
 	server.truncate_limit = NARC_DEFAULT_TRUNCATE_LIMIT;
+	server.lag_warning_bytes = NARC_DEFAULT_LAG_WARNING_BYTES;
+	server.lag_warning_interval = NARC_DEFAULT_LAG_WARNING_INTERVAL;
+	server.multiline_max_lines = NARC_DEFAULT_MULTILINE_LINES;
+	server.multiline_max_bytes = NARC_DEFAULT_MULTILINE_BYTES;
+	server.multiline_timeout = NARC_DEFAULT_MULTILINE_TIMEOUT;
 	server.streams = listCreate();
 	listSetFreeMethod(server.streams, free_stream);
 }
@@ -173,63 +460,73 @@ void
 clean_server_config(void)
 {
 	free(server.pidfile);
-	free(server.host);
 	free(server.stream_id);
 	free(server.logfile);
 	free(server.syslog_ident);
-	switch (server.protocol) {
-	case NARC_PROTO_UDP :
-		free((narc_udp_client *)server.client);
-		break;
-	case NARC_PROTO_TCP :
-		free((narc_tcp_client *)server.client);
-		break;
-	}
+	free(server.stats_socket);
+	free(server.metrics_bind);
+	listRelease(server.outputs);
 
 }
 
 void
 init_server(void)
 {
+	init_logger(&server.logger, server.log_buffer_size);
+
 	if (server.syslog_enabled)
 		openlog(server.syslog_ident, LOG_PID | LOG_NDELAY | LOG_NOWAIT, server.syslog_facility);
 
 	server.loop = uv_default_loop();
+	server.start_time = time(NULL);
+#if UV_VERSION_HEX >= 0x012700
+	uv_loop_configure(server.loop, UV_METRICS_IDLE_TIME);
+#endif
+	start_loop_probe();
+
+	if (server.watchdog_period > 0)
+		init_watchdog();
+
+	if (server.bandwidth_burst == 0)
+		server.bandwidth_burst = server.bandwidth_limit;
+	init_shaper(&server.shaper, server.bandwidth_limit, server.bandwidth_burst, resume_streams);
 
 	listIter *iter;
 	listNode *node;
 
+	server.multiline_escape = !outputs_keep_newlines();
+
 	iter = listGetIterator(server.streams, AL_START_HEAD);
 	while ((node = listNext(iter)) != NULL)
 		init_stream((narc_stream *)listNodeValue(node));
 
 	listReleaseIterator(iter);
 
-	switch (server.protocol) {
-		case NARC_PROTO_UDP :
-			init_udp_client();
-			break;
-		case NARC_PROTO_TCP :
-			init_tcp_client();
-			break;
-		case NARC_PROTO_SYSLOG :
-			narc_log(NARC_WARNING, "syslog is not yet implemented");
-			exit(1);
-			break;
-	}
+	if (server.global_rate_limit > 0)
+		start_global_rate_timer();
+
+	if (server.lag_warning_bytes > 0)
+		start_lag_timer();
+
+	if (server.stats_socket != NULL)
+		init_stats_server();
+
+	if (server.metrics_port > 0)
+		init_metrics_server();
+
+	init_outputs();
 }
 
 void
 clean_server(void)
 {
-	switch (server.protocol) {
-		case NARC_PROTO_UDP :
-			clean_udp_client();
-			break;
-		case NARC_PROTO_TCP :
-			clean_tcp_client();
-			break;
-	}
+	stop_watchdog();
+
+	if (server.stats_socket != NULL)
+		clean_stats_server();
+
+	clean_outputs();
+	clean_resolvers();
 }
 
 /* =================================== Main! ================================ */
@@ -279,7 +576,8 @@ usage(void)
 	fprintf(stderr,"Usage: ./narc [/path/to/narc.conf] [options]\n");
 	fprintf(stderr,"       ./narc - (read config from stdin)\n");
 	fprintf(stderr,"       ./narc -v or --version\n");
-	fprintf(stderr,"       ./narc -h or --help\n\n");
+	fprintf(stderr,"       ./narc -h or --help\n");
+	fprintf(stderr,"       ./narc --train-dictionary <dictionary> <sample file> [...]\n\n");
 	fprintf(stderr,"Examples:\n");
 	fprintf(stderr,"       ./narc (run the server with default conf)\n");
 	fprintf(stderr,"       ./narc /etc/narc.conf\n");
@@ -316,11 +614,35 @@ stop(void)
 	// uv_stop(server.loop);
 }
 
+void
+latency_signal_handler(uv_signal_t *handle, int signum)
+{
+	sds info = latency_info(sdsempty());
+	int count, i;
+	sds *lines = sdssplitlen(info, sdslen(info), "\r\n", 2, &count);
+
+	for (i = 0; i < count; i++)
+		if (sdslen(lines[i]))
+			narc_log(NARC_WARNING, "%s", lines[i]);
+
+	sdsfreesplitres(lines, count);
+	sdsfree(info);
+}
+
+void
+reopen_log_signal_handler(uv_signal_t *handle, int signum)
+{
+	logger_reopen(&server.logger);
+}
+
 void signal_handler(uv_signal_t *handle, int signum) {
 	uv_signal_stop(handle);
 	uv_close((uv_handle_t*)handle, NULL);
 	uv_signal_stop(&server.loop->child_watcher);
 	uv_close((uv_handle_t*)&server.loop->child_watcher, NULL);
+	stop_streams();
+	if (server.verify_digest)
+		log_delivery_digests();
 	listRelease(server.streams);
 	clean_server();
 	stop();
@@ -343,6 +665,10 @@ main(int argc, char **argv)
 			strcmp(argv[1], "--version") == 0) version();
 		if (strcmp(argv[1], "--help") == 0 ||
 			strcmp(argv[1], "-h") == 0) usage();
+		if (strcmp(argv[1], "--train-dictionary") == 0) {
+			if (argc < 4) usage();
+			exit(train_dictionary(argv[2], argv + 3, argc - 3));
+		}
 
 		/* First argument is the config file name? */
 		if (argv[j][0] != '-' || argv[j][1] != '-')
@@ -384,7 +710,18 @@ main(int argc, char **argv)
 	uv_signal_init(server.loop, &quit_signal);
 	uv_signal_start(&quit_signal, signal_handler, SIGTERM);
 
+	uv_signal_t latency_signal;
+	uv_signal_init(server.loop, &latency_signal);
+	uv_signal_start(&latency_signal, latency_signal_handler, SIGUSR1);
+	uv_unref((uv_handle_t *)&latency_signal);
+
+	uv_signal_t reopen_log_signal;
+	uv_signal_init(server.loop, &reopen_log_signal);
+	uv_signal_start(&reopen_log_signal, reopen_log_signal_handler, SIGHUP);
+	uv_unref((uv_handle_t *)&reopen_log_signal);
+
 	uv_run(server.loop, UV_RUN_DEFAULT);
+	stop_logger(&server.logger);
 	clean_server_config();
 	// listRelease(server.streams);
 	return uv_loop_close(server.loop);
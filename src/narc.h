@@ -27,12 +27,18 @@
 #define NARC_H 
 
 #include <syslog.h>	/* definitions for system error logging */
+#include <time.h>	/* time types */
+#include <pthread.h>	/* watchdog thread */
 
 #if defined(__sun)
 #include "solarisfixes.h"
 #endif
 
 #include "adlist.h"	/* Linked lists */
+#include "shaper.h"	/* Bandwidth shaping */
+#include "logger.h"	/* Buffered logging */
+#include "sds.h"	/* dynamic safe strings */
+#include "histogram.h"	/* Latency histograms */
 #include "version.h"	/* Version macro */
 
 #include <uv.h>		/* Event driven programming library */
@@ -46,6 +52,18 @@
 #define NARC_PROTO_TCP 		2
 #define NARC_PROTO_SYSLOG 	3
 
+/* message formats */
+#define NARC_FORMAT_RFC3164	1	/* <pri>Mmm dd hh:mm:ss host id line */
+#define NARC_FORMAT_RFC5424	2	/* <pri>1 timestamp host app - msgid sd line */
+
+/* structured data element for narc's own parameters, under the
+ * documentation enterprise number until one is registered */
+#define NARC_SD_ID		"narc@32473"
+
+/* tcp framing */
+#define NARC_FRAMING_NEWLINE	1	/* messages end with a newline */
+#define NARC_FRAMING_OCTET	2	/* RFC 6587 octet counting: <len> <msg> */
+
 /* Static narc configuration */
 #define NARC_MAX_BUFF_SIZE 		4096
 #define NARC_MAX_MESSAGE_SIZE 		1024
@@ -59,6 +77,9 @@
 #define NARC_DEFAULT_HOST 		"127.0.0.1"
 #define NARC_DEFAULT_PORT 		514
 #define NARC_DEFAULT_PROTO		2
+#define NARC_DEFAULT_REMOTE_SOCKET	"/dev/log"
+#define NARC_DEFAULT_UDP_PACKING	0	/* one message per datagram */
+#define NARC_DEFAULT_UDP_LINGER		10
 #define NARC_DEFAULT_STREAM_ID		""
 #define NARC_DEFAULT_STREAM_FACILITY 	LOG_USER
 #define NARC_DEFAULT_STREAM_PRIORITY	LOG_ERR
@@ -66,9 +87,21 @@
 #define NARC_DEFAULT_OPEN_DELAY		3000
 #define NARC_DEFAULT_CONNECT_ATTEMPTS	2
 #define NARC_DEFAULT_CONNECT_DELAY	3000
+#define NARC_DEFAULT_DNS_TTL		60	/* seconds between lookups of a host */
 #define NARC_DEFAULT_RATE_LIMIT		100
 #define NARC_DEFAULT_RATE_TIME		10
+#define NARC_DEFAULT_GLOBAL_RATE_LIMIT	0	/* unlimited */
+#define NARC_DEFAULT_BANDWIDTH_LIMIT	0	/* unlimited */
+#define NARC_DEFAULT_METRICS_PORT	0	/* disabled */
+#define NARC_DEFAULT_LAG_WARNING_BYTES	0	/* disabled */
+#define NARC_DEFAULT_LAG_WARNING_INTERVAL	60
+#define NARC_DEFAULT_LOG_BUFFER_SIZE	(256*1024)
+#define NARC_DEFAULT_WATCHDOG_PERIOD	0	/* disabled */
+#define NARC_DEFAULT_METRICS_BIND	"127.0.0.1"
 #define NARC_DEFAULT_TRUNCATE_LIMIT	1024*1024*32 /* Default truncate files when they get to 32MB */
+#define NARC_DEFAULT_MULTILINE_LINES	200
+#define NARC_DEFAULT_MULTILINE_BYTES	1024*32
+#define NARC_DEFAULT_MULTILINE_TIMEOUT	1000
 
 /* Log levels */
 #define NARC_DEBUG		0
@@ -87,6 +120,22 @@
 #define narcAssert(_e)			((_e)?(void)0 : (_narcAssert(#_e,__FILE__,__LINE__),_exit(1)))
 #define narcPanic(_e)			_narcPanic(#_e,__FILE__,__LINE__),_exit(1)
 
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+/* A formatted message on its way to the outputs, shared between them */
+typedef struct narc_message {
+	sds			data;			/* formatted message */
+	struct narc_stream	*stream;		/* stream it was read from */
+	uint64_t		read_time;		/* hrtime its line was read */
+	sds			local;			/* local syslog form, when an output needs it */
+	size_t			body;			/* offset of the line in data, when verifying */
+	char			frame[24];		/* octet counting prefix */
+	int			refcount;		/* outputs still holding the message */
+	int			sent;			/* an output delivered it */
+} narc_message;
+
 /*-----------------------------------------------------------------------------
  * Global state
  *----------------------------------------------------------------------------*/
@@ -96,28 +145,39 @@ struct narc_server {
 	char		*pidfile;				/* PID file path */
 	int			arch_bits;				/* 32 or 64 depending on sizeof(long) */
 	uv_loop_t	*loop;					/* Event loop */
+	time_t		start_time;				/* Server start time */
+	char		*stats_socket;			/* Unix socket serving the stats */
 	
 	/* Configuration */
 	int			verbosity;				/* Loglevel in narc.conf */
 	int			daemonize;				/* True if running as a daemon */
+	int			verify_digest;			/* keep a digest of the lines sent per stream */
+	int			format;					/* syslog message format */
+	int			sequence_numbers;		/* tag messages with a sequence number and offset */
 	
 	/* Logging */
 	char		*logfile;				/* Path of log file */
 	int			syslog_enabled;			/* Is syslog enabled? */
 	char		*syslog_ident;			/* Syslog ident */
 	int			syslog_facility;		/* Syslog facility */
+	size_t		log_buffer_size;		/* bytes of log lines held for the logger thread */
+	narc_logger	logger;					/* writes the log lines out */
 	
 	/* File access */
 	int 		max_open_attempts;		/* Max open attempts */
 	uint64_t 	open_retry_delay;		/* Millesecond delay between attempts */
 	
 	/* Server connection */
-	char		*host; 					/* Remote syslog host */
-	int 		port; 					/* Remote syslog port */
-	int 		protocol; 				/* Protocol to use when communicating with remote host */
-	void		*client;				/* the client data pointer */
+	list		*outputs;				/* where the messages go */
+	struct narc_output	*default_output;	/* set by the remote-* directives */
+	int			blocked_outputs;		/* outputs holding the reads */
+	int			local_syslog;			/* an output needs the local syslog form */
 	int 		max_connect_attempts;	/* Max connect attempts */
 	uint64_t	connect_retry_delay;	/* Millesecond delay between attempts */
+	uint64_t	dns_ttl;				/* seconds the addresses of a host are kept, 0 to resolve once */
+	uint64_t	bandwidth_limit;		/* bytes per second written by all the outputs */
+	uint64_t	bandwidth_burst;		/* bytes that may be sent at once */
+	narc_shaper	shaper;					/* enforces the bandwidth limit */
 
 	/* Streams */
 	list		*streams;				/* Stream list */
@@ -126,11 +186,60 @@ struct narc_server {
 	int 		stream_priority;		/* Syslog stream priority */
 	int			rate_limit;				/* log rate limit */
 	int			rate_time;				/* log rate time */
+	int			global_rate_limit;		/* messages per second across all streams */
+	int64_t		global_tokens;			/* global budget left this tick */
+	int64_t		global_deficit;			/* global budget owed to busy streams */
+	int			global_weight;			/* sum of the stream weights */
 	int			truncate_limit;			/* size limit for truncating */
+	uint64_t	lag_warning_bytes;		/* warn about streams further behind, 0 to disable */
+	uint64_t	lag_warning_interval;	/* seconds between lag warnings */
+	int			multiline_max_lines;	/* max lines joined into one record */
+	int			multiline_max_bytes;	/* max bytes joined into one record */
+	uint64_t	multiline_timeout;		/* millisecond delay before flushing a record */
+	int			multiline_escape;		/* join lines with #012, the outputs split on newlines */
+
+	/* Event loop probe */
+	uv_prepare_t	*loop_prepare;			/* runs before the loop polls */
+	uv_check_t	*loop_check;			/* runs after the loop polled */
+	uint64_t	loop_start;				/* hrtime the current iteration began */
+	uint64_t	loop_idle;				/* idle time when the iteration began */
+	uint64_t	loop_wake;				/* hrtime the loop last came back from polling */
+	uint64_t	loop_iterations;		/* iterations measured */
+	uint64_t	loop_busy_time;			/* nanoseconds spent handling events */
+	uint64_t	loop_max_busy;			/* longest iteration in nanoseconds */
+
+	/* Watchdog */
+	int			watchdog_period;		/* milliseconds the loop may stall, 0 to disable */
+	pthread_t	watchdog_thread;		/* pings the loop and reports stalls */
+	pthread_t	main_thread;			/* thread running the loop */
+	uv_async_t	*watchdog_async;		/* wakes the loop to answer a ping */
+	int			watchdog_running;		/* cleared to stop the watchdog thread */
+	uint64_t	watchdog_ping;			/* hrtime of the last ping */
+	uint64_t	watchdog_pong;			/* hrtime the loop answered it */
+	uint64_t	loop_stalls;			/* pings left unanswered past the period */
+	uint64_t	loop_max_stall;			/* longest ping round trip in nanoseconds */
+
+	/* Assert */
+	char		*assert_failed;			/* expression of the failed assertion */
+	char		*assert_file;			/* file it failed in */
+	int			assert_line;			/* line it failed at */
+
+	/* Latency */
+	narc_histogram	read_latency;			/* microseconds from fs event to read completion */
+	narc_histogram	send_latency;			/* microseconds from read completion to write completion */
+
+	/* Metrics */
+	int			metrics_port;			/* prometheus endpoint port, 0 when disabled */
+	char		*metrics_bind;			/* prometheus endpoint address */
+	sds			metrics_buffer;			/* reused to render every scrape */
+	int			metrics_busy;			/* metrics_buffer is being written */
 
 	/* Time of day */
 	uv_timer_t 	time_timer;				/* runs ever hald second to update the current time */
 	char		time[16];				/* current time of day */
+	char		rfc5424_time[40];		/* RFC 3339 timestamp, microsecond precision */
+	time_t		rfc5424_second;			/* second rfc5424_time was formatted for */
+	int			rfc5424_fraction;		/* offset of the microseconds in rfc5424_time */
 };
 
 /*-----------------------------------------------------------------------------
@@ -142,8 +251,14 @@ extern struct narc_server	server;
 /*-----------------------------------------------------------------------------
  * Functions prototypes
  *----------------------------------------------------------------------------*/
+struct narc_stream;
+
 /* Core functions and callbacks */
-void	handle_message(char *id, char *message);
+void	handle_message(struct narc_stream *stream, char *message);
+void	message_sent(narc_message *message);
+char	*rfc5424_timestamp(void);
+void	free_message(narc_message *message);
+sds	latency_info(sds info);
 void	narc_out_of_memory_handler(size_t allocation_size);
 int	main(int argc, char **argv);
 void	init_server_config(void);
@@ -157,6 +272,7 @@ void	narc_log(int level, const char *fmt, ...) __attribute__((format(printf, 2,
 void	narc_log(int level, const char *fmt, ...);
 #endif
 void	narc_logRaw(int level, const char *msg);
+int	narc_log_format(int level, const char *msg, char *line, size_t size);
 
 /* Git SHA1 */
 char		*narc_git_sha1(void);
@@ -174,5 +290,11 @@ uint64_t	narc_build_id(void);
 /* Debugging stuff */
 void	_narcAssert(char *estr, char *file, int line);
 void	_narcPanic(char *msg, char *file, int line);
+void	xorDigest(unsigned char *digest, void *ptr, size_t len);
+void	mixDigest(unsigned char *digest, void *ptr, size_t len);
+void	digestHex(unsigned char *digest, char *hex);
+void	narc_log_from_handler(int level, const char *msg);
+void	init_watchdog(void);
+void	stop_watchdog(void);
 
 #endif
@@ -0,0 +1,513 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "output.h"
+#include "stream.h"
+#include "tcp_client.h"
+#include "udp_client.h"
+#include "syslog_client.h"
+#include "compress.h"
+
+#include "sds.h"	/* dynamic safe strings */
+#include "crc64.h"
+
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <uv.h>		/* Event driven programming library */
+
+/*============================ Utility functions ============================ */
+
+narc_output
+*new_output(char *name)
+{
+	narc_output *output = (narc_output *)malloc(sizeof(narc_output));
+
+	memset(output, 0, sizeof(narc_output));
+	output->name         = strdup(name);
+	output->protocol     = NARC_DEFAULT_PROTO;
+	output->host         = strdup(NARC_DEFAULT_HOST);
+	output->port         = NARC_DEFAULT_PORT;
+	output->path         = strdup(NARC_DEFAULT_REMOTE_SOCKET);
+	output->framing      = NARC_FRAMING_NEWLINE;
+	output->compression  = NARC_COMPRESSION_NONE;
+	output->packing      = NARC_DEFAULT_UDP_PACKING;
+	output->linger       = NARC_DEFAULT_UDP_LINGER;
+	output->queue_limit  = NARC_DEFAULT_OUTPUT_QUEUE;
+	output->backpressure = NARC_BACKPRESSURE_DROP;
+	output->connections  = 1;
+
+	return output;
+}
+
+void
+free_output(void *ptr)
+{
+	narc_output *output = (narc_output *)ptr;
+
+	free(output->name);
+	free(output->host);
+	free(output->path);
+	sdsfree(output->dictionary);
+	free(output->client);
+	if (output->members)
+		listRelease(output->members);
+	free(output->ring);
+	free(output->placed);
+	free(output);
+}
+
+narc_output
+*find_output(char *name)
+{
+	listIter *iter;
+	listNode *node;
+	narc_output *output = NULL;
+
+	iter = listGetIterator(server.outputs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		if (!strcmp(((narc_output *)listNodeValue(node))->name, name)) {
+			output = (narc_output *)listNodeValue(node);
+			break;
+		}
+	}
+	listReleaseIterator(iter);
+
+	return output;
+}
+
+/* Members are named after their group and destination. */
+narc_output
+*add_output_member(narc_output *group, char *host, int port)
+{
+	sds name = sdscatprintf(sdsempty(), "%s/%s", group->name, host);
+	narc_output *member;
+
+	if (group->protocol != NARC_PROTO_SYSLOG)
+		name = sdscatprintf(name, ":%d", port);
+	member = new_output(name);
+	sdsfree(name);
+
+	if (group->protocol == NARC_PROTO_SYSLOG) {
+		free(member->path);
+		member->path = strdup(host);
+	} else {
+		free(member->host);
+		member->host = strdup(host);
+		member->port = port;
+	}
+	member->group = group;
+
+	if (group->members == NULL) {
+		group->members = listCreate();
+		listSetFreeMethod(group->members, free_output);
+	}
+	listAddNodeTail(group->members, member);
+	return member;
+}
+
+/* Several connections to the same destination are members of a pool,
+ * numbered so that each gets its own points on the ring. */
+static void
+add_pool_connections(narc_output *output)
+{
+	int i;
+
+	for (i = 0; i < output->connections; i++) {
+		narc_output *member = add_output_member(output, output->host, output->port);
+		sds name = sdscatprintf(sdsempty(), "%s#%d", member->name, i);
+
+		free(member->name);
+		member->name = strdup(name);
+		sdsfree(name);
+	}
+	output->pool = 1;
+}
+
+/* crc64 alone spreads similar names poorly, so the bits are mixed
+ * further before they go on the ring. */
+static uint64_t
+ring_hash(const char *key, size_t len)
+{
+	uint64_t h = crc64(0, (const unsigned char *)key, len);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int
+compare_ring_points(const void *a, const void *b)
+{
+	uint64_t x = ((narc_ring_point *)a)->hash, y = ((narc_ring_point *)b)->hash;
+	return (x > y) - (x < y);
+}
+
+static void
+build_group_ring(narc_output *group)
+{
+	listIter *iter;
+	listNode *node;
+	int i, n = 0;
+
+	group->ring_size = listLength(group->members) * NARC_GROUP_POINTS;
+	group->ring = malloc(sizeof(narc_ring_point) * group->ring_size);
+
+	iter = listGetIterator(group->members, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_output *member = (narc_output *)listNodeValue(node);
+
+		for (i = 0; i < NARC_GROUP_POINTS; i++) {
+			char key[512];
+			int len = snprintf(key, sizeof(key), "%s#%d", member->name, i);
+
+			group->ring[n].hash   = ring_hash(key, len);
+			group->ring[n].member = member;
+			n++;
+		}
+	}
+	listReleaseIterator(iter);
+
+	qsort(group->ring, group->ring_size, sizeof(narc_ring_point), compare_ring_points);
+	group->placed = calloc(listLength(server.streams) + 1, sizeof(narc_output *));
+}
+
+/* The stream belongs to the member owning the first point at or after
+ * its hash. While that member is down the next healthy member on the
+ * ring takes the stream, so only the streams of the failed member move
+ * and they move back once it recovers. */
+static narc_output
+*ring_member(narc_output *group, struct narc_stream *stream)
+{
+	uint64_t hash = ring_hash((char *)&stream->hash, sizeof(stream->hash));
+	int low = 0, high = group->ring_size, i;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (group->ring[mid].hash < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	for (i = 0; i < group->ring_size; i++) {
+		narc_output *member = group->ring[(low + i) % group->ring_size].member;
+
+		if (output_connected(member)) {
+			if (i > 0 && member != group->ring[low % group->ring_size].member)
+				group->failovers++;
+			return member;
+		}
+	}
+	// nobody is up, the owner drops it
+	return group->ring[low % group->ring_size].member;
+}
+
+/* A stream only moves to another member once nothing of it is queued
+ * on the one it went to last, so its lines can't overtake each other on
+ * two connections. When that member lost its connection, what it had
+ * queued went with it and the stream moves on at once. */
+static narc_output
+*output_group_member(narc_output *group, struct narc_stream *stream)
+{
+	narc_output *member = ring_member(group, stream);
+	narc_output **placed = &group->placed[stream->number];
+
+	if (*placed != NULL && *placed != member
+		&& output_connected(*placed) && output_queue_bytes(*placed) > 0)
+		member = *placed;
+	*placed = member;
+	return member;
+}
+
+const char
+*output_protocol_name(narc_output *output)
+{
+	if (output->members != NULL && !output->pool)
+		return "group";
+
+	switch (output->protocol) {
+		case NARC_PROTO_UDP : return "udp";
+		case NARC_PROTO_TCP : return "tcp";
+		case NARC_PROTO_SYSLOG : return "syslog";
+	}
+	return "unknown";
+}
+
+static void
+init_output(narc_output *output)
+{
+	if (output->connections > 1 && output->members == NULL)
+		add_pool_connections(output);
+
+	if (output->members != NULL) {
+		listIter *iter;
+		listNode *node;
+
+		// the members take the settings of their group
+		iter = listGetIterator(output->members, AL_START_HEAD);
+		while ((node = listNext(iter)) != NULL) {
+			narc_output *member = (narc_output *)listNodeValue(node);
+
+			member->protocol     = output->protocol;
+			member->framing      = output->framing;
+			member->compression  = output->compression;
+			member->compression_level = output->compression_level;
+			if (output->dictionary != NULL) {
+				member->dictionary    = sdsdup(output->dictionary);
+				member->dictionary_id = output->dictionary_id;
+			}
+			member->packing      = output->packing;
+			member->linger       = output->linger;
+			member->queue_limit  = output->queue_limit;
+			member->backpressure = output->backpressure;
+			if (!output->pool)
+				member->connections = output->connections;
+			init_output(member);
+		}
+		listReleaseIterator(iter);
+
+		build_group_ring(output);
+		return;
+	}
+
+	switch (output->protocol) {
+		case NARC_PROTO_UDP :
+			init_udp_client(output);
+			break;
+		case NARC_PROTO_TCP :
+			init_tcp_client(output);
+			break;
+		case NARC_PROTO_SYSLOG :
+			server.local_syslog = 1;
+			init_syslog_client(output);
+			break;
+	}
+}
+
+static void
+clean_output(narc_output *output)
+{
+	if (output->members != NULL) {
+		listIter *iter;
+		listNode *node;
+
+		iter = listGetIterator(output->members, AL_START_HEAD);
+		while ((node = listNext(iter)) != NULL)
+			clean_output((narc_output *)listNodeValue(node));
+		listReleaseIterator(iter);
+		return;
+	}
+
+	switch (output->protocol) {
+		case NARC_PROTO_UDP :
+			clean_udp_client(output);
+			break;
+		case NARC_PROTO_TCP :
+			clean_tcp_client(output);
+			break;
+		case NARC_PROTO_SYSLOG :
+			clean_syslog_client(output);
+			break;
+	}
+}
+
+/*================================== API ==================================== */
+
+/* Without any output declared, the remote-* settings make the only one. */
+void
+init_outputs(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	if (listLength(server.outputs) == 0)
+		listAddNodeTail(server.outputs, server.default_output);
+	else
+		free_output(server.default_output);
+	server.default_output = NULL;
+
+	iter = listGetIterator(server.outputs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		init_output((narc_output *)listNodeValue(node));
+	listReleaseIterator(iter);
+}
+
+void
+clean_outputs(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	iter = listGetIterator(server.outputs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		clean_output((narc_output *)listNodeValue(node));
+	listReleaseIterator(iter);
+}
+
+int
+output_connected(narc_output *output)
+{
+	if (output->members != NULL) {
+		listIter *iter = listGetIterator(output->members, AL_START_HEAD);
+		listNode *node;
+		int healthy = 0;
+
+		while ((node = listNext(iter)) != NULL)
+			healthy += output_connected((narc_output *)listNodeValue(node));
+		listReleaseIterator(iter);
+		return healthy;
+	}
+
+	switch (output->protocol) {
+		case NARC_PROTO_UDP :
+			return ((narc_udp_client *)output->client)->state == NARC_UDP_BOUND;
+		case NARC_PROTO_TCP :
+			return ((narc_tcp_client *)output->client)->state == NARC_TCP_ESTABLISHED;
+		case NARC_PROTO_SYSLOG :
+			return ((narc_syslog_client *)output->client)->state == NARC_SYSLOG_CONNECTED;
+	}
+	return 0;
+}
+
+size_t
+output_queue_bytes(narc_output *output)
+{
+	if (output->members != NULL) {
+		listIter *iter = listGetIterator(output->members, AL_START_HEAD);
+		listNode *node;
+		size_t queued = 0;
+
+		while ((node = listNext(iter)) != NULL)
+			queued += output_queue_bytes((narc_output *)listNodeValue(node));
+		listReleaseIterator(iter);
+		return queued;
+	}
+
+	switch (output->protocol) {
+		case NARC_PROTO_UDP :
+			return udp_client_queue_bytes(output);
+		case NARC_PROTO_TCP :
+			return tcp_client_queue_bytes(output);
+		case NARC_PROTO_SYSLOG :
+			return syslog_client_queue_bytes(output);
+	}
+	return 0;
+}
+
+/* Hand the message to the output, which takes its own reference. Over
+ * the queue limit the message is either dropped for this output alone,
+ * or taken anyway while the output holds the reads until it drained. */
+int
+submit_output_message(narc_output *output, narc_message *message)
+{
+	if (output->members != NULL)
+		return submit_output_message(output_group_member(output, message->stream), message);
+
+	message->refcount++;
+
+	if (output->queue_limit > 0 && output_queue_bytes(output) >= output->queue_limit) {
+		if (output->backpressure == NARC_BACKPRESSURE_DROP) {
+			output->dropped++;
+			free_message(message);
+			return NARC_ERR;
+		}
+		if (!output->blocked) {
+			narc_log(NARC_NOTICE, "Output %s is full, holding the reads", output->name);
+			output->blocked = 1;
+			output->blocked_count++;
+			server.blocked_outputs++;
+		}
+	}
+
+	switch (output->protocol) {
+		case NARC_PROTO_UDP :
+			return submit_udp_message(output, message);
+		case NARC_PROTO_TCP :
+			return submit_tcp_message(output, message);
+		case NARC_PROTO_SYSLOG :
+			return submit_syslog_message(output, message);
+	}
+
+	free_message(message);
+	return NARC_ERR;
+}
+
+/* Called by the transports as their queues go down. A blocked output
+ * lets the reads go again once it is back under half its limit. */
+void
+output_drained(narc_output *output)
+{
+	if (!output->blocked || output_queue_bytes(output) > output->queue_limit / 2)
+		return;
+
+	output->blocked = 0;
+	if (--server.blocked_outputs == 0)
+		resume_streams();
+}
+
+/* Called by the transports with the bytes they hand to the wire, after
+ * framing and compression, so the bandwidth limit counts every output. */
+void
+output_wrote(narc_output *output, size_t bytes)
+{
+	output->write_bytes += bytes;
+	shaper_consume(&server.shaper, bytes);
+}
+
+/* Whether the files may be read, no output holding the reads. */
+int
+outputs_ready(void)
+{
+	return server.blocked_outputs == 0;
+}
+
+/* Whether a message may hold newlines, every output framing messages
+ * by their length. Newline framing and udp packing would split it. */
+int
+outputs_keep_newlines(void)
+{
+	listIter *iter;
+	listNode *node;
+	int keep = 1;
+
+	// before init_outputs() the remote-* output is not in the list yet
+	if (listLength(server.outputs) == 0)
+		return server.default_output->protocol == NARC_PROTO_TCP
+			&& server.default_output->framing == NARC_FRAMING_OCTET;
+
+	iter = listGetIterator(server.outputs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_output *output = (narc_output *)listNodeValue(node);
+
+		if (output->protocol != NARC_PROTO_TCP || output->framing != NARC_FRAMING_OCTET)
+			keep = 0;
+	}
+	listReleaseIterator(iter);
+	return keep;
+}
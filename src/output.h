@@ -0,0 +1,121 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_OUTPUT
+#define NARC_OUTPUT 
+
+#include "narc.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <uv.h>		/* Event driven programming library */
+
+/* what happens once an output has queue_limit bytes queued */
+#define NARC_BACKPRESSURE_DROP	1	/* drop what this output can't take */
+#define NARC_BACKPRESSURE_BLOCK	2	/* stop reading the files until it drained */
+
+#define NARC_DEFAULT_OUTPUT_NAME	"default"
+#define NARC_DEFAULT_OUTPUT_QUEUE	(32*1024*1024)
+
+#define NARC_GROUP_POINTS	64	/* points per member on the hash ring */
+#define NARC_MAX_CONNECTIONS	64	/* parallel connections of a tcp output */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+struct narc_output;
+
+/* a point of a member on the consistent hash ring of a group */
+typedef struct {
+	uint64_t		hash;
+	struct narc_output	*member;
+} narc_ring_point;
+
+typedef struct narc_output {
+	char		*name;			/* output name */
+	int		protocol;		/* transport */
+	char		*host;			/* remote host */
+	int		port;			/* remote port */
+	char		*path;			/* local syslog socket */
+	struct narc_resolver	*resolver;	/* cached addresses of host, NULL for syslog */
+	int		framing;		/* how tcp messages are delimited */
+	int		compression;		/* tcp wire compression codec */
+	int		compression_level;	/* codec level */
+	sds		dictionary;		/* zstd dictionary, NULL for none */
+	unsigned	dictionary_id;		/* its id, sent in every frame */
+	size_t		packing;		/* udp payload filled with messages, 0 to disable */
+	uint64_t	linger;			/* millisecond delay before sending a partly filled datagram */
+	size_t		queue_limit;		/* bytes queued before backpressure, 0 for no limit */
+	int		backpressure;		/* NARC_BACKPRESSURE_* */
+	int		blocked;		/* over the queue limit, holding the reads */
+	void		*client;		/* the transport data pointer */
+
+	/* groups */
+	list		*members;		/* member outputs, NULL unless a group */
+	int		connections;		/* parallel tcp connections to the destination */
+	int		pool;			/* the members are connections of this output */
+	struct narc_output	*group;			/* group the output is a member of */
+	narc_ring_point	*ring;			/* member points, sorted by hash */
+	int		ring_size;		/* points on the ring */
+	struct narc_output	**placed;		/* member each stream went to last, by stream number */
+	uint64_t	failovers;		/* messages sent past their member while it was down */
+
+	/* counters */
+	uint64_t	connects;		/* connections established */
+	uint64_t	reconnects;		/* connections lost or refused */
+	uint64_t	write_calls;		/* writes or datagrams issued */
+	uint64_t	write_messages;		/* messages written */
+	uint64_t	write_bytes;		/* bytes written */
+	uint64_t	write_errors;		/* writes that failed */
+	uint64_t	dropped;		/* messages dropped while disconnected or over the queue limit */
+	uint64_t	blocked_count;		/* times the output held the reads */
+	uint64_t	compress_batches;	/* batches compressed */
+	uint64_t	compress_offloaded;	/* batches compressed on the thread pool */
+	uint64_t	compress_in_bytes;	/* bytes before compression */
+	uint64_t	compress_out_bytes;	/* bytes after compression */
+	uint64_t	compress_cpu_ns;	/* cpu time spent compressing */
+} narc_output;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+narc_output	*new_output(char *name);
+void	free_output(void *ptr);
+narc_output	*find_output(char *name);
+narc_output	*add_output_member(narc_output *group, char *host, int port);
+void	init_outputs(void);
+void	clean_outputs(void);
+int	submit_output_message(narc_output *output, narc_message *message);
+void	output_drained(narc_output *output);
+int	output_connected(narc_output *output);
+size_t	output_queue_bytes(narc_output *output);
+void	output_wrote(narc_output *output, size_t bytes);
+int	outputs_ready(void);
+int	outputs_keep_newlines(void);
+const char	*output_protocol_name(narc_output *output);
+
+#endif
@@ -0,0 +1,285 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "resolver.h"
+
+#include "adlist.h"	/* linked lists */
+
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <uv.h>		/* Event driven programming library */
+
+static list *resolvers = NULL;	/* one per host and port */
+static int stopping = 0;	/* lookups finishing after the shutdown are ignored */
+
+void	start_resolve(narc_resolver *resolver);
+
+/*============================ Utility functions ============================ */
+
+narc_resolver *
+new_resolver(char *host, int port)
+{
+	narc_resolver *resolver = (narc_resolver *)malloc(sizeof(narc_resolver));
+	memset(resolver, 0, sizeof(narc_resolver));
+
+	resolver->host = strdup(host);
+	resolver->port = port;
+	resolver->req.data = (void *)resolver;
+	resolver->waiting = listCreate();
+	listSetFreeMethod(resolver->waiting, free);
+
+	// a literal address needs no lookup
+	if (uv_ip4_addr(host, port, (struct sockaddr_in *)&resolver->addresses[0]) == 0
+		|| uv_ip6_addr(host, port, (struct sockaddr_in6 *)&resolver->addresses[0]) == 0) {
+		resolver->numeric = 1;
+		resolver->count = 1;
+		return resolver;
+	}
+	memset(&resolver->addresses[0], 0, sizeof(struct sockaddr_storage));
+
+	resolver->refresh_timer = (uv_timer_t *)malloc(sizeof(uv_timer_t));
+	uv_timer_init(server.loop, resolver->refresh_timer);
+	uv_unref((uv_handle_t *)resolver->refresh_timer);
+	resolver->refresh_timer->data = (void *)resolver;
+	return resolver;
+}
+
+void
+notify_resolver_waiters(narc_resolver *resolver)
+{
+	listNode *node;
+
+	while ((node = listFirst(resolver->waiting)) != NULL) {
+		narc_resolve_waiter *waiter = (narc_resolve_waiter *)listNodeValue(node);
+		narc_resolved_cb *callback = waiter->callback;
+		void *data = waiter->data;
+
+		listDelNode(resolver->waiting, node);
+		callback(data);
+	}
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_refresh_timeout(uv_timer_t *timer)
+{
+	start_resolve((narc_resolver *)timer->data);
+}
+
+void
+handle_resolved(uv_getaddrinfo_t *req, int status, struct addrinfo *res)
+{
+	narc_resolver *resolver = (narc_resolver *)req->data;
+	struct sockaddr_storage addresses[NARC_RESOLVER_MAX_ADDRESSES];
+	char name[NARC_ADDRESS_NAME_LEN];
+	struct addrinfo *ai;
+	int count = 0;
+
+	resolver->resolving = 0;
+	if (status == 0) {
+		// in the order getaddrinfo sorted them, the preferred one first
+		for (ai = res; ai != NULL && count < NARC_RESOLVER_MAX_ADDRESSES; ai = ai->ai_next) {
+			if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+				continue;
+			memset(&addresses[count], 0, sizeof(struct sockaddr_storage));
+			memcpy(&addresses[count], ai->ai_addr, ai->ai_addrlen);
+			count++;
+		}
+		uv_freeaddrinfo(res);
+	}
+	if (stopping)
+		return;
+
+	if (count == 0) {
+		resolver->failures++;
+		// warn once, until a lookup succeeds again
+		if (resolver->failing++ > 0)
+			narc_log(NARC_DEBUG, "Can't resolve %s: %s",
+				resolver->host,
+				status ? uv_strerror(status) : "no address");
+		else if (resolver->count > 0)
+			narc_log(NARC_WARNING, "Can't resolve %s: %s, keeping %s",
+				resolver->host,
+				status ? uv_strerror(status) : "no address",
+				format_address(resolver_address(resolver, 0), name, sizeof(name)));
+		else
+			narc_log(NARC_WARNING, "Can't resolve %s: %s",
+				resolver->host,
+				status ? uv_strerror(status) : "no address");
+		uv_timer_start(resolver->refresh_timer, handle_refresh_timeout, server.connect_retry_delay, 0);
+		return;
+	}
+
+	resolver->refreshes++;
+	resolver->failing = 0;
+	if (count != resolver->count
+		|| memcmp(addresses, resolver->addresses, count * sizeof(struct sockaddr_storage))) {
+		memcpy(resolver->addresses, addresses, count * sizeof(struct sockaddr_storage));
+		resolver->count = count;
+		narc_log(NARC_NOTICE, "Resolved %s to %s (%d address%s)",
+			resolver->host,
+			format_address(resolver_address(resolver, 0), name, sizeof(name)),
+			count,
+			count > 1 ? "es" : "");
+	}
+
+	if (server.dns_ttl > 0)
+		uv_timer_start(resolver->refresh_timer, handle_refresh_timeout, server.dns_ttl * 1000, 0);
+	notify_resolver_waiters(resolver);
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_resolve(narc_resolver *resolver)
+{
+	struct addrinfo hints;
+	char port[8];
+
+	if (resolver->resolving)
+		return;
+
+	// one entry per address, of either family this host can reach
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+	snprintf(port, sizeof(port), "%d", resolver->port);
+
+	narc_log(NARC_DEBUG, "Resolving %s", resolver->host);
+	if (uv_getaddrinfo(server.loop, &resolver->req, handle_resolved, resolver->host, port, &hints) == 0)
+		resolver->resolving = 1;
+	else {
+		resolver->failures++;
+		uv_timer_start(resolver->refresh_timer, handle_refresh_timeout, server.connect_retry_delay, 0);
+	}
+}
+
+/*================================== API ==================================== */
+
+/* The cached addresses of host, looked up in the background the first
+ * time it is asked for. */
+narc_resolver *
+get_resolver(char *host, int port)
+{
+	narc_resolver *resolver;
+	listIter *iter;
+	listNode *node;
+
+	if (resolvers == NULL)
+		resolvers = listCreate();
+
+	iter = listGetIterator(resolvers, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		resolver = (narc_resolver *)listNodeValue(node);
+		if (resolver->port == port && !strcmp(resolver->host, host)) {
+			listReleaseIterator(iter);
+			return resolver;
+		}
+	}
+	listReleaseIterator(iter);
+
+	resolver = new_resolver(host, port);
+	listAddNodeTail(resolvers, (void *)resolver);
+	if (!resolver->numeric)
+		start_resolve(resolver);
+	return resolver;
+}
+
+/* Calls back once the host has addresses, for clients that found none. */
+void
+resolver_wait(narc_resolver *resolver, narc_resolved_cb *callback, void *data)
+{
+	narc_resolve_waiter *waiter = (narc_resolve_waiter *)malloc(sizeof(narc_resolve_waiter));
+
+	waiter->callback = callback;
+	waiter->data = data;
+	listAddNodeTail(resolver->waiting, (void *)waiter);
+}
+
+/* The index-th address, wrapping around, NULL until the first lookup
+ * succeeded. */
+struct sockaddr *
+resolver_address(narc_resolver *resolver, int index)
+{
+	if (resolver->count == 0)
+		return NULL;
+	return (struct sockaddr *)&resolver->addresses[index % resolver->count];
+}
+
+/* The index of the first address of family, -1 if there is none. */
+int
+resolver_find(narc_resolver *resolver, int family)
+{
+	int i;
+
+	for (i = 0; i < resolver->count; i++)
+		if (resolver->addresses[i].ss_family == family)
+			return i;
+	return -1;
+}
+
+char *
+format_address(struct sockaddr *addr, char *buf, size_t len)
+{
+	char ip[NARC_ADDRESS_NAME_LEN];
+
+	if (addr == NULL)
+		snprintf(buf, len, "none");
+	else if (addr->sa_family == AF_INET6) {
+		uv_ip6_name((struct sockaddr_in6 *)addr, ip, sizeof(ip));
+		snprintf(buf, len, "[%s]:%d", ip, ntohs(((struct sockaddr_in6 *)addr)->sin6_port));
+	} else {
+		uv_ip4_name((struct sockaddr_in *)addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%d", ip, ntohs(((struct sockaddr_in *)addr)->sin_port));
+	}
+	return buf;
+}
+
+void
+clean_resolvers(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	stopping = 1;
+	if (resolvers == NULL)
+		return;
+
+	iter = listGetIterator(resolvers, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_resolver *resolver = (narc_resolver *)listNodeValue(node);
+
+		// a lookup stuck on a slow server would hold the loop open
+		if (resolver->resolving)
+			uv_cancel((uv_req_t *)&resolver->req);
+		if (resolver->refresh_timer != NULL)
+			uv_timer_stop(resolver->refresh_timer);
+	}
+	listReleaseIterator(iter);
+}
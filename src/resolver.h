@@ -0,0 +1,80 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_RESOLVER
+#define NARC_RESOLVER 
+
+#include "adlist.h"	/* linked lists */
+
+#include <stdint.h>	/* fixed width integers */
+#include <uv.h>		/* Event driven programming library */
+
+#define NARC_RESOLVER_MAX_ADDRESSES	16	/* addresses kept per host */
+#define NARC_ADDRESS_NAME_LEN		64	/* room for [ipv6]:port */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+typedef void narc_resolved_cb(void *data);
+
+/* a client waiting for the first addresses of a host */
+typedef struct {
+	narc_resolved_cb	*callback;
+	void			*data;
+} narc_resolve_waiter;
+
+/* The addresses of a host, shared by every client sending to it. They
+ * are refreshed in the background every dns-ttl seconds, so connecting
+ * never waits on dns, and a failed lookup keeps the last known good
+ * ones. */
+typedef struct narc_resolver {
+	char		*host;
+	int		port;
+	int		numeric;	/* a literal address, never looked up */
+	struct sockaddr_storage	addresses[NARC_RESOLVER_MAX_ADDRESSES];
+	int		count;		/* addresses known, in the order to try them */
+	int		resolving;	/* a lookup is on the thread pool */
+	int		failing;	/* lookups failed since the last success */
+	uv_getaddrinfo_t	req;
+	uv_timer_t	*refresh_timer;	/* starts the next lookup */
+	list		*waiting;	/* narc_resolve_waiter, until the first addresses */
+	uint64_t	refreshes;	/* lookups that succeeded */
+	uint64_t	failures;	/* lookups that failed */
+} narc_resolver;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+narc_resolver	*get_resolver(char *host, int port);
+void	resolver_wait(narc_resolver *resolver, narc_resolved_cb *callback, void *data);
+struct sockaddr	*resolver_address(narc_resolver *resolver, int index);
+int	resolver_find(narc_resolver *resolver, int family);
+char	*format_address(struct sockaddr *addr, char *buf, size_t len);
+void	clean_resolvers(void);
+
+#endif
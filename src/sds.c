@@ -292,25 +292,26 @@ sds sdscpy(sds s, const char *t) {
 /* Like sdscatpritf() but gets va_list instead of being variadic. */
 sds sdscatvprintf(sds s, const char *fmt, va_list ap) {
     va_list cpy;
-    char *buf, *t;
-    size_t buflen = 16;
-
-    while(1) {
-        buf = malloc(buflen);
-        if (buf == NULL) return NULL;
-        buf[buflen-2] = '\0';
+    size_t avail = sdsavail(s);
+    int len;
+
+    /* Print straight into the free space at the end of the string, and
+     * only grow it when that was not enough. Reused strings end up never
+     * allocating at all. */
+    va_copy(cpy,ap);
+    len = vsnprintf(s+sdslen(s), avail+1, fmt, cpy);
+    va_end(cpy);
+    if (len < 0) return NULL;
+
+    if ((size_t)len > avail) {
+        s = sdsMakeRoomFor(s,len);
+        if (s == NULL) return NULL;
         va_copy(cpy,ap);
-        vsnprintf(buf, buflen, fmt, cpy);
-        if (buf[buflen-2] != '\0') {
-            free(buf);
-            buflen *= 2;
-            continue;
-        }
-        break;
+        vsnprintf(s+sdslen(s), len+1, fmt, cpy);
+        va_end(cpy);
     }
-    t = sdscat(s, buf);
-    free(buf);
-    return t;
+    sdsIncrLen(s,len);
+    return s;
 }
 
 /* Append to the sds string 's' a string obtained using printf-alike format
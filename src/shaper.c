@@ -0,0 +1,144 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "shaper.h"
+
+#include <stdlib.h>	/* standard library definitions */
+#include <uv.h>		/* Event driven programming library */
+
+/*============================ Utility functions ============================ */
+
+void
+refill_shaper(narc_shaper *shaper)
+{
+	uint64_t now = uv_now(server.loop);
+	int64_t added = (now - shaper->last_refill) * shaper->rate / 1000;
+
+	if (added == 0)
+		return;
+
+	shaper->tokens += added;
+	if (shaper->tokens > (int64_t)shaper->burst)
+		shaper->tokens = shaper->burst;
+	shaper->last_refill = now;
+}
+
+/*============================== Callbacks ================================== */
+
+void
+handle_shaper_timer(uv_timer_t *timer)
+{
+	narc_shaper *shaper = (narc_shaper *)timer->data;
+
+	refill_shaper(shaper);
+	if (shaper->tokens <= 0) {
+		uv_timer_start(timer, handle_shaper_timer, (-shaper->tokens * 1000) / shaper->rate + 1, 0);
+		return;
+	}
+
+	shaper->throttled_time += uv_now(server.loop) - shaper->throttle_start;
+	shaper->throttled = 0;
+	narc_log(NARC_DEBUG, "Bandwidth shaper resumed");
+
+	if (shaper->resume != NULL)
+		shaper->resume();
+}
+
+/*================================== API ==================================== */
+
+void
+init_shaper(narc_shaper *shaper, uint64_t rate, uint64_t burst, void (*resume)(void))
+{
+	shaper->rate           = rate;
+	shaper->burst          = burst;
+	shaper->tokens         = burst;
+	shaper->last_refill    = uv_now(server.loop);
+	shaper->throttled      = 0;
+	shaper->throttle_start = 0;
+	shaper->throttled_time = 0;
+	shaper->window_start   = shaper->last_refill;
+	shaper->window_bytes   = 0;
+	shaper->current_rate   = 0;
+	shaper->timer          = NULL;
+	shaper->resume         = resume;
+
+	if (rate == 0)
+		return;
+
+	shaper->timer = malloc(sizeof(uv_timer_t));
+	if (uv_timer_init(server.loop, shaper->timer) == 0)
+		shaper->timer->data = (void *)shaper;
+}
+
+/* Account for bytes handed to the transport. The bucket is allowed to go
+ * into debt, messages are never held back or dropped here; instead the
+ * readers stop until the debt is paid off. */
+void
+shaper_consume(narc_shaper *shaper, size_t bytes)
+{
+	uint64_t now = uv_now(server.loop);
+
+	shaper->window_bytes += bytes;
+	if (now - shaper->window_start >= 1000) {
+		shaper->current_rate = shaper->window_bytes * 1000 / (now - shaper->window_start);
+		shaper->window_start = now;
+		shaper->window_bytes = 0;
+	}
+
+	if (shaper->rate > 0)
+		shaper->tokens -= bytes;
+}
+
+/* Returns 1 if more data may be read, otherwise arms the timer that will
+ * call the resume callback once the bucket has tokens again. */
+int
+shaper_ready(narc_shaper *shaper)
+{
+	if (shaper->rate == 0)
+		return 1;
+
+	if (shaper->throttled)
+		return 0;
+
+	refill_shaper(shaper);
+	if (shaper->tokens > 0)
+		return 1;
+
+	shaper->throttled = 1;
+	shaper->throttle_start = uv_now(server.loop);
+	narc_log(NARC_DEBUG, "Bandwidth shaper throttling reads");
+	uv_timer_start(shaper->timer, handle_shaper_timer, (-shaper->tokens * 1000) / shaper->rate + 1, 0);
+
+	return 0;
+}
+
+uint64_t
+shaper_throttled_time(narc_shaper *shaper)
+{
+	if (shaper->throttled)
+		return shaper->throttled_time + uv_now(server.loop) - shaper->throttle_start;
+	return shaper->throttled_time;
+}
@@ -0,0 +1,60 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_SHAPER
+#define NARC_SHAPER 
+
+#include <uv.h>		/* Event driven programming library */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+typedef struct {
+	uint64_t	rate;			/* bytes per second, 0 when unlimited */
+	uint64_t	burst;			/* bucket size in bytes */
+	int64_t		tokens;			/* bytes that may be sent now */
+	uint64_t	last_refill;		/* loop time of the last refill */
+	int		throttled;		/* waiting for tokens */
+	uint64_t	throttle_start;		/* loop time throttling began */
+	uint64_t	throttled_time;		/* total milliseconds spent throttled */
+	uint64_t	window_start;		/* loop time the rate window began */
+	uint64_t	window_bytes;		/* bytes sent in the rate window */
+	uint64_t	current_rate;		/* bytes per second over the last window */
+	uv_timer_t	*timer;			/* wakes the shaper when tokens are back */
+	void		(*resume)(void);	/* called when throttling ends */
+} narc_shaper;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* api */
+void	init_shaper(narc_shaper *shaper, uint64_t rate, uint64_t burst, void (*resume)(void));
+void	shaper_consume(narc_shaper *shaper, size_t bytes);
+int	shaper_ready(narc_shaper *shaper);
+uint64_t shaper_throttled_time(narc_shaper *shaper);
+
+#endif
@@ -0,0 +1,298 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "narc.h"
+#include "stats.h"
+#include "stream.h"
+#include "output.h"
+#include "compress.h"
+#include "resolver.h"
+
+#include "sds.h"	/* dynamic safe strings */
+
+#include <stdlib.h>	/* standard library definitions */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <uv.h>		/* Event driven programming library */
+
+/*============================ Utility functions ============================ */
+
+sds
+stats_server_info(sds info)
+{
+	return sdscatprintf(info,
+		"# Server\r\n"
+		"narc_version:%s\r\n"
+		"arch_bits:%d\r\n"
+		"process_id:%d\r\n"
+		"uptime_in_seconds:%ld\r\n"
+		"loop_iterations:%llu\r\n"
+		"loop_max_busy_ms:%.3f\r\n"
+		"loop_stalls:%llu\r\n"
+		"loop_max_stall_ms:%.3f\r\n"
+		"log_dropped:%llu\r\n",
+		NARC_VERSION,
+		server.arch_bits,
+		(int)getpid(),
+		(long)(time(NULL) - server.start_time),
+		(unsigned long long)server.loop_iterations,
+		server.loop_max_busy / 1e6,
+		(unsigned long long)__atomic_load_n(&server.loop_stalls, __ATOMIC_RELAXED),
+		server.loop_max_stall / 1e6,
+		(unsigned long long)logger_dropped(&server.logger));
+}
+
+sds
+stats_streams_info(sds info)
+{
+	listIter *iter;
+	listNode *node;
+	int j = 0;
+
+	info = sdscat(info, "\r\n# Streams\r\n");
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+		info = sdscatprintf(info,
+			"stream%d:id=%s,file=%s,reads=%llu,read_bytes=%llu,lines=%llu,"
+			"sent=%llu,sent_bytes=%llu,suppressed=%llu,filtered=%llu,"
+			"sampled=%llu,dropped=%llu,lag_bytes=%lld,lag_seconds=%llu",
+			j++, stream->id, stream->file,
+			(unsigned long long)stream->read_calls,
+			(unsigned long long)stream->read_bytes,
+			(unsigned long long)stream->line_count,
+			(unsigned long long)stream->sent_count,
+			(unsigned long long)stream->sent_bytes,
+			(unsigned long long)stream->suppressed_count,
+			(unsigned long long)stream->filtered_count,
+			(unsigned long long)stream->sampled_count,
+			(unsigned long long)stream->dropped_count,
+			(long long)stream_lag_bytes(stream),
+			(unsigned long long)stream_lag_seconds(stream));
+
+		if (server.verify_digest) {
+			char hex[41];
+
+			digestHex(stream->digest, hex);
+			info = sdscatprintf(info, ",digest_count=%llu,digest=%s",
+				(unsigned long long)stream->digest_count, hex);
+		}
+		info = sdscatlen(info, "\r\n", 2);
+	}
+	listReleaseIterator(iter);
+
+	return info;
+}
+
+/* One line per output. A group or a pool gets a line of its own,
+ * followed by the lines of its members. */
+sds
+stats_output_info(sds info, narc_output *output, int *j)
+{
+	if (output->members != NULL) {
+		listIter *iter;
+		listNode *node;
+
+		info = sdscatprintf(info,
+			"output%d:name=%s,protocol=%s,members=%lu,healthy=%d,queue_bytes=%zu,failovers=%llu\r\n",
+			(*j)++, output->name, output_protocol_name(output),
+			listLength(output->members),
+			output_connected(output),
+			output_queue_bytes(output),
+			(unsigned long long)output->failovers);
+
+		iter = listGetIterator(output->members, AL_START_HEAD);
+		while ((node = listNext(iter)) != NULL)
+			info = stats_output_info(info, (narc_output *)listNodeValue(node), j);
+		listReleaseIterator(iter);
+		return info;
+	}
+
+	info = sdscatprintf(info, "output%d:name=%s,protocol=%s,", (*j)++,
+		output->name, output_protocol_name(output));
+	if (output->protocol == NARC_PROTO_SYSLOG)
+		info = sdscatprintf(info, "remote=%s,", output->path);
+	else {
+		char name[NARC_ADDRESS_NAME_LEN];
+
+		// the cached addresses, with the preferred one
+		info = sdscatprintf(info,
+			"remote=%s:%d,address=%s,addresses=%d,dns_refreshes=%llu,dns_failures=%llu,",
+			output->host, output->port,
+			format_address(resolver_address(output->resolver, 0), name, sizeof(name)),
+			output->resolver->count,
+			(unsigned long long)output->resolver->refreshes,
+			(unsigned long long)output->resolver->failures);
+	}
+	info = sdscatprintf(info,
+		"connected=%d,queue_bytes=%zu,queue_limit=%zu,blocked=%d,"
+		"connects=%llu,reconnects=%llu,write_calls=%llu,write_messages=%llu,"
+		"write_bytes=%llu,write_errors=%llu,dropped=%llu,blocked_count=%llu",
+		output_connected(output),
+		output_queue_bytes(output),
+		output->queue_limit,
+		output->blocked,
+		(unsigned long long)output->connects,
+		(unsigned long long)output->reconnects,
+		(unsigned long long)output->write_calls,
+		(unsigned long long)output->write_messages,
+		(unsigned long long)output->write_bytes,
+		(unsigned long long)output->write_errors,
+		(unsigned long long)output->dropped,
+		(unsigned long long)output->blocked_count);
+	if (output->protocol == NARC_PROTO_UDP && output->packing > 0) {
+		// how full the datagrams were, against the configured payload
+		double calls = output->write_calls ? (double)output->write_calls : 1;
+		info = sdscatprintf(info,
+			",packing_size=%zu,packing_messages_per_datagram=%.2f,packing_efficiency=%.2f",
+			output->packing,
+			output->write_messages / calls,
+			100.0 * output->write_bytes / (calls * output->packing));
+	}
+	if (output->compression != NARC_COMPRESSION_NONE) {
+		// the ratio, and the cpu it costs per uncompressed megabyte
+		double in = output->compress_in_bytes ? (double)output->compress_in_bytes : 1;
+		double out = output->compress_out_bytes ? (double)output->compress_out_bytes : 1;
+		info = sdscatprintf(info,
+			",compression=%s,compress_level=%d,compress_dictionary=%u,compress_batches=%llu,compress_offloaded=%llu,"
+			"compress_in_bytes=%llu,compress_out_bytes=%llu,compress_ratio=%.2f,"
+			"compress_cpu_ms=%llu,compress_cpu_ms_per_mb=%.3f",
+			compression_name(output->compression),
+			output->compression_level,
+			output->dictionary_id,
+			(unsigned long long)output->compress_batches,
+			(unsigned long long)output->compress_offloaded,
+			(unsigned long long)output->compress_in_bytes,
+			(unsigned long long)output->compress_out_bytes,
+			output->compress_in_bytes ? in / out : 0,
+			(unsigned long long)(output->compress_cpu_ns / 1000000),
+			output->compress_cpu_ns / 1e6 / (in / (1024 * 1024)));
+	}
+	return sdscatlen(info, "\r\n", 2);
+}
+
+sds
+stats_transport_info(sds info)
+{
+	listIter *iter;
+	listNode *node;
+	int j = 0;
+
+	info = sdscat(info, "\r\n# Transport\r\n");
+
+	iter = listGetIterator(server.outputs, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		info = stats_output_info(info, (narc_output *)listNodeValue(node), &j);
+	listReleaseIterator(iter);
+
+	return sdscatprintf(info,
+		"bandwidth_limit:%llu\r\n"
+		"bandwidth_rate:%llu\r\n"
+		"bandwidth_throttled:%d\r\n"
+		"bandwidth_throttled_ms:%llu\r\n",
+		(unsigned long long)server.shaper.rate,
+		(unsigned long long)server.shaper.current_rate,
+		server.shaper.throttled,
+		(unsigned long long)shaper_throttled_time(&server.shaper));
+}
+
+/*============================== Callbacks ================================== */
+
+void
+handle_stats_write(uv_write_t *req, int status)
+{
+	sdsfree((sds)req->data);
+	uv_close((uv_handle_t *)req->handle, (uv_close_cb)free);
+	free(req);
+}
+
+/* Every connection gets the full report, then the socket is closed, so
+ * `nc -U /path/to/socket` is all it takes to read the stats. */
+void
+handle_stats_connection(uv_stream_t *listener, int status)
+{
+	if (status != 0) {
+		narc_log(NARC_WARNING, "Stats connection error: %s", uv_err_name(status));
+		return;
+	}
+
+	uv_pipe_t *client = malloc(sizeof(uv_pipe_t));
+	uv_pipe_init(server.loop, client, 0);
+
+	if (uv_accept(listener, (uv_stream_t *)client) != 0) {
+		uv_close((uv_handle_t *)client, (uv_close_cb)free);
+		return;
+	}
+
+	sds info = stats_info(sdsempty());
+	uv_write_t *req = malloc(sizeof(uv_write_t));
+	uv_buf_t buf = uv_buf_init(info, sdslen(info));
+
+	req->data = (void *)info;
+	if (uv_write(req, (uv_stream_t *)client, &buf, 1, handle_stats_write) != 0) {
+		sdsfree(info);
+		free(req);
+		uv_close((uv_handle_t *)client, (uv_close_cb)free);
+	}
+}
+
+/*================================== API ==================================== */
+
+sds
+stats_info(sds info)
+{
+	info = stats_server_info(info);
+	info = stats_streams_info(info);
+	info = stats_transport_info(info);
+	info = sdscat(info, "\r\n# Latency\r\n");
+	info = latency_info(info);
+	return info;
+}
+
+void
+init_stats_server(void)
+{
+	uv_pipe_t *listener = malloc(sizeof(uv_pipe_t));
+	int err;
+
+	unlink(server.stats_socket);
+	uv_pipe_init(server.loop, listener, 0);
+
+	if ((err = uv_pipe_bind(listener, server.stats_socket)) != 0 ||
+		(err = uv_listen((uv_stream_t *)listener, 16, handle_stats_connection)) != 0) {
+		narc_log(NARC_WARNING, "Can't listen on stats socket %s: %s",
+			server.stats_socket, uv_err_name(err));
+		uv_close((uv_handle_t *)listener, (uv_close_cb)free);
+		return;
+	}
+
+	narc_log(NARC_NOTICE, "Stats available on %s", server.stats_socket);
+}
+
+void
+clean_stats_server(void)
+{
+	unlink(server.stats_socket);
+}
@@ -26,9 +26,11 @@
 #include "narc.h"
 #include "stream.h"
 #include "sds.h"	/* dynamic safe strings */
+#include "util.h"	/* Misc functions useful in many places */
+#include "crc64.h"
 
 // temporary
-#include "tcp_client.h"
+#include "output.h"
 
 #include <stdio.h>	/* standard buffered input/output */
 #include <stdlib.h>	/* standard library definitions */
@@ -98,23 +100,203 @@ stream_unlocked(narc_stream *stream)
 	return (stream->lock == NARC_STREAM_UNLOCKED);
 }
 
+/* Admit a message against the global budget. Each stream that asked for
+ * budget recently is handed its weighted quantum every tick, deficit
+ * round robin style, and may spend it first. Budget that isn't claimed
+ * by another busy stream can be borrowed, so a lone busy stream still
+ * gets the whole limit, but it can never starve the others. */
+int
+global_rate_allows(narc_stream *stream)
+{
+	int64_t reserved;
+
+	if (server.global_rate_limit == 0)
+		return 1;
+
+	stream->demand = NARC_GLOBAL_RATE_IDLE;
+
+	if (server.global_tokens < NARC_GLOBAL_RATE_UNIT)
+		return 0;
+
+	if (stream->deficit >= NARC_GLOBAL_RATE_UNIT) {
+		stream->deficit -= NARC_GLOBAL_RATE_UNIT;
+		server.global_deficit -= NARC_GLOBAL_RATE_UNIT;
+		server.global_tokens -= NARC_GLOBAL_RATE_UNIT;
+		return 1;
+	}
+
+	reserved = server.global_deficit - stream->deficit;
+	if (server.global_tokens - reserved >= NARC_GLOBAL_RATE_UNIT) {
+		server.global_tokens -= NARC_GLOBAL_RATE_UNIT;
+		return 1;
+	}
+
+	return 0;
+}
+
 void
 submit_message(narc_stream *stream, char *message)
 {
-	if (stream->rate_count < server.rate_limit) {
-		if (stream->missed_count > 0) {
+	if (stream->rate_count < server.rate_limit && global_rate_allows(stream)) {
+		// the notice pays its own way, or waits for the next message
+		if (stream->missed_count > 0 && global_rate_allows(stream)) {
 			char str[81];
 			sprintf(&str[0], "Suppressed %d messages due to rate limiting", stream->missed_count);
 			stream->rate_count++;
 			start_rate_limit_timer(stream);
-			handle_message(stream->id, &str[0]);
+			handle_message(stream, &str[0]);
 			stream->missed_count = 0;
 		}
 		stream->rate_count++;
 		start_rate_limit_timer(stream);
-		handle_message(stream->id, message);
+		handle_message(stream, message);
 	} else {
 		stream->missed_count++;
+		stream->suppressed_count++;
+	}
+}
+
+/* Decide from the content alone whether a record is kept, so the same
+ * line is kept or dropped on every host. The crc is run through a
+ * finalizer so the high bits compared against the threshold are mixed. */
+int
+sample_record(narc_stream *stream, char *record, size_t len)
+{
+	uint64_t hash;
+
+	if (stream->sample_field > 0) {
+		char *end = record + len;
+		int field = 1;
+
+		while (record < end && field < stream->sample_field) {
+			if (*record++ == ' ') {
+				while (record < end && *record == ' ') record++;
+				field++;
+			}
+		}
+		len = 0;
+		while (record + len < end && record[len] != ' ') len++;
+	}
+
+	hash  = crc64(0, (unsigned char *)record, len);
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash < stream->sample_threshold;
+}
+
+void
+handle_record(narc_stream *stream, char *record, size_t len)
+{
+	if (stream->filter != NULL && !filter_match(stream->filter, record, len)) {
+		stream->filtered_count++;
+		return;
+	}
+
+	if (stream->sample_threshold != UINT64_MAX && !sample_record(stream, record, len)) {
+		stream->sampled_count++;
+		return;
+	}
+
+	if (sdslen(stream->previous_line) == len && memcmp(record, stream->previous_line, len) == 0) {
+		stream->repeat_count++;
+		if (stream->repeat_count % 500 == 0) {
+			char str[NARC_MAX_LOGMSG_LEN + 20];
+			sprintf(&str[0], "Previous message repeated %d times", stream->repeat_count);
+			submit_message(stream, &str[0]);
+		}
+		return;
+	} else if (stream->repeat_count == 1) {
+		submit_message(stream, stream->previous_line);
+	} else if (stream->repeat_count > 1) {
+		char str[NARC_MAX_LOGMSG_LEN + 20];
+		sprintf(&str[0], "Previous message repeated %d times", stream->repeat_count);
+		submit_message(stream, &str[0]);
+	}
+
+	submit_message(stream, record);
+	stream->repeat_count = 0;
+	stream->previous_line = sdscpylen(stream->previous_line, record, len);
+}
+
+void
+flush_record(narc_stream *stream)
+{
+	if (stream->record_lines == 0)
+		return;
+
+	handle_record(stream, stream->record, sdslen(stream->record));
+	sdsclear(stream->record);
+	stream->record_lines = 0;
+
+	if (stream->multiline_timer != NULL)
+		uv_timer_stop(stream->multiline_timer);
+}
+
+/* Join lines into a single record until the pattern marks a boundary,
+ * or the record reaches the configured line or byte limits. */
+void
+handle_line(narc_stream *stream, char *line, size_t len)
+{
+	int match, boundary;
+	const char *separator;
+	size_t separator_len;
+
+	stream->line_count++;
+
+	if (stream->multiline_mode == NARC_MULTILINE_NONE) {
+		stream->record_offset = stream->line_offset;
+		handle_record(stream, line, len);
+		return;
+	}
+
+	match = stringmatchlen(stream->multiline_pattern, sdslen(stream->multiline_pattern), line, len, 0);
+
+	if (stream->multiline_mode == NARC_MULTILINE_START)
+		boundary = match;
+	else
+		boundary = !match;
+
+	// rsyslog's escape keeps the record a single message on the wire
+	separator = server.multiline_escape ? "#012" : "\n";
+	separator_len = strlen(separator);
+
+	if (boundary || sdslen(stream->record) + len + separator_len > (size_t)server.multiline_max_bytes)
+		flush_record(stream);
+
+	if (stream->record_lines > 0)
+		stream->record = sdscatlen(stream->record, separator, separator_len);
+	else
+		stream->record_offset = stream->line_offset;
+	stream->record = sdscatlen(stream->record, line, len);
+	stream->record_lines++;
+
+	if (stream->record_lines >= server.multiline_max_lines)
+		flush_record(stream);
+	else
+		start_multiline_timer(stream);
+}
+
+/* Close the file and its watcher so it can be opened again, after it
+ * was rotated or deleted. */
+void
+close_stream_file(narc_stream *stream)
+{
+	uv_fs_t close_req;
+
+	// a record never spans two files
+	flush_record(stream);
+	if (stream->fd >= 0) {
+		uv_fs_close(server.loop, &close_req, stream->fd, NULL);
+		uv_fs_req_cleanup(&close_req);
+		stream->fd = -1;
+	}
+	if (stream->fs_events != NULL) {
+		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
+		stream->fs_events = NULL;
 	}
 }
 
@@ -167,27 +349,24 @@ handle_file_change(uv_fs_event_t *handle, const char *filename, int events, int
 
 	narc_stream *stream = handle->data;
 
+	// the watcher of a file that was already closed
+	if (handle != stream->fs_events)
+		return;
+
+	if (stream->event_time == 0)
+		stream->event_time = uv_hrtime();
+
 	if ((events & UV_RENAME) == UV_RENAME) {
 		narc_log(NARC_WARNING, "File renamed");
 		// File is being rotated
-		uv_fs_t close_req;
-		uv_fs_close(server.loop, &close_req, stream->fd, NULL);
-		// uv_fs_event_stop(stream->fs_events);
-		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
-		// free(stream->fs_events);
-		stream->fs_events = NULL;
+		close_stream_file(stream);
 		start_file_open(stream);
 	} else if ((events & UV_CHANGE) == UV_CHANGE) {
 		if (file_exists(stream->file)) {
 			start_file_stat(stream);
 		} else {
 			narc_log(NARC_WARNING, "File deleted: %s, attempting to re-open", stream->file);
-			uv_fs_t close_req;
-			uv_fs_close(server.loop, &close_req, stream->fd, NULL);
-			// uv_fs_event_stop(stream->fs_events);
-			uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
-			// free(stream->fs_events);
-			stream->fs_events = NULL;
+			close_stream_file(stream);
 			start_file_open(stream);
 		}
 	}
@@ -203,6 +382,7 @@ handle_file_stat(uv_fs_t* req)
 		// file is initially opened
 		if (stream->size < 0){
 			stream->offset = stat->st_size;
+			stream->caught_up = uv_now(server.loop);
 		}
 
 		// file has been truncated
@@ -219,14 +399,12 @@ handle_file_stat(uv_fs_t* req)
 
 		start_file_read(stream);
 	} else {
-		// there was an error, try things again?
-		uv_fs_t close_req;
-		uv_fs_close(server.loop, &close_req, stream->fd, NULL);
-		// uv_fs_event_stop(stream->fs_events);
-		uv_close((uv_handle_t *)stream->fs_events, (uv_close_cb)free);
-		// free(stream->fs_events);
-		stream->fs_events = NULL;
-		start_file_open(stream);
+		// there was an error, try things again? unless the file
+		// was rotated meanwhile and is already being re-opened
+		if (stream->fd >= 0) {
+			close_stream_file(stream);
+			start_file_open(stream);
+		}
 	}
 
 	uv_fs_req_cleanup(req);
@@ -238,44 +416,29 @@ handle_file_read(uv_fs_t *req)
 {
 	narc_stream *stream = req->data;
 
+	stream->read_time = uv_hrtime();
+	if (stream->event_time != 0) {
+		histogram_record(&server.read_latency, (stream->read_time - stream->event_time) / 1000);
+		stream->event_time = 0;
+	}
+
 	if (req->result < 0)
 		narc_log(NARC_WARNING, "Read error (%s): %s", stream->file, uv_err_name(req->result));
 
 	if (req->result > 0) {
+		int64_t start = stream->offset;
 		stream->offset += req->result;
+		stream->read_bytes += req->result;
 		int i;
 		for (i = 0; i < req->result; i++) {
-			if (stream->index == 0)
+			if (stream->index == 0) {
 				init_line(stream->current_line);
+				stream->line_offset = start + i;
+			}
 
 			if (stream->buffer->base[i] == '\n' || stream->index == NARC_MAX_MESSAGE_SIZE -1) {
 				stream->current_line[stream->index] = '\0';
-
-				if (strcmp(stream->current_line, stream->previous_line) == 0 ) {
-					stream->repeat_count++;
-					init_line(stream->current_line);
-					stream->index = 0;
-					if (stream->repeat_count % 500 == 0) {
-						char str[NARC_MAX_LOGMSG_LEN + 20];
-						sprintf(&str[0], "Previous message repeated %d times", stream->repeat_count);
-						submit_message(stream, &str[0]);
-					}
-					continue;
-				} else if (stream->repeat_count == 1) {
-					submit_message(stream, stream->previous_line);
-				} else if (stream->repeat_count > 1) {
-					char str[NARC_MAX_LOGMSG_LEN + 20];
-					sprintf(&str[0], "Previous message repeated %d times", stream->repeat_count);
-					submit_message(stream, &str[0]);
-				}
-
-				submit_message(stream, stream->current_line);
-				stream->repeat_count = 0;
-				
-				char *tmp = stream->previous_line;
-				stream->previous_line = stream->current_line;
-				stream->current_line = tmp;
-
+				handle_line(stream, stream->current_line, stream->index);
 				stream->index = 0;
 			} else {
 				stream->current_line[stream->index] = stream->buffer->base[i];
@@ -284,7 +447,12 @@ handle_file_read(uv_fs_t *req)
 		}
 	}
 
-	if (stream->truncate == 1) {
+	if (stream->offset >= stream->size)
+		stream->caught_up = uv_now(server.loop);
+
+	// only truncate once everything has been read, a throttled
+	// stream may still have data waiting on disk
+	if (stream->truncate == 1 && stream->offset >= stream->size) {
 		if (truncate(stream->file, 0) == -1) {
 			narc_log(NARC_WARNING, "Truncate error (%s): %s", stream->file, strerror(errno));
 		}
@@ -310,6 +478,80 @@ handle_rate_limit_timer(uv_timer_t* timer)
 	// free(timer);
 }
 
+void
+handle_multiline_timeout(uv_timer_t* timer)
+{
+	narc_stream *stream = (narc_stream *)timer->data;
+	uint64_t now = uv_now(server.loop);
+
+	// lines joined since it was armed push the deadline back
+	if (now < stream->record_deadline) {
+		uv_timer_start(timer, handle_multiline_timeout, stream->record_deadline - now, 0);
+		return;
+	}
+	flush_record(stream);
+}
+
+void
+handle_global_rate_timer(uv_timer_t* timer)
+{
+	int64_t budget = (int64_t)server.global_rate_limit * NARC_GLOBAL_RATE_UNIT * NARC_GLOBAL_RATE_TICK / 1000;
+	listIter *iter;
+	listNode *node;
+
+	server.global_tokens  = budget;
+	server.global_deficit = 0;
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+		int64_t quantum = budget * stream->weight / server.global_weight;
+
+		if (stream->demand > 0) {
+			stream->deficit += quantum;
+			if (stream->deficit > quantum + NARC_GLOBAL_RATE_UNIT)
+				stream->deficit = quantum + NARC_GLOBAL_RATE_UNIT;
+			stream->demand--;
+		} else
+			stream->deficit = 0;
+
+		server.global_deficit += stream->deficit;
+	}
+	listReleaseIterator(iter);
+}
+
+void
+handle_lag_timer(uv_timer_t* timer)
+{
+	uint64_t now = uv_now(server.loop), interval = server.lag_warning_interval * 1000;
+	listIter *iter;
+	listNode *node;
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+		int64_t lag = stream_lag_bytes(stream);
+
+		if (lag <= (int64_t)server.lag_warning_bytes) {
+			stream->lag_since = 0;
+			continue;
+		}
+
+		if (stream->lag_since == 0)
+			stream->lag_since = now;
+
+		if (now - stream->lag_since >= interval && now - stream->lag_warned >= interval) {
+			narc_log(NARC_WARNING, "Stream %s is %lld bytes (%llu seconds) behind %s",
+				stream->id,
+				(long long)lag,
+				(unsigned long long)stream_lag_seconds(stream),
+				stream->file);
+			stream->lag_warned = now;
+		}
+	}
+	listReleaseIterator(iter);
+}
+
 /*================================= Watchers =================================== */
 
 void
@@ -357,9 +599,19 @@ start_file_read(narc_stream *stream)
 		return;
 	}
 
+	// the file is being re-opened
+	if (stream->fd < 0)
+		return;
+
+	if (!shaper_ready(&server.shaper) || !outputs_ready()) {
+		stream->throttled = 1;
+		return;
+	}
+
 	uv_fs_t *req = malloc(sizeof(uv_fs_t));
 	if (uv_fs_read(server.loop, req, stream->fd, stream->buffer, NARC_STREAM_BUFFERS, stream->offset, handle_file_read) == 0) {
 		lock_stream(stream);
+		stream->read_calls++;
 		req->data = (void *)stream;
 	}
 }
@@ -374,6 +626,58 @@ start_rate_limit_timer(narc_stream *stream)
 	}
 }
 
+/* Every joined line moves the deadline, the timer is only armed for the
+ * first one and catches up when it fires. */
+void
+start_multiline_timer(narc_stream *stream)
+{
+	stream->record_deadline = uv_now(server.loop) + server.multiline_timeout;
+
+	if (stream->multiline_timer == NULL) {
+		stream->multiline_timer = malloc(sizeof(uv_timer_t));
+		if (uv_timer_init(server.loop, stream->multiline_timer) != 0) {
+			// nothing would flush the record later
+			free(stream->multiline_timer);
+			stream->multiline_timer = NULL;
+			flush_record(stream);
+			return;
+		}
+		stream->multiline_timer->data = (void *)stream;
+	} else if (uv_is_active((uv_handle_t *)stream->multiline_timer))
+		return;
+	uv_timer_start(stream->multiline_timer, handle_multiline_timeout, server.multiline_timeout, 0);
+}
+
+void
+start_global_rate_timer(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	server.global_weight = 0;
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		server.global_weight += ((narc_stream *)listNodeValue(node))->weight;
+	listReleaseIterator(iter);
+
+	if (server.global_weight == 0)
+		return;
+
+	handle_global_rate_timer(NULL);
+
+	uv_timer_t *timer = malloc(sizeof(uv_timer_t));
+	if (uv_timer_init(server.loop, timer) == 0)
+		uv_timer_start(timer, handle_global_rate_timer, NARC_GLOBAL_RATE_TICK, NARC_GLOBAL_RATE_TICK);
+}
+
+void
+start_lag_timer(void)
+{
+	uv_timer_t *timer = malloc(sizeof(uv_timer_t));
+	if (uv_timer_init(server.loop, timer) == 0)
+		uv_timer_start(timer, handle_lag_timer, 1000, 1000);
+}
+
 /*================================= API =================================== */
 
 narc_stream
@@ -389,16 +693,51 @@ narc_stream
 	stream->lock                = NARC_STREAM_UNLOCKED;
 	stream->rate_count          = 0;
 	stream->missed_count        = 0;
+	stream->weight              = 1;
+	stream->deficit             = 0;
+	stream->demand              = 0;
+	stream->throttled           = 0;
+	stream->read_calls          = 0;
+	stream->read_bytes          = 0;
+	stream->line_count          = 0;
+	stream->sent_count          = 0;
+	stream->sent_bytes          = 0;
+	stream->suppressed_count    = 0;
+	stream->dropped_count       = 0;
+	stream->caught_up           = 0;
+	stream->lag_since           = 0;
+	stream->lag_warned          = 0;
+	stream->event_time          = 0;
+	stream->read_time           = 0;
+	stream->digest_count        = 0;
+	stream->sequence            = 0;
+	stream->rfc5424_header      = NULL;
+	stream->hash                = crc64(0, (unsigned char *)id, strlen(id));
+	stream->line_offset         = 0;
+	stream->record_offset       = 0;
+	memset(stream->digest, 0, sizeof(stream->digest));
 	stream->repeat_count        = 0;
 	stream->message_header_size = strlen(id) + strlen(server.stream_id) + 24;
 	stream->offset              = 0;
+	stream->fd                  = -1;
 	stream->fs_events			= NULL;
 	stream->open_timer			= NULL;
+	stream->multiline_timer		= NULL;
+	stream->multiline_mode		= NARC_MULTILINE_NONE;
+	stream->multiline_pattern	= NULL;
+	stream->record			= sdsempty();
+	stream->record_lines		= 0;
+	stream->record_deadline		= 0;
+	stream->filter			= NULL;
+	stream->filtered_count		= 0;
+	stream->sample_rate		= 1.0;
+	stream->sample_threshold	= UINT64_MAX;
+	stream->sample_field		= 0;
+	stream->sampled_count		= 0;
 
 	stream->current_line  = &stream->line[0];
-	stream->previous_line = &stream->line[NARC_MAX_LOGMSG_LEN + 1];
+	stream->previous_line = sdsempty();
 	init_line(stream->current_line);
-	init_line(stream->previous_line);
 
 	init_buffer(stream->buffer);
 
@@ -420,6 +759,12 @@ stop_stream(narc_stream *stream)
 		// free(stream->open_timer);
 		stream->open_timer = NULL;
 	}
+	// the tail of a record would be lost with the timer
+	flush_record(stream);
+	if (stream->multiline_timer != NULL) {
+		uv_close((uv_handle_t *)stream->multiline_timer, (uv_close_cb)free);
+		stream->multiline_timer = NULL;
+	}
 }
 
 void
@@ -428,13 +773,108 @@ free_stream(void *ptr)
 	narc_stream *stream = (narc_stream *)ptr;
 	// stop_stream(stream);
 	free_buffer(stream->buffer);
+	sdsfree(stream->previous_line);
+	sdsfree(stream->record);
+	if (stream->rfc5424_header != NULL)
+		sdsfree(stream->rfc5424_header);
+	if (stream->multiline_pattern != NULL)
+		sdsfree(stream->multiline_pattern);
+	if (stream->filter != NULL)
+		free_filter(stream->filter);
 	sdsfree(stream->id);
 	sdsfree(stream->file);
 	free(stream);
 }
 
+/* The fields of RFC 5424 messages that never change for a stream. A
+ * stream id of the form app[msgid] gives the app-name and the msgid,
+ * otherwise the whole id is the app-name. */
+void
+build_rfc5424_header(narc_stream *stream)
+{
+	char *id = stream->id, *bracket = strchr(id, '[');
+	size_t len = sdslen(stream->id);
+	const char *host = server.stream_id[0] ? server.stream_id : "-";
+
+	if (bracket != NULL && bracket > id && id[len - 1] == ']' && bracket + 1 < id + len - 1)
+		stream->rfc5424_header = sdscatprintf(sdsempty(), " %s %.*s - %.*s ",
+			host, (int)(bracket - id), id, (int)(id + len - 2 - bracket), bracket + 1);
+	else
+		stream->rfc5424_header = sdscatprintf(sdsempty(), " %s %s - - ",
+			host, len ? id : "-");
+}
+
 void
 init_stream(narc_stream *stream)
 {
+	if (server.format == NARC_FORMAT_RFC5424)
+		build_rfc5424_header(stream);
 	start_file_open(stream);
 }
+
+/* Restart the reads postponed while the bandwidth shaper was throttled
+ * or an output was full, picking up whatever was appended to the files in the meantime. */
+void
+resume_streams(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		narc_stream *stream = (narc_stream *)listNodeValue(node);
+		if (stream->throttled) {
+			stream->throttled = 0;
+			start_file_read(stream);
+		}
+	}
+	listReleaseIterator(iter);
+}
+
+/* On shutdown, so the records still being joined are sent. */
+void
+stop_streams(void)
+{
+	listIter *iter;
+	listNode *node;
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL)
+		stop_stream((narc_stream *)listNodeValue(node));
+	listReleaseIterator(iter);
+}
+
+int64_t
+stream_lag_bytes(narc_stream *stream)
+{
+	return (stream->size > stream->offset) ? stream->size - stream->offset : 0;
+}
+
+/* Anything still unread was appended after the stream last reached the
+ * end of the file, so the time since then bounds how far behind it is. */
+uint64_t
+stream_lag_seconds(narc_stream *stream)
+{
+	if (stream_lag_bytes(stream) == 0 || stream->caught_up == 0)
+		return 0;
+	return (uv_now(server.loop) - stream->caught_up) / 1000;
+}
+
+narc_stream
+*find_stream(char *id)
+{
+	listIter *iter;
+	listNode *node;
+	narc_stream *stream = NULL;
+
+	iter = listGetIterator(server.streams, AL_START_HEAD);
+	while ((node = listNext(iter)) != NULL) {
+		if (!strcmp(((narc_stream *)listNodeValue(node))->id, id)) {
+			stream = (narc_stream *)listNodeValue(node);
+			break;
+		}
+	}
+	listReleaseIterator(iter);
+
+	return stream;
+}
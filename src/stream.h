@@ -26,6 +26,8 @@
 #define NARC_STREAM 
 
 #include "narc.h"
+#include "sds.h"	/* dynamic safe strings */
+#include "filter.h"
 #include <uv.h>
 
 /* Stream locking */
@@ -33,30 +35,76 @@
 #define NARC_STREAM_UNLOCKED	2
 #define NARC_STREAM_BUFFERS	1
 
+/* Multi-line modes */
+#define NARC_MULTILINE_NONE	0
+#define NARC_MULTILINE_START	1	/* a matching line starts a new record */
+#define NARC_MULTILINE_CONTINUE	2	/* a matching line continues the record */
+
+/* Global rate limiting, in thousandths of a message */
+#define NARC_GLOBAL_RATE_TICK	100	/* millisecond refill interval */
+#define NARC_GLOBAL_RATE_UNIT	1000	/* cost of a single message */
+#define NARC_GLOBAL_RATE_IDLE	10	/* ticks before a quiet stream loses its share */
+
 /*-----------------------------------------------------------------------------
  * Data types
  *----------------------------------------------------------------------------*/
 
-typedef struct {
+typedef struct narc_stream {
 	char 	*id;					/* message id prefix */
 	char 	*file;					/* absolute path to the file */
 	int 	fd;					/* file descriptor */
 	off_t 	size;					/* last known file size in bytes */
 	uv_buf_t buffer[NARC_STREAM_BUFFERS];		/* read buffer (file content) */
-	char 	line[(NARC_MAX_LOGMSG_LEN + 1) * 2];	/* the current and previous lines buffer */
+	char 	line[NARC_MAX_LOGMSG_LEN + 1];		/* the current line buffer */
 	char	*current_line;				/* current line */
-	char	*previous_line;				/* previous line */
+	sds	previous_line;				/* previous record */
 	int	repeat_count;				/* how many times the previous line was repeated */
+	int	multiline_mode;				/* how lines are joined into records */
+	sds	multiline_pattern;			/* glob deciding record boundaries */
+	sds	record;					/* multi-line record being assembled */
+	int	record_lines;				/* lines in the current record */
+	uint64_t record_deadline;			/* loop time the record is flushed at */
+	narc_filter *filter;				/* include/exclude rules */
+	uint64_t filtered_count;			/* records dropped by the filter */
+	double	sample_rate;				/* keep 1 in sample_rate records */
+	uint64_t sample_threshold;			/* keep records hashing below this */
+	int	sample_field;				/* field to hash, 0 for the whole record */
+	uint64_t sampled_count;				/* records dropped by sampling */
 	int 	index;					/* the line character index */
 	int 	lock;					/* read lock to prevent resetting buffers */
 	int 	attempts;				/* open attempts */
 	int	rate_count;				/*  */
 	int	missed_count;				/*  */
+	int	weight;					/* share of the global rate limit */
+	int64_t	deficit;				/* unspent share of the global rate limit */
+	int	demand;					/* ticks left before the stream counts as quiet */
+	int	throttled;				/* read postponed by the bandwidth shaper */
+	uint64_t read_calls;				/* reads issued on the file */
+	uint64_t read_bytes;				/* bytes read from the file */
+	uint64_t line_count;				/* lines read from the file */
+	uint64_t sent_count;				/* messages handed to the transport */
+	uint64_t sent_bytes;				/* bytes handed to the transport */
+	uint64_t suppressed_count;			/* messages dropped by rate limiting */
+	uint64_t dropped_count;				/* messages dropped by the transport */
+	uint64_t caught_up;				/* loop time the stream last read to the end */
+	uint64_t lag_since;				/* loop time the lag went over the threshold */
+	uint64_t lag_warned;				/* loop time of the last lag warning */
+	uint64_t event_time;				/* hrtime of the change being read */
+	uint64_t read_time;				/* hrtime the last read completed */
+	unsigned char digest[20];			/* ordered digest of the lines sent */
+	uint64_t digest_count;				/* lines in the digest */
+	uint64_t sequence;				/* number of the last message sent */
+	int64_t line_offset;				/* file offset of the line being read */
+	int64_t record_offset;				/* file offset of the record being sent */
+	sds	rfc5424_header;				/* ' host app procid msgid ' of RFC 5424 messages */
+	uint64_t hash;					/* places the stream on the output groups */
+	int	number;					/* position among the streams */
 	int     message_header_size;
 	int64_t offset;
 	int		truncate;
 	uv_fs_event_t *fs_events;
 	uv_timer_t *open_timer;
+	uv_timer_t *multiline_timer;
 } narc_stream;
 
 /*-----------------------------------------------------------------------------
@@ -70,10 +118,18 @@ void	start_file_open_timer(narc_stream *stream);
 void	start_file_stat(narc_stream *stream);
 void	start_file_read(narc_stream *stream);
 void	start_rate_limit_timer(narc_stream *stream);
+void	start_multiline_timer(narc_stream *stream);
+void	start_global_rate_timer(void);
+void	start_lag_timer(void);
 
 /* api */
 narc_stream 	*new_stream(char *id, char *file);
 void		free_stream(void *ptr);
 void		init_stream(narc_stream *stream);
+narc_stream	*find_stream(char *id);
+void		resume_streams(void);
+void		stop_streams(void);
+int64_t		stream_lag_bytes(narc_stream *stream);
+uint64_t	stream_lag_seconds(narc_stream *stream);
 
 #endif
@@ -0,0 +1,306 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#include "fmacros.h"
+
+#include "narc.h"
+#include "syslog_client.h"
+
+#include "sds.h"	/* dynamic safe strings */
+
+#include <errno.h>	/* error codes */
+#include <fcntl.h>	/* file control options */
+#include <stdio.h>	/* standard buffered input/output */
+#include <stdlib.h>	/* standard library definitions */
+#include <string.h>	/* string operations */
+#include <sys/socket.h>	/* sockets */
+#include <sys/uio.h>	/* scatter/gather io */
+#include <sys/un.h>	/* unix domain sockets */
+#include <unistd.h>	/* standard symbolic constants and types */
+#include <uv.h>		/* Event driven programming library */
+
+/*============================ Utility functions ============================ */
+
+narc_syslog_client
+*new_syslog_client(narc_output *output)
+{
+	narc_syslog_client *client = (narc_syslog_client *)malloc(sizeof(narc_syslog_client));
+	memset(client, 0, sizeof(narc_syslog_client));
+	client->state  = NARC_SYSLOG_INITIALIZED;
+	client->fd     = -1;
+	client->output = output;
+	return client;
+}
+
+/* the local form of the message, when there is one */
+sds
+syslog_message_data(narc_message *message)
+{
+	return message->local ? message->local : message->data;
+}
+
+narc_message
+*syslog_queue_pop(narc_syslog_client *client)
+{
+	narc_message *message = client->queue[client->head];
+
+	client->head = (client->head + 1) % NARC_SYSLOG_QUEUE;
+	client->count--;
+	client->queued_bytes -= sdslen(syslog_message_data(message)) - 1;
+	return message;
+}
+
+/* Send up to NARC_SYSLOG_BATCH datagrams from the head of the queue,
+ * without their trailing newline. Returns how many went out. */
+int
+send_syslog_batch(narc_syslog_client *client)
+{
+	struct iovec iov[NARC_SYSLOG_BATCH];
+	int n = client->count < NARC_SYSLOG_BATCH ? client->count : NARC_SYSLOG_BATCH;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		narc_message *message = client->queue[(client->head + i) % NARC_SYSLOG_QUEUE];
+		iov[i].iov_base = syslog_message_data(message);
+		iov[i].iov_len  = sdslen(syslog_message_data(message)) - 1;
+	}
+
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[NARC_SYSLOG_BATCH];
+
+	memset(msgs, 0, sizeof(struct mmsghdr) * n);
+	for (i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	return sendmmsg(client->fd, msgs, n, MSG_DONTWAIT);
+#else
+	for (i = 0; i < n; i++)
+		if (send(client->fd, iov[i].iov_base, iov[i].iov_len, MSG_DONTWAIT) == -1)
+			return i ? i : -1;
+	return n;
+#endif
+}
+
+void
+close_syslog_socket(narc_syslog_client *client)
+{
+	if (client->poll != NULL) {
+		uv_close((uv_handle_t *)client->poll, (uv_close_cb)free);
+		client->poll = NULL;
+	}
+	if (client->fd != -1) {
+		close(client->fd);
+		client->fd = -1;
+	}
+	client->state = NARC_SYSLOG_INITIALIZED;
+}
+
+void handle_syslog_writable(uv_poll_t *poll, int status, int events);
+void handle_syslog_prepare(uv_prepare_t *prepare);
+
+/* Drain the queue. When the socket is full the rest waits for it to
+ * become writable again; when the daemon went away the socket is
+ * reconnected and the queue kept. */
+void
+flush_syslog_queue(narc_syslog_client *client)
+{
+	while (client->count > 0 && client->state == NARC_SYSLOG_CONNECTED) {
+		int sent = send_syslog_batch(client);
+
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				uv_poll_start(client->poll, UV_WRITABLE, handle_syslog_writable);
+				break;
+			}
+			if (errno == ECONNREFUSED || errno == ENOTCONN || errno == ENOENT) {
+				narc_log(NARC_WARNING, "Lost the syslog socket %s: %s",
+					client->output->path, strerror(errno));
+				client->output->reconnects++;
+				close_syslog_socket(client);
+				start_syslog_connect_timer(client);
+				break;
+			}
+			// anything else is about the message itself, so it goes
+			narc_log(NARC_WARNING, "Syslog send error: %s", strerror(errno));
+			client->output->write_errors++;
+			free_message(syslog_queue_pop(client));
+			continue;
+		}
+
+		client->output->write_calls++;
+		while (sent-- > 0) {
+			narc_message *message = syslog_queue_pop(client);
+
+			client->output->write_messages++;
+			output_wrote(client->output, sdslen(syslog_message_data(message)) - 1);
+			message_sent(message);
+			free_message(message);
+		}
+	}
+
+	uv_prepare_stop(client->prepare);
+	if (client->count == 0 && client->poll != NULL)
+		uv_poll_stop(client->poll);
+	output_drained(client->output);
+}
+
+/*=============================== Callbacks ================================= */
+
+void
+handle_syslog_writable(uv_poll_t *poll, int status, int events)
+{
+	narc_syslog_client *client = (narc_syslog_client *)poll->data;
+
+	uv_poll_stop(poll);
+	flush_syslog_queue(client);
+}
+
+void
+handle_syslog_prepare(uv_prepare_t *prepare)
+{
+	flush_syslog_queue((narc_syslog_client *)prepare->data);
+}
+
+void
+handle_syslog_connect_timeout(uv_timer_t *timer)
+{
+	start_syslog_connect((narc_syslog_client *)timer->data);
+	uv_close((uv_handle_t *)timer, (uv_close_cb)free);
+}
+
+/*=============================== Watchers ================================== */
+
+void
+start_syslog_connect(narc_syslog_client *client)
+{
+	narc_output *output = client->output;
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, output->path, sizeof(addr.sun_path) - 1);
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+		narc_log(NARC_WARNING, "Can't create a syslog socket: %s", strerror(errno));
+		exit(1);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		narc_log(NARC_WARNING, "Error connecting to %s: %s",
+			output->path, strerror(errno));
+		close(fd);
+		start_syslog_connect_timer(client);
+		return;
+	}
+
+	client->poll = (uv_poll_t *)malloc(sizeof(uv_poll_t));
+	uv_poll_init(server.loop, client->poll, fd);
+	client->poll->data = (void *)client;
+	client->fd    = fd;
+	client->state = NARC_SYSLOG_CONNECTED;
+	output->connects++;
+	narc_log(NARC_NOTICE, "Connection established: %s", output->path);
+
+	if (client->count > 0)
+		uv_prepare_start(client->prepare, handle_syslog_prepare);
+}
+
+void
+start_syslog_connect_timer(narc_syslog_client *client)
+{
+	uv_timer_t *timer = malloc(sizeof(uv_timer_t));
+	if (uv_timer_init(server.loop, timer) == 0) {
+		timer->data = (void *)client;
+		uv_timer_start(timer, handle_syslog_connect_timeout, server.connect_retry_delay, 0);
+	}
+}
+
+/*================================== API ==================================== */
+
+void
+init_syslog_client(narc_output *output)
+{
+	narc_syslog_client *client = new_syslog_client(output);
+
+	client->prepare = (uv_prepare_t *)malloc(sizeof(uv_prepare_t));
+	uv_prepare_init(server.loop, client->prepare);
+	uv_unref((uv_handle_t *)client->prepare);
+	client->prepare->data = (void *)client;
+
+	output->client = (void *)client;
+	start_syslog_connect(client);
+}
+
+void
+clean_syslog_client(narc_output *output)
+{
+	narc_syslog_client *client = (narc_syslog_client *)output->client;
+
+	// one last try, whatever the socket won't take is lost
+	flush_syslog_queue(client);
+	while (client->count > 0) {
+		output->dropped++;
+		free_message(syslog_queue_pop(client));
+	}
+
+	close_syslog_socket(client);
+	uv_close((uv_handle_t *)client->prepare, (uv_close_cb)free);
+}
+
+size_t
+syslog_client_queue_bytes(narc_output *output)
+{
+	return ((narc_syslog_client *)output->client)->queued_bytes;
+}
+
+/* Messages are queued and sent in batches once the loop has handled
+ * its events, so a burst of lines costs a few system calls. */
+int
+submit_syslog_message(narc_output *output, narc_message *message)
+{
+	narc_syslog_client *client = (narc_syslog_client *)output->client;
+	int len = sdslen(syslog_message_data(message));
+
+	if (client->count == NARC_SYSLOG_QUEUE || len < 2) {
+		output->dropped++;
+		free_message(message);
+		return NARC_ERR;
+	}
+
+	client->queue[(client->head + client->count) % NARC_SYSLOG_QUEUE] = message;
+	client->count++;
+	client->queued_bytes += len - 1;
+
+	if (client->state == NARC_SYSLOG_CONNECTED && !uv_is_active((uv_handle_t *)client->poll))
+		uv_prepare_start(client->prepare, handle_syslog_prepare);
+
+	return NARC_OK;
+}
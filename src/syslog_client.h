@@ -0,0 +1,72 @@
+// -*- mode: c; tab-width: 8; indent-tabs-mode: 1; st-rulers: [70] -*-
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2013 Pagoda Box, Inc.  All rights reserved.
+ */
+
+#ifndef NARC_SYSLOG
+#define NARC_SYSLOG 
+
+#include "narc.h"
+#include "output.h"
+#include "sds.h"	/* dynamic safe strings */
+
+#include <uv.h>		/* Event driven programming library */
+
+/* connection states */
+#define NARC_SYSLOG_INITIALIZED	0
+#define NARC_SYSLOG_CONNECTED	1
+
+#define NARC_SYSLOG_QUEUE		4096	/* messages held while the socket is full */
+#define NARC_SYSLOG_BATCH		64	/* datagrams handed to sendmmsg at once */
+
+/*-----------------------------------------------------------------------------
+ * Data types
+ *----------------------------------------------------------------------------*/
+
+typedef struct {
+	int 		state;		/* connection state */
+	int		fd;		/* unix datagram socket, -1 when closed */
+	uv_poll_t	*poll;		/* waits for the socket to drain */
+	uv_prepare_t	*prepare;	/* flushes the queue once per loop iteration */
+	narc_message	*queue[NARC_SYSLOG_QUEUE];	/* messages waiting to be sent */
+	int		head;		/* first message in the queue */
+	int		count;		/* messages in the queue */
+	size_t		queued_bytes;	/* bytes in the queue */
+	narc_output	*output;	/* output the client sends for */
+} narc_syslog_client;
+
+/*-----------------------------------------------------------------------------
+ * Functions prototypes
+ *----------------------------------------------------------------------------*/
+
+/* watchers */
+void	start_syslog_connect(narc_syslog_client *client);
+void	start_syslog_connect_timer(narc_syslog_client *client);
+
+/* api */
+void	init_syslog_client(narc_output *output);
+void	clean_syslog_client(narc_output *output);
+int 	submit_syslog_message(narc_output *output, narc_message *message);
+size_t	syslog_client_queue_bytes(narc_output *output);
+
+#endif
@@ -40,13 +40,12 @@
 void 
 free_tcp_write_req(uv_write_t *req) 
 {
-	sdsfree((char *)req->data);
-	free(req->bufs);
+	free_message((narc_message *)req->data);
 	free(req);
 }
 
 narc_tcp_client
-*new_tcp_client(void)
+*new_tcp_client(narc_output *output)
 {
 	narc_tcp_client *client = (narc_tcp_client *)malloc(sizeof(narc_tcp_client));
 
@@ -54,6 +53,16 @@ narc_tcp_client
 	client->socket   = NULL;
 	client->stream   = NULL;
 	client->attempts = 0;
+	client->address  = 0;
+	client->tried    = 0;
+	client->output   = output;
+
+	client->compressor  = NULL;
+	client->prepare     = NULL;
+	client->batch       = NULL;
+	client->compressing = NULL;
+	client->generation  = 0;
+	client->compressed_generation = 0;
 
 	return client;
 }
@@ -64,36 +73,213 @@ tcp_client_established(narc_tcp_client *client)
 	return (client->state == NARC_TCP_ESTABLISHED);
 }
 
+/* A failed connect moves on to the next address right away. Once all of
+ * them failed the attempt waits for the retry delay, or gives up after
+ * max-connect-attempts. */
+void
+retry_tcp_connect(narc_tcp_client *client)
+{
+	narc_output *output = client->output;
+
+	client->address++;
+	if (client->tried < output->resolver->count) {
+		start_tcp_connect(client);
+		return;
+	}
+	client->tried = 0;
+
+	// a group member stays down and the group works around it
+	if (client->attempts >= server.max_connect_attempts
+		&& (output->group == NULL || output->group->pool)) {
+		narc_log(NARC_WARNING, "Reached max connect attempts: %s:%d", 
+			output->host, 
+			output->port);
+		logger_flush(&server.logger);
+		exit(1);
+	}
+	start_tcp_connect_timer(client);
+}
+
+void handle_tcp_batch_write(uv_write_t *req, int status);
+void handle_tcp_compress_work(uv_work_t *work);
+void handle_tcp_compress_done(uv_work_t *work, int status);
+void handle_tcp_prepare(uv_prepare_t *prepare);
+
+narc_tcp_batch
+*new_tcp_batch(narc_tcp_client *client)
+{
+	narc_tcp_batch *batch = (narc_tcp_batch *)malloc(sizeof(narc_tcp_batch));
+
+	batch->work.data  = (void *)batch;
+	batch->req.data   = (void *)batch;
+	batch->client     = client;
+	batch->generation = 0;
+	batch->plain      = sdsempty();
+	batch->compressed = NULL;
+	batch->offloaded  = 0;
+	batch->cpu_ns     = 0;
+	batch->count      = 0;
+	batch->size       = 64;
+	batch->messages   = (narc_message **)malloc(sizeof(narc_message *) * batch->size);
+
+	return batch;
+}
+
+void
+free_tcp_batch(narc_tcp_batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->count; i++)
+		free_message(batch->messages[i]);
+	free(batch->messages);
+	sdsfree(batch->plain);
+	sdsfree(batch->compressed);
+	free(batch);
+}
+
+/* The socket goes, the next connection starts over with a new frame. */
+void
+drop_tcp_connection(narc_tcp_client *client)
+{
+	uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
+	client->socket = NULL;
+	client->state = NARC_TCP_INITIALIZED;
+	client->output->reconnects++;
+
+	start_tcp_connect_timer(client);
+	// whatever was queued is gone with the socket
+	output_drained(client->output);
+}
+
+void
+drop_tcp_batch(narc_tcp_batch *batch)
+{
+	batch->client->output->dropped += batch->count;
+	free_tcp_batch(batch);
+}
+
+/* Runs on the loop or on the thread pool, never both at once: a batch
+ * is only compressed once the previous one is done. */
+void
+compress_tcp_batch(narc_tcp_batch *batch)
+{
+	narc_tcp_client *client = batch->client;
+	uint64_t start = thread_cpu_ns();
+
+	if (client->compressed_generation != batch->generation) {
+		reset_compressor(client->compressor);
+		client->compressed_generation = batch->generation;
+	}
+	batch->compressed = compress_batch(client->compressor, sdsempty(),
+		batch->plain, sdslen(batch->plain));
+	batch->cpu_ns = thread_cpu_ns() - start;
+}
+
+void
+write_tcp_batch(narc_tcp_batch *batch)
+{
+	narc_tcp_client *client = batch->client;
+	narc_output *output = client->output;
+	uv_buf_t buf;
+
+	output->compress_batches++;
+	output->compress_offloaded += batch->offloaded;
+	output->compress_in_bytes  += sdslen(batch->plain);
+	output->compress_cpu_ns    += batch->cpu_ns;
+
+	// the connection it was compressed for is gone
+	if (!tcp_client_established(client) || client->generation != batch->generation) {
+		drop_tcp_batch(batch);
+		return;
+	}
+
+	// the receiver can not make sense of anything after a broken frame
+	if (batch->compressed == NULL) {
+		narc_log(NARC_WARNING, "Dropping %d messages to %s:%d, re-connecting with a new frame",
+			batch->count,
+			output->host,
+			output->port);
+		output->write_errors++;
+		drop_tcp_batch(batch);
+		reset_compressor(client->compressor);
+		drop_tcp_connection(client);
+		return;
+	}
+	output->compress_out_bytes += sdslen(batch->compressed);
+
+	buf = uv_buf_init(batch->compressed, sdslen(batch->compressed));
+	if (uv_write(&batch->req, client->stream, &buf, 1, handle_tcp_batch_write) != 0) {
+		output->write_errors++;
+		drop_tcp_batch(batch);
+		return;
+	}
+	output->write_calls++;
+	output_wrote(output, buf.len);
+}
+
+/* Small batches are compressed right away, large ones on the thread
+ * pool so the loop keeps reading meanwhile. */
+void
+flush_tcp_batch(narc_tcp_client *client)
+{
+	narc_tcp_batch *batch = client->batch;
+
+	uv_prepare_stop(client->prepare);
+	if (batch == NULL || client->compressing != NULL)
+		return;
+	client->batch = NULL;
+
+	if (!tcp_client_established(client)) {
+		drop_tcp_batch(batch);
+		output_drained(client->output);
+		return;
+	}
+	batch->generation = client->generation;
+
+	if (sdslen(batch->plain) >= NARC_TCP_OFFLOAD_BATCH) {
+		batch->offloaded = 1;
+		client->compressing = batch;
+		uv_queue_work(server.loop, &batch->work, handle_tcp_compress_work, handle_tcp_compress_done);
+	} else {
+		compress_tcp_batch(batch);
+		write_tcp_batch(batch);
+	}
+}
+
 /*=============================== Callbacks ================================= */
 
 void 
 handle_tcp_connect(uv_connect_t* connection, int status)
 {
-	narc_tcp_client *client = server.client;
-
-	if (status == -1) {
-		uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
-		client->socket = NULL;
-		narc_log(NARC_WARNING, "Error connecting to %s:%d (%d/%d)", 
-			server.host, 
-			server.port,
+	narc_tcp_client *client = (narc_tcp_client *)connection->handle->data;
+	narc_output *output = client->output;
+	char name[NARC_ADDRESS_NAME_LEN];
+
+	format_address(resolver_address(output->resolver, client->address), name, sizeof(name));
+
+	if (status < 0) {
+		narc_log(NARC_WARNING, "Error connecting to %s:%d at %s: %s (%d/%d)", 
+			output->host, 
+			output->port,
+			name,
+			uv_strerror(status),
 			client->attempts,
 			server.max_connect_attempts);
-
-		if (client->attempts == server.max_connect_attempts) {
-			narc_log(NARC_WARNING, "Reached max connect attempts: %s:%d", 
-				server.host, 
-				server.port);
-			exit(1);
-		} else
-			start_tcp_connect_timer();
+		uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
+		client->socket = NULL;
+		output->reconnects++;
+		retry_tcp_connect(client);
 
 	} else {
-		narc_log(NARC_NOTICE, "Connection established: %s:%d", server.host, server.port);
+		narc_log(NARC_NOTICE, "Connection established: %s:%d at %s", output->host, output->port, name);
 
 		client->stream   = (uv_stream_t *)connection->handle;
 		client->state    = NARC_TCP_ESTABLISHED;
 		client->attempts = 0;
+		client->tried    = 0;
+		client->generation++;
+		output->connects++;
 
 		start_tcp_read(client->stream);
 	}
@@ -103,7 +289,61 @@ handle_tcp_connect(uv_connect_t* connection, int status)
 void
 handle_tcp_write(uv_write_t* req, int status)
 {
+	narc_tcp_client *client = (narc_tcp_client *)req->handle->data;
+
+	if (status != 0)
+		client->output->write_errors++;
+	else
+		message_sent((narc_message *)req->data);
 	free_tcp_write_req(req);
+	output_drained(client->output);
+}
+
+void
+handle_tcp_batch_write(uv_write_t *req, int status)
+{
+	narc_tcp_batch *batch = (narc_tcp_batch *)req->data;
+	narc_output *output = batch->client->output;
+	int i;
+
+	if (status != 0)
+		output->write_errors++;
+	else {
+		for (i = 0; i < batch->count; i++)
+			message_sent(batch->messages[i]);
+	}
+	free_tcp_batch(batch);
+	output_drained(output);
+}
+
+void
+handle_tcp_compress_work(uv_work_t *work)
+{
+	compress_tcp_batch((narc_tcp_batch *)work->data);
+}
+
+void
+handle_tcp_compress_done(uv_work_t *work, int status)
+{
+	narc_tcp_batch *batch = (narc_tcp_batch *)work->data;
+	narc_tcp_client *client = batch->client;
+
+	client->compressing = NULL;
+	write_tcp_batch(batch);
+
+	if (client->prepare == NULL) {
+		// cleaned meanwhile
+		free_compressor(client->compressor);
+		client->compressor = NULL;
+	} else if (client->batch != NULL)
+		// what came in meanwhile
+		uv_prepare_start(client->prepare, handle_tcp_prepare);
+}
+
+void
+handle_tcp_prepare(uv_prepare_t *prepare)
+{
+	flush_tcp_batch((narc_tcp_client *)prepare->data);
 }
 
 void
@@ -119,8 +359,6 @@ handle_tcp_read_alloc_buffer(uv_handle_t *handle, size_t len,  struct uv_buf_t *
 // 	return uv_buf_init(malloc(size), size);
 // }
 
-void start_tcp_resolve(void);
-
 void
 handle_tcp_read(uv_stream_t* tcp, ssize_t nread, const struct uv_buf_t *buf)
 {
@@ -128,16 +366,12 @@ handle_tcp_read(uv_stream_t* tcp, ssize_t nread, const struct uv_buf_t *buf)
 		narc_log(NARC_WARNING, "server responded unexpectedly: %s", buf->base);
 
 	else {
-		narc_log(NARC_WARNING, "Connection dropped: %s:%d, attempting to re-connect", 
-			server.host,
-			server.port);
-		
-		narc_tcp_client *client = (narc_tcp_client *)server.client;
-		uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
-		client->socket = NULL;
-		client->state = NARC_TCP_INITIALIZED;
+		narc_tcp_client *client = (narc_tcp_client *)tcp->data;
 
-		start_tcp_connect_timer();
+		narc_log(NARC_WARNING, "Connection dropped: %s:%d, attempting to re-connect", 
+			client->output->host,
+			client->output->port);
+		drop_tcp_connection(client);
 	}
 	if (buf->base)
 		free(buf->base);
@@ -146,54 +380,60 @@ handle_tcp_read(uv_stream_t* tcp, ssize_t nread, const struct uv_buf_t *buf)
 void
 handle_tcp_connect_timeout(uv_timer_t* timer)
 {
-	start_tcp_resolve();
+	start_tcp_connect((narc_tcp_client *)timer->data);
 	uv_close((uv_handle_t *)timer, (uv_close_cb)free);
 }
 
 void
-handle_tcp_resolved(uv_getaddrinfo_t *resolver, int status, struct addrinfo *res)
+handle_tcp_resolved(void *data)
 {
-	if (status >= 0){
-		narc_log(NARC_WARNING, "server resolved: %s", server.host);
-		start_tcp_connect(res);
-	}else{
-		narc_log(NARC_WARNING, "server did not resolve: %s", server.host);
-	}
+	start_tcp_connect((narc_tcp_client *)data);
 }
 
 /*=============================== Watchers ================================== */
 
+/* Connects to the cached address of the host, never waiting on dns
+ * unless its first lookup has yet to succeed. */
 void
-start_tcp_resolve(void)
+start_tcp_connect(narc_tcp_client *client)
 {
-	struct addrinfo hints;
-	hints.ai_family = PF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_flags = 0;
-	narc_log(NARC_WARNING, "server resolving: %s", server.host);
-	narc_tcp_client *client = (narc_tcp_client *)server.client;
-	uv_getaddrinfo(server.loop, &client->resolver, handle_tcp_resolved, server.host, "80", &hints);
-}
-
-void
-start_tcp_connect(struct addrinfo *res)
-{
-	narc_tcp_client *client = (narc_tcp_client *)server.client;
-	uv_tcp_t 	*socket = (uv_tcp_t *)malloc(sizeof(uv_tcp_t));
+	narc_output	*output = client->output;
+	struct sockaddr	*dest = resolver_address(output->resolver, client->address);
+	char		name[NARC_ADDRESS_NAME_LEN];
+	uv_tcp_t 	*socket;
+	uv_connect_t	*connect;
+	int		err;
+
+	if (dest == NULL) {
+		resolver_wait(output->resolver, handle_tcp_resolved, (void *)client);
+		return;
+	}
 
+	socket = (uv_tcp_t *)malloc(sizeof(uv_tcp_t));
 	uv_tcp_init(server.loop, socket);
 	uv_tcp_keepalive(socket, 1, 60);
+	socket->data = (void *)client;
 
-	struct sockaddr_in dest;
-	uv_ip4_addr(res->ai_addr->sa_data, server.port, &dest);
+	// every address of the host counts as one attempt
+	if (client->tried++ == 0)
+		client->attempts += 1;
 
-	uv_connect_t *connect = malloc(sizeof(uv_connect_t));
-	if(uv_tcp_connect(connect, socket, (struct sockaddr *)&dest, handle_tcp_connect) == 0) {
+	connect = malloc(sizeof(uv_connect_t));
+	if ((err = uv_tcp_connect(connect, socket, dest, handle_tcp_connect)) == 0) {
 		client->socket = socket;
-		client->attempts += 1;
+		return;
 	}
-	uv_freeaddrinfo(res);
+
+	// e.g. an ipv6 address while the host has no ipv6 route
+	narc_log(NARC_WARNING, "Error connecting to %s:%d at %s: %s", 
+		output->host, 
+		output->port,
+		format_address(dest, name, sizeof(name)),
+		uv_strerror(err));
+	free(connect);
+	uv_close((uv_handle_t *)socket, (uv_close_cb)free);
+	output->reconnects++;
+	retry_tcp_connect(client);
 }
 
 void
@@ -203,49 +443,142 @@ start_tcp_read(uv_stream_t *stream)
 }
 
 void
-start_tcp_connect_timer(void)
+start_tcp_connect_timer(narc_tcp_client *client)
 {
 	uv_timer_t *timer = malloc(sizeof(uv_timer_t));
-	if (uv_timer_init(server.loop, timer) == 0)
+	if (uv_timer_init(server.loop, timer) == 0) {
+		timer->data = (void *)client;
 		uv_timer_start(timer, handle_tcp_connect_timeout, server.connect_retry_delay, 0);
+	}
 }
 
 /*================================== API ==================================== */
 
 void
-init_tcp_client(void)
+init_tcp_client(narc_output *output)
 {
-	server.client = (void *)new_tcp_client();
+	narc_tcp_client *client = new_tcp_client(output);
+
+	if (output->compression != NARC_COMPRESSION_NONE) {
+		client->compressor = new_compressor(output->compression, output->compression_level);
+		if (output->dictionary != NULL)
+			compressor_use_dictionary(client->compressor, output->dictionary, sdslen(output->dictionary));
+		client->prepare = (uv_prepare_t *)malloc(sizeof(uv_prepare_t));
+		uv_prepare_init(server.loop, client->prepare);
+		uv_unref((uv_handle_t *)client->prepare);
+		client->prepare->data = (void *)client;
+	}
 
-	start_tcp_resolve();
+	output->client = (void *)client;
+	output->resolver = get_resolver(output->host, output->port);
+	start_tcp_connect(client);
 }
 
 void
-clean_tcp_client(void)
+clean_tcp_client(narc_output *output)
 {
-	narc_tcp_client *client = (narc_tcp_client *)server.client;
+	narc_tcp_client *client = (narc_tcp_client *)output->client;
+
+	if (client->prepare != NULL) {
+		if (client->batch != NULL) {
+			drop_tcp_batch(client->batch);
+			client->batch = NULL;
+		}
+		uv_close((uv_handle_t *)client->prepare, (uv_close_cb)free);
+		client->prepare = NULL;
+		// a batch on the thread pool still needs the compressor
+		if (client->compressing == NULL) {
+			free_compressor(client->compressor);
+			client->compressor = NULL;
+		}
+	}
 	if (client->socket != NULL) {
 		uv_close((uv_handle_t *)client->socket, (uv_close_cb)free);
 		client->socket = NULL;
 	}
-	// server.client = NULL;
-	// free(client);
+	client->state = NARC_TCP_INITIALIZED;
 }
 
-void
-submit_tcp_message(char *message)
+size_t
+tcp_client_queue_bytes(narc_output *output)
+{
+	narc_tcp_client *client = (narc_tcp_client *)output->client;
+	size_t queued = tcp_client_established(client) ? client->stream->write_queue_size : 0;
+
+	// compressed batches count what they hold before compression
+	if (client->batch != NULL)
+		queued += sdslen(client->batch->plain);
+	if (client->compressing != NULL)
+		queued += sdslen(client->compressing->plain);
+	return queued;
+}
+
+/* With compression messages are gathered and written as one chunk,
+ * compressed once the loop has handled its events. */
+int
+batch_tcp_message(narc_tcp_client *client, narc_message *message, uv_buf_t *bufs, int nbufs)
+{
+	narc_tcp_batch *batch;
+	int i;
+
+	if (client->batch == NULL)
+		client->batch = new_tcp_batch(client);
+	batch = client->batch;
+
+	if (batch->count == batch->size) {
+		batch->size *= 2;
+		batch->messages = (narc_message **)realloc(batch->messages, sizeof(narc_message *) * batch->size);
+	}
+	batch->messages[batch->count++] = message;
+	for (i = 0; i < nbufs; i++)
+		batch->plain = sdscatlen(batch->plain, bufs[i].base, bufs[i].len);
+	client->output->write_messages++;
+
+	if (client->compressing == NULL)
+		uv_prepare_start(client->prepare, handle_tcp_prepare);
+	return NARC_OK;
+}
+
+int
+submit_tcp_message(narc_output *output, narc_message *message)
 {
-	narc_tcp_client *client = (narc_tcp_client *)server.client;
+	narc_tcp_client *client = (narc_tcp_client *)output->client;
 
 	if ( ! tcp_client_established(client) ) {
-		sdsfree(message);
-		return;
+		output->dropped++;
+		free_message(message);
+		return NARC_ERR;
 	}
 
-	uv_write_t *req = (uv_write_t *)malloc(sizeof(uv_write_t));
-	uv_buf_t buf    = uv_buf_init(message, strlen(message));
+	uv_write_t *req;
+	size_t len      = sdslen(message->data);
+	uv_buf_t bufs[2];
+	int nbufs       = 1;
+
+	if (output->framing == NARC_FRAMING_OCTET) {
+		// the length goes in front and replaces the trailing newline
+		len--;
+		bufs[0] = uv_buf_init(message->frame, snprintf(message->frame, sizeof(message->frame), "%zu ", len));
+		bufs[1] = uv_buf_init(message->data, len);
+		nbufs = 2;
+	} else
+		bufs[0] = uv_buf_init(message->data, len);
+
+	if (client->compressor != NULL)
+		return batch_tcp_message(client, message, bufs, nbufs);
+
+	req = (uv_write_t *)malloc(sizeof(uv_write_t));
+	if (uv_write(req, client->stream, bufs, nbufs, handle_tcp_write) != 0) {
+		output->write_errors++;
+		free_message(message);
+		free(req);
+		return NARC_ERR;
+	}
 
-	if (uv_write(req, client->stream, &buf, 1, handle_tcp_write) == 0)
-		req->data = (void *)message;
+	req->data = (void *)message;
+	output->write_calls++;
+	output->write_messages++;
+	output_wrote(output, len + (nbufs == 2 ? bufs[0].len : 0));
 
+	return NARC_OK;
 }
@@ -27,6 +27,9 @@
 #define NARC_TCP 
 
 #include "narc.h"
+#include "output.h"
+#include "compress.h"
+#include "resolver.h"
 #include "sds.h"	/* dynamic safe strings */
 
 #include <uv.h>		/* Event driven programming library */
@@ -35,16 +38,45 @@
 #define NARC_TCP_INITIALIZED	0
 #define NARC_TCP_ESTABLISHED	1
 
+#define NARC_TCP_OFFLOAD_BATCH	(64*1024)	/* batches compressed on the thread pool */
+
 /*-----------------------------------------------------------------------------
  * Data types
  *----------------------------------------------------------------------------*/
 
+struct narc_tcp_client;
+
+/* messages written as one compressed chunk */
 typedef struct {
+	uv_work_t	work;		/* compression on the thread pool */
+	uv_write_t	req;
+	struct narc_tcp_client	*client;
+	int		generation;	/* connection the batch was compressed for */
+	sds		plain;		/* the framed messages */
+	sds		compressed;
+	int		offloaded;	/* compressed on the thread pool */
+	uint64_t	cpu_ns;		/* cpu time spent compressing */
+	int		count;		/* messages in the batch */
+	int		size;		/* room in messages */
+	narc_message	**messages;
+} narc_tcp_batch;
+
+typedef struct narc_tcp_client {
 	int 		state;		/* connection state */
 	uv_tcp_t 	*socket;	/* tcp socket */
 	uv_stream_t	*stream;	/* connection stream */
 	int 		attempts;	/* connection attempts */
-	uv_getaddrinfo_t resolver;
+	int		address;	/* index of the address tried */
+	int		tried;		/* addresses tried in this attempt */
+	narc_output	*output;	/* output the client sends for */
+
+	/* compression */
+	narc_compressor	*compressor;	/* NULL unless the output compresses */
+	uv_prepare_t	*prepare;	/* compresses the batch once per loop iteration */
+	narc_tcp_batch	*batch;		/* messages waiting to be compressed */
+	narc_tcp_batch	*compressing;	/* batch on the thread pool */
+	int		generation;	/* connections established */
+	int		compressed_generation;	/* connection the compressor's frame is for */
 } narc_tcp_client;
 
 /*-----------------------------------------------------------------------------
@@ -52,14 +84,14 @@ typedef struct {
  *----------------------------------------------------------------------------*/
 
 /* watchers */
-void	start_resolve(void);
-void	start_tcp_connect(struct addrinfo *res);
+void	start_tcp_connect(narc_tcp_client *client);
 void	start_tcp_read(uv_stream_t *stream);
+void	start_tcp_connect_timer(narc_tcp_client *client);
 
 /* api */
-void	init_tcp_client(void);
-void	clean_tcp_client(void);
-void 	submit_tcp_message(char *message);
-void	start_tcp_connect_timer(void);
+void	init_tcp_client(narc_output *output);
+void	clean_tcp_client(narc_output *output);
+int 	submit_tcp_message(narc_output *output, narc_message *message);
+size_t	tcp_client_queue_bytes(narc_output *output);
 
 #endif
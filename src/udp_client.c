@@ -38,10 +38,12 @@
 /*============================ Utility functions ============================ */
 
 narc_udp_client
-*new_udp_client(void)
+*new_udp_client(narc_output *output)
 {
 	narc_udp_client *client = (narc_udp_client *)malloc(sizeof(narc_udp_client));
 	memset(client, 0, sizeof(narc_udp_client));
+	client->output = output;
+	client->socket.data = (void *)client;
 	return client;
 }
 
@@ -73,121 +75,330 @@ handle_udp_read(uv_udp_t *req, ssize_t nread, const uv_buf_t *buf, const struct
 }
 
 void
-handle_udp_send(uv_udp_send_t* req, int status)
+handle_udp_packet_send(uv_udp_send_t* req, int status)
 {
+	narc_udp_packet *packet = (narc_udp_packet *)req;
+	narc_output *output = ((narc_udp_client *)req->handle->data)->output;
+	int i;
+
 	if (status != 0){
 		narc_log(NARC_WARNING, "Udp send error: %s", 
 			uv_err_name(status));
+		output->write_errors++;
 	}
-	uv_buf_t *buf = (uv_buf_t *)req->data;
-	// narc_log(NARC_WARNING, "message again: %s", buf->base);
-	sdsfree(buf->base);
-	free(buf);
-	free(req);
+	for (i = 0; i < packet->count; i++) {
+		if (status == 0)
+			message_sent(packet->messages[i]);
+		free_message(packet->messages[i]);
+	}
+	sdsfree(packet->compressed);
+	free(packet);
+	output_drained(output);
 }
 
+void start_udp_bind(narc_udp_client *client);
+
 void
-start_udp_read()
+handle_udp_rebind(uv_handle_t *handle)
 {
-	narc_udp_client *client = (narc_udp_client *)server.client;
-	uv_udp_recv_start(&client->socket, handle_udp_read_alloc_buffer, handle_udp_read);
+	narc_udp_client *client = (narc_udp_client *)handle->data;
+
+	if (client->state != NARC_UDP_CLOSED)
+		start_udp_bind(client);
+}
+
+/* The preferred address of the host in the family of the socket. When
+ * the last lookup left none of that family, the socket is bound again
+ * in the other one, and nothing is sent meanwhile. */
+struct sockaddr *
+udp_send_addr(narc_udp_client *client)
+{
+	narc_output *output = client->output;
+	int index;
+
+	if (client->state != NARC_UDP_BOUND)
+		return NULL;
+
+	index = resolver_find(output->resolver, client->family);
+	if (index >= 0)
+		return resolver_address(output->resolver, index);
+
+	narc_log(NARC_WARNING, "%s:%d has no %s address anymore, binding a new socket",
+		output->host,
+		output->port,
+		client->family == AF_INET6 ? "ipv6" : "ipv4");
+	client->state = NARC_UDP_INITIALIZED;
+	uv_close((uv_handle_t *)&client->socket, handle_udp_rebind);
+	return NULL;
 }
 
-void start_udp_bind(struct addrinfo *res);
+narc_udp_packet
+*new_udp_packet(narc_udp_client *client)
+{
+	narc_udp_packet *packet = malloc(sizeof(narc_udp_packet) + sizeof(narc_message *) * client->packet_size);
+	packet->count = 0;
+	packet->len = 0;
+	packet->compressed = NULL;
+	return packet;
+}
+
+/* The datagram becomes a single zstd frame, starting from the
+ * dictionary when there is one. Every frame starts over, so a failed
+ * one only costs its own datagram. */
+int
+compress_udp_packet(narc_udp_client *client, narc_udp_packet *packet, uv_buf_t *bufs)
+{
+	narc_output *output = client->output;
+	uint64_t start = thread_cpu_ns();
+	sds plain = sdsempty();
+	int i;
 
+	for (i = 0; i < packet->count; i++)
+		plain = sdscatlen(plain, bufs[i].base, bufs[i].len);
+	packet->compressed = compress_frame(client->compressor, sdsempty(), plain, sdslen(plain));
+
+	output->compress_batches++;
+	output->compress_in_bytes  += sdslen(plain);
+	output->compress_cpu_ns    += thread_cpu_ns() - start;
+	sdsfree(plain);
+
+	if (packet->compressed == NULL)
+		return NARC_ERR;
+	output->compress_out_bytes += sdslen(packet->compressed);
+	packet->len = sdslen(packet->compressed);
+	return NARC_OK;
+}
+
+/* Send the packet being filled: its messages stay newline separated,
+ * only the last one loses its newline. */
 void
-handle_udp_resolved(uv_getaddrinfo_t *resolver, int status, struct addrinfo *res)
+flush_udp_packet(narc_udp_client *client)
 {
-	if (status >= 0){
-		start_udp_bind(res);
-	}else{
-		narc_log(NARC_WARNING, "server did not resolve: %s", server.host);
+	narc_udp_packet *packet = client->packet;
+	struct sockaddr *dest;
+	uv_buf_t *bufs;
+	int i, nbufs;
+
+	if (client->linger_timer != NULL)
+		uv_timer_stop(client->linger_timer);
+	if (packet == NULL || packet->count == 0)
+		return;
+	client->packet = NULL;
+
+	bufs = malloc(sizeof(uv_buf_t) * packet->count);
+	for (i = 0; i < packet->count; i++)
+		bufs[i] = uv_buf_init(packet->messages[i]->data, sdslen(packet->messages[i]->data));
+	bufs[packet->count - 1].len--;
+	packet->len--;
+	nbufs = packet->count;
+
+	// a datagram that failed to compress is dropped
+	dest = NULL;
+	if (client->compressor == NULL)
+		dest = udp_send_addr(client);
+	else if (compress_udp_packet(client, packet, bufs) == NARC_OK) {
+		bufs[0] = uv_buf_init(packet->compressed, sdslen(packet->compressed));
+		nbufs = 1;
+		dest = udp_send_addr(client);
 	}
+
+	if (dest == NULL || uv_udp_send(&packet->req, &client->socket, bufs, nbufs, dest, handle_udp_packet_send) != 0) {
+		client->output->write_errors++;
+		for (i = 0; i < packet->count; i++)
+			free_message(packet->messages[i]);
+		sdsfree(packet->compressed);
+		free(packet);
+	} else {
+		client->output->write_calls++;
+		client->output->write_messages += packet->count;
+		output_wrote(client->output, packet->len);
+	}
+	free(bufs);
 }
 
-/*=============================== Watchers ================================== */
+void
+handle_udp_linger_timeout(uv_timer_t *timer)
+{
+	flush_udp_packet((narc_udp_client *)timer->data);
+}
 
 void
-start_udp_resolve(void)
+handle_udp_send(uv_udp_send_t* req, int status)
 {
-	struct addrinfo hints;
-	hints.ai_family = PF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_flags = 0;
-	narc_log(NARC_WARNING, "server resolving: %s", server.host);
-	narc_udp_client *client = (narc_udp_client *)server.client;
+	narc_output *output = ((narc_udp_client *)req->handle->data)->output;
+
+	if (status != 0){
+		narc_log(NARC_WARNING, "Udp send error: %s", 
+			uv_err_name(status));
+		output->write_errors++;
+	} else
+		message_sent((narc_message *)req->data);
+	free_message((narc_message *)req->data);
+	free(req);
+	output_drained(output);
+}
 
-	uv_getaddrinfo(server.loop, &client->resolver, handle_udp_resolved, server.host, "80", &hints);
+void
+start_udp_read(narc_udp_client *client)
+{
+	uv_udp_recv_start(&client->socket, handle_udp_read_alloc_buffer, handle_udp_read);
 }
 
 void
-start_udp_bind(struct addrinfo *res)
+handle_udp_resolved(void *data)
 {
+	start_udp_bind((narc_udp_client *)data);
+}
 
-	narc_udp_client *client = (narc_udp_client *)server.client;
+/*=============================== Watchers ================================== */
 
-	memcpy(&client->send_addr,res->ai_addr,sizeof(res->ai_addr)),
-	client->send_addr.sin_port = htons(server.port);
-	narc_log(NARC_WARNING, "server resolved: '%s' to %s:%d", server.host, inet_ntoa(client->send_addr.sin_addr),ntohs(client->send_addr.sin_port));
+/* Binds a socket of the family of the preferred address, once the host
+ * has one. Each datagram goes to the address the last lookup returned. */
+void
+start_udp_bind(narc_udp_client *client)
+{
+	struct sockaddr *dest = resolver_address(client->output->resolver, 0);
+	struct sockaddr_storage recv_addr;
+	char name[NARC_ADDRESS_NAME_LEN];
+
+	if (dest == NULL) {
+		resolver_wait(client->output->resolver, handle_udp_resolved, (void *)client);
+		return;
+	}
+	narc_log(NARC_NOTICE, "Sending to %s:%d at %s",
+		client->output->host,
+		client->output->port,
+		format_address(dest, name, sizeof(name)));
 
 	uv_udp_init(server.loop, &client->socket);
 
-	struct sockaddr_in recv_addr;
-	uv_ip4_addr("0.0.0.0", 0, &recv_addr);
+	client->family = dest->sa_family;
+	if (client->family == AF_INET6)
+		uv_ip6_addr("::", 0, (struct sockaddr_in6 *)&recv_addr);
+	else
+		uv_ip4_addr("0.0.0.0", 0, (struct sockaddr_in *)&recv_addr);
 	uv_udp_bind(&client->socket, (struct sockaddr *)&recv_addr, 0);
 
 	client->state = NARC_UDP_BOUND;
-	start_udp_read();
-
-	uv_freeaddrinfo(res);
+	start_udp_read(client);
 }
 
 /*================================== API ==================================== */
 
 void
-init_udp_client(void)
+init_udp_client(narc_output *output)
 {
-	narc_udp_client *client = new_udp_client();
+	narc_udp_client *client = new_udp_client(output);
 	client->state = NARC_UDP_INITIALIZED;
 
-	server.client = (void *)client;
-	start_udp_resolve();
+	if (output->packing > 0) {
+		// the shortest message takes well over 16 bytes
+		client->packet_size = output->packing / 16 + 1;
+		client->linger_timer = malloc(sizeof(uv_timer_t));
+		uv_timer_init(server.loop, client->linger_timer);
+		client->linger_timer->data = (void *)client;
+	}
+
+	if (output->compression != NARC_COMPRESSION_NONE) {
+		client->compressor = new_compressor(output->compression, output->compression_level);
+		if (output->dictionary != NULL)
+			compressor_use_dictionary(client->compressor, output->dictionary, sdslen(output->dictionary));
+		// without packing every message is a packet of its own
+		if (output->packing == 0)
+			client->packet_size = 1;
+	}
+
+	output->client = (void *)client;
+	output->resolver = get_resolver(output->host, output->port);
+	start_udp_bind(client);
 }
 
 void
-clean_udp_client(void)
+clean_udp_client(narc_output *output)
 {
-	narc_udp_client *client = (narc_udp_client *)server.client;
+	narc_udp_client *client = (narc_udp_client *)output->client;
+	if (client->state != NARC_UDP_BOUND) {
+		// a socket being bound again stays closed
+		client->state = NARC_UDP_CLOSED;
+		return;
+	}
+	if (output->packing > 0)
+		flush_udp_packet(client);
+	client->state = NARC_UDP_CLOSED;
 	// uv_udp_recv_stop((uv_udp_t *)&client->socket);
 	uv_close((uv_handle_t *)&client->socket, NULL);
-	// server.client = NULL;
 }
 
-void
-submit_udp_message(char *message)
+size_t
+udp_client_queue_bytes(narc_output *output)
 {
-	if (server.client == NULL) {
-		sdsfree(message);
-		return;
+	narc_udp_client *client = (narc_udp_client *)output->client;
+	size_t queued = (client->state == NARC_UDP_BOUND) ? client->socket.send_queue_size : 0;
+
+	return queued + (client->packet ? client->packet->len : 0);
+}
+
+/* Add the message to the packet being filled, sending the packet first
+ * when the message would not fit. The linger timer starts with the
+ * first message of a packet. */
+int
+pack_udp_message(narc_udp_client *client, narc_message *message)
+{
+	size_t len = sdslen(message->data);
+	narc_udp_packet *packet = client->packet;
+
+	if (packet != NULL && (packet->len + len - 1 > client->output->packing || packet->count == client->packet_size))
+		flush_udp_packet(client);
+
+	if (client->packet == NULL) {
+		client->packet = new_udp_packet(client);
+		uv_timer_start(client->linger_timer, handle_udp_linger_timeout, client->output->linger, 0);
 	}
-	narc_udp_client *client = (narc_udp_client *)server.client;
-	int len = strlen(message);
+	packet = client->packet;
+	packet->messages[packet->count++] = message;
+	packet->len += len;
+
+	// a message as large as the payload goes out alone
+	if (packet->len - 1 >= client->output->packing)
+		flush_udp_packet(client);
+	return NARC_OK;
+}
+
+int
+submit_udp_message(narc_output *output, narc_message *message)
+{
+	narc_udp_client *client = (narc_udp_client *)output->client;
+	int len = sdslen(message->data);
 	if (client->state == NARC_UDP_BOUND && len > 2) {
+		if (output->packing > 0)
+			return pack_udp_message(client, message);
+		if (client->compressor != NULL) {
+			client->packet = new_udp_packet(client);
+			client->packet->messages[client->packet->count++] = message;
+			client->packet->len = len;
+			flush_udp_packet(client);
+			return NARC_OK;
+		}
 
 		// we make the packet one character less so that we aren't sending the newline character
-		message[strlen(message)-1] = '\0';
-		// narc_log(NARC_WARNING, "sockaddr: %d %d %d %p", client->send_addr.sin_family, client->send_addr.sin_port, client->send_addr.sin_addr.s_addr, &client->send_addr);
 		uv_udp_send_t *req = (uv_udp_send_t *)malloc(sizeof(uv_udp_send_t));
-		memset(req, 0, sizeof(uv_udp_send_t));
-		uv_buf_t *buf = malloc(sizeof(uv_buf_t));
-		memset(buf, 0, sizeof(uv_buf_t));
-
-		*buf    = uv_buf_init(message, strlen(message));
-		req->data = (void *)buf;
-		// narc_udp_client *client = (narc_udp_client *)server.client;
-		uv_udp_send(req, &client->socket, buf, 1, (struct sockaddr *)&client->send_addr, handle_udp_send);
+		uv_buf_t buf = uv_buf_init(message->data, len-1);
+		struct sockaddr *dest = udp_send_addr(client);
+
+		req->data = (void *)message;
+		if (dest == NULL || uv_udp_send(req, &client->socket, &buf, 1, dest, handle_udp_send) != 0) {
+			output->write_errors++;
+			free_message(message);
+			free(req);
+			return NARC_ERR;
+		}
+		output->write_calls++;
+		output->write_messages++;
+		output_wrote(output, buf.len);
+		return NARC_OK;
 	} else {
-		sdsfree(message);
+		output->dropped++;
+		free_message(message);
+		return NARC_ERR;
 	}
 }
@@ -27,6 +27,9 @@
 #define NARC_UDP 
 
 #include "narc.h"
+#include "output.h"
+#include "compress.h"
+#include "resolver.h"
 #include "sds.h"	/* dynamic safe strings */
 
 #include <uv.h>		/* Event driven programming library */
@@ -34,15 +37,31 @@
 /* connection states */
 #define NARC_UDP_INITIALIZED	0
 #define NARC_UDP_BOUND			1
+#define NARC_UDP_CLOSED			2	/* cleaned, never bound again */
+
+#define NARC_UDP_MAX_PAYLOAD	65507	/* largest udp payload over ipv4 */
 /*-----------------------------------------------------------------------------
  * Data types
  *----------------------------------------------------------------------------*/
 
+/* messages packed into one datagram, freed once it was sent */
+typedef struct {
+	uv_udp_send_t	req;
+	int		count;		/* messages in the datagram */
+	size_t		len;		/* payload bytes */
+	sds		compressed;	/* the payload as a zstd frame, NULL if not compressed */
+	narc_message	*messages[];
+} narc_udp_packet;
+
 typedef struct {
 	int 		state;		/* connection state */
 	uv_udp_t 	socket;	/* udp socket */
-	uv_getaddrinfo_t resolver;
-	struct sockaddr_in send_addr;
+	int		family;		/* address family of the socket */
+	narc_udp_packet	*packet;	/* datagram being filled, when packing */
+	int		packet_size;	/* messages a packet has room for */
+	uv_timer_t	*linger_timer;	/* sends a partly filled packet */
+	narc_compressor	*compressor;	/* NULL unless the datagrams are compressed */
+	narc_output	*output;	/* output the client sends for */
 } narc_udp_client;
 
 /*-----------------------------------------------------------------------------
@@ -52,8 +71,9 @@ typedef struct {
 /* watchers */
 
 /* api */
-void	init_udp_client(void);
-void	clean_udp_client(void);
-void 	submit_udp_message(char *message);
+void	init_udp_client(narc_output *output);
+void	clean_udp_client(narc_output *output);
+int 	submit_udp_message(narc_output *output, narc_message *message);
+size_t	udp_client_queue_bytes(narc_output *output);
 
 #endif
@@ -380,6 +380,24 @@ int pathIsBaseName(char *path) {
     return strchr(path,'/') == NULL && strchr(path,'\\') == NULL;
 }
 
+/* Return the resident set size of the process in bytes, or 0 when the
+ * platform gives no cheap way to read it. */
+size_t getRSS(void) {
+#if defined(__linux__)
+    char buf[64];
+    FILE *fp = fopen("/proc/self/statm","r");
+    long pages = 0;
+
+    if (!fp) return 0;
+    if (fgets(buf,sizeof(buf),fp) != NULL)
+        sscanf(buf,"%*s %ld",&pages);
+    fclose(fp);
+    return (size_t)pages * sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
 #ifdef UTIL_TEST_MAIN
 #include <assert.h>
 
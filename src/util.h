@@ -40,5 +40,6 @@ int string2ll(const char *s, size_t slen, long long *value);
 int string2l(const char *s, size_t slen, long *value);
 sds getAbsolutePath(char *filename);
 int pathIsBaseName(char *path);
+size_t getRSS(void);
 
 #endif